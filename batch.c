@@ -0,0 +1,1096 @@
+/* Sonic library
+   Copyright 2026
+   Bill Cox
+   This file is part of the Sonic Library.
+
+   This file is licensed under the Apache 2.0 license.
+*/
+
+/* clock_gettime is POSIX, not ANSI C. */
+#define _POSIX_C_SOURCE 199309L
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "sonic.h"
+
+/* Segments of a long job overlap by 1/CROSSFADE_FREQ seconds. */
+#define CROSSFADE_FREQ 100
+
+struct sonicBatchStruct {
+  pthread_t* threads;
+  /* One stream per thread.  Stream 0 belongs to the caller's thread. */
+  sonicStream* streams;
+  pthread_mutex_t mutex;
+  pthread_cond_t workReady;
+  pthread_cond_t workDone;
+  sonicBatchJob* jobs;
+  /* The pitch marks the jobs share, if any, or the marks to record for each
+     job instead of running it. */
+  sonicPitchMarks pitchMarks;
+  sonicPitchMarks* recordMarks;
+  int numJobs;
+  int nextJob;
+  int numThreads;
+  int numBusyThreads;
+  int generation;
+  int shutdown;
+  int failed;
+};
+
+struct sonicStreamPoolStruct {
+  pthread_mutex_t mutex;
+  sonicStream* streams;
+  int numStreams;
+  int allocatedStreams;
+};
+
+/* A single producer, single consumer queue of samples.  Each count is only
+   changed by one side, and the size is a power of two, so the counts can wrap
+   around. */
+typedef struct {
+  short* samples;
+  unsigned long mask;
+  unsigned long writeCount;
+  unsigned long readCount;
+} sonicQueue;
+
+/* The worker feeds the stream at most this many samples at a time, so what
+   the stream buffers stays small. */
+#define THREADED_CHUNK_SAMPLES 1024
+/* The most flushes that can wait for the worker at once. */
+#define THREADED_MAX_FLUSHES 8
+
+struct sonicThreadedStreamStruct {
+  sonicStream stream;
+  pthread_t thread;
+  /* The mutex and conditions are only used by the producer and the worker,
+     never by the consumer. */
+  pthread_mutex_t mutex;
+  pthread_cond_t inputReady;
+  pthread_cond_t spaceReady;
+  sonicQueue input;
+  sonicQueue output;
+  int numChannels;
+  /* How long the worker sleeps when the output queue is full. */
+  struct timespec pollTime;
+  /* The latest value set for each SONIC_PARAM parameter. */
+  float paramValues[SONIC_NUM_PARAMS];
+  /* The parameters whose values are not applied yet, one bit per SONIC_PARAM
+     value. */
+  int changedParams;
+  /* A ring of the input counts to flush the stream at, oldest first. */
+  unsigned long flushCounts[THREADED_MAX_FLUSHES];
+  int firstFlush;
+  int numFlushes;
+  int shutdown;
+  int failed;
+};
+
+/* Each worker thread is given its batch and its index. */
+typedef struct {
+  sonicBatch batch;
+  int index;
+} sonicBatchWorker;
+
+/* Get the pitch range of the job, filling in the defaults. */
+static void getJobPitchRange(sonicBatchJob* job, int* minPitch,
+                             int* maxPitch) {
+  *minPitch = job->minPitch != 0 ? job->minPitch : SONIC_MIN_PITCH;
+  *maxPitch = job->maxPitch != 0 ? job->maxPitch : SONIC_MAX_PITCH;
+}
+
+/* Return a stream set up for the job, using pitchMarks, reusing the worker's
+   stream if it has one.  Return NULL if out of memory, or if the job's pitch
+   range is not valid. */
+static sonicStream getJobStream(sonicStream* streamPtr, sonicBatchJob* job,
+                                sonicPitchMarks pitchMarks) {
+  sonicStream stream = *streamPtr;
+  int minPitch, maxPitch;
+
+  if (stream == NULL) {
+    stream = sonicCreateStream(job->sampleRate, job->numChannels);
+    *streamPtr = stream;
+    if (stream == NULL) {
+      return NULL;
+    }
+  } else if (sonicGetSampleRate(stream) != job->sampleRate ||
+             sonicGetNumChannels(stream) != job->numChannels) {
+    /* sonicSetSampleRate destroys the stream if it runs out of memory, so
+       just start over. */
+    sonicDestroyStream(stream);
+    stream = sonicCreateStream(job->sampleRate, job->numChannels);
+    *streamPtr = stream;
+    if (stream == NULL) {
+      return NULL;
+    }
+  }
+  getJobPitchRange(job, &minPitch, &maxPitch);
+  /* This also resets the stream. */
+  if (!sonicSetPitchRange(stream, minPitch, maxPitch)) {
+    return NULL;
+  }
+  sonicSetSpeed(stream, job->speed);
+  sonicSetPitch(stream, job->pitch);
+  sonicSetRate(stream, job->rate);
+  sonicSetVolume(stream, job->volume);
+  sonicSetChordPitch(stream, job->useChordPitch);
+  sonicSetQuality(stream, job->quality);
+  sonicSetPitchMethod(stream, job->pitchMethod);
+  sonicSetPitchTracking(stream, job->pitchTracking);
+  sonicSetPitchMarks(stream, pitchMarks);
+  return stream;
+}
+
+/* Process one job, or just record its pitch marks in recordMarks if that is
+   not NULL.  Return 0 if out of memory. */
+static int runJob(sonicStream* streamPtr, sonicBatchJob* job,
+                  sonicPitchMarks pitchMarks, sonicPitchMarks recordMarks) {
+  sonicStream stream = getJobStream(streamPtr, job, pitchMarks);
+  sonicSample* samples;
+  int numSamples, succeeded;
+
+  job->numOutputSamples = 0;
+  if (stream == NULL) {
+    return 0;
+  }
+  if (recordMarks != NULL) {
+    sonicRecordPitchMarks(stream, recordMarks);
+    succeeded =
+        sonicWriteShortToStream(stream, job->samples, job->numSamples) &&
+        sonicFlushStream(stream);
+    sonicSetPitchMarks(stream, NULL);
+    return succeeded;
+  }
+  if (!sonicWriteShortToStream(stream, job->samples, job->numSamples) ||
+      !sonicFlushStream(stream)) {
+    return 0;
+  }
+  job->numOutputSamples = sonicSamplesAvailable(stream);
+  sonicReadShortFromStream(stream, job->output, job->maxOutputSamples);
+  /* Drop whatever did not fit. */
+  numSamples = sonicPeekOutput(stream, &samples);
+  sonicConsumeOutput(stream, numSamples);
+  return 1;
+}
+
+/* Run jobs until there are none left. */
+static void runJobs(sonicBatch batch, int index) {
+  sonicBatchJob* job;
+  int failed;
+
+  while (1) {
+    pthread_mutex_lock(&batch->mutex);
+    if (batch->nextJob >= batch->numJobs) {
+      pthread_mutex_unlock(&batch->mutex);
+      return;
+    }
+    job = batch->jobs + batch->nextJob++;
+    pthread_mutex_unlock(&batch->mutex);
+    failed = !runJob(batch->streams + index, job, batch->pitchMarks,
+                     batch->recordMarks == NULL
+                         ? NULL
+                         : batch->recordMarks[job - batch->jobs]);
+    if (failed) {
+      pthread_mutex_lock(&batch->mutex);
+      batch->failed = 1;
+      pthread_mutex_unlock(&batch->mutex);
+    }
+  }
+}
+
+/* The main loop of the worker threads. */
+static void* runWorker(void* arg) {
+  sonicBatchWorker* worker = (sonicBatchWorker*)arg;
+  sonicBatch batch = worker->batch;
+  int index = worker->index;
+  int generation = 0;
+
+  free(worker);
+  pthread_mutex_lock(&batch->mutex);
+  while (1) {
+    while (!batch->shutdown && batch->generation == generation) {
+      pthread_cond_wait(&batch->workReady, &batch->mutex);
+    }
+    if (batch->shutdown) {
+      pthread_mutex_unlock(&batch->mutex);
+      return NULL;
+    }
+    generation = batch->generation;
+    pthread_mutex_unlock(&batch->mutex);
+    runJobs(batch, index);
+    pthread_mutex_lock(&batch->mutex);
+    if (--batch->numBusyThreads == 0) {
+      pthread_cond_signal(&batch->workDone);
+    }
+  }
+}
+
+/* Stop the first numThreads - 1 worker threads, and free the batch. */
+static void stopBatch(sonicBatch batch, int numThreads) {
+  int i;
+
+  pthread_mutex_lock(&batch->mutex);
+  batch->shutdown = 1;
+  pthread_cond_broadcast(&batch->workReady);
+  pthread_mutex_unlock(&batch->mutex);
+  for (i = 1; i < numThreads; i++) {
+    pthread_join(batch->threads[i], NULL);
+  }
+  for (i = 0; i < batch->numThreads; i++) {
+    if (batch->streams[i] != NULL) {
+      sonicDestroyStream(batch->streams[i]);
+    }
+  }
+  pthread_cond_destroy(&batch->workDone);
+  pthread_cond_destroy(&batch->workReady);
+  pthread_mutex_destroy(&batch->mutex);
+  free(batch->streams);
+  free(batch->threads);
+  free(batch);
+}
+
+/* Create a batch processor with numThreads threads, including the thread that
+   calls sonicProcessBatch.  Return NULL if out of memory or if threads cannot
+   be created. */
+sonicBatch sonicCreateBatch(int numThreads) {
+  sonicBatch batch;
+  sonicBatchWorker* worker;
+  int i;
+
+  if (numThreads < 1) {
+    numThreads = 1;
+  }
+  batch = (sonicBatch)calloc(1, sizeof(struct sonicBatchStruct));
+  if (batch == NULL) {
+    return NULL;
+  }
+  batch->numThreads = numThreads;
+  batch->threads = (pthread_t*)calloc(numThreads, sizeof(pthread_t));
+  batch->streams = (sonicStream*)calloc(numThreads, sizeof(sonicStream));
+  if (batch->threads == NULL || batch->streams == NULL) {
+    free(batch->threads);
+    free(batch->streams);
+    free(batch);
+    return NULL;
+  }
+  pthread_mutex_init(&batch->mutex, NULL);
+  pthread_cond_init(&batch->workReady, NULL);
+  pthread_cond_init(&batch->workDone, NULL);
+  for (i = 1; i < numThreads; i++) {
+    worker = (sonicBatchWorker*)malloc(sizeof(sonicBatchWorker));
+    if (worker == NULL) {
+      stopBatch(batch, i);
+      return NULL;
+    }
+    worker->batch = batch;
+    worker->index = i;
+    if (pthread_create(batch->threads + i, NULL, runWorker, worker) != 0) {
+      free(worker);
+      stopBatch(batch, i);
+      return NULL;
+    }
+  }
+  return batch;
+}
+
+/* Destroy the batch processor, stopping its threads. */
+void sonicDestroyBatch(sonicBatch batch) {
+  stopBatch(batch, batch->numThreads);
+}
+
+/* Run numJobs jobs, and return when they are all done.  Return 0 if any job
+   ran out of memory, otherwise 1. */
+int sonicProcessBatch(sonicBatch batch, sonicBatchJob* jobs, int numJobs) {
+  int failed;
+
+  pthread_mutex_lock(&batch->mutex);
+  batch->jobs = jobs;
+  batch->numJobs = numJobs;
+  batch->nextJob = 0;
+  batch->failed = 0;
+  batch->numBusyThreads = batch->numThreads - 1;
+  batch->generation++;
+  pthread_cond_broadcast(&batch->workReady);
+  pthread_mutex_unlock(&batch->mutex);
+  runJobs(batch, 0);
+  pthread_mutex_lock(&batch->mutex);
+  while (batch->numBusyThreads > 0) {
+    pthread_cond_wait(&batch->workDone, &batch->mutex);
+  }
+  failed = batch->failed;
+  batch->jobs = NULL;
+  batch->numJobs = 0;
+  pthread_mutex_unlock(&batch->mutex);
+  return !failed;
+}
+
+/* Return the middle of the quietest window of windowSize samples between start
+   and end.  Windows overlap by half. */
+static int findQuietPoint(short* samples, int numChannels, int start, int end,
+                          int windowSize) {
+  long energy, minEnergy = -1;
+  int i, j, bestStart = start;
+  short* p;
+
+  for (i = start; i + windowSize <= end; i += windowSize >> 1) {
+    energy = 0;
+    p = samples + i * numChannels;
+    for (j = 0; j < windowSize * numChannels; j++) {
+      energy += p[j] >= 0 ? p[j] : -p[j];
+    }
+    if (minEnergy < 0 || energy < minEnergy) {
+      minEnergy = energy;
+      bestStart = i;
+    }
+  }
+  return bestStart + (windowSize >> 1);
+}
+
+/* Return the cut nearest position that lies between two pulses of the pitch
+   period there: the middle of the quietest quarter of the period centred on
+   position.  The period is found with the stream's own pitch search.  Return
+   position if no period can be found. */
+static int snapToPitchPeriod(sonicStream stream, short* samples,
+                             int numSamples, int numChannels, int position,
+                             int maxPeriod) {
+  long energy, minEnergy;
+  int start = position - maxPeriod;
+  int period, windowSize, end, i, j, best;
+  short* p;
+
+  if (start > numSamples - 2 * maxPeriod) {
+    start = numSamples - 2 * maxPeriod;
+  }
+  if (start < 0) {
+    start = 0;
+  }
+  period = sonicFindPitchPeriod(stream, samples + start * numChannels,
+                                numSamples - start);
+  windowSize = period >> 2;
+  if (windowSize < 1) {
+    return position;
+  }
+  start = position - (period >> 1);
+  end = start + period;
+  if (start < 0) {
+    start = 0;
+  }
+  if (end > numSamples) {
+    end = numSamples;
+  }
+  if (end - start < windowSize) {
+    return position;
+  }
+  energy = 0;
+  p = samples + start * numChannels;
+  for (j = 0; j < windowSize * numChannels; j++) {
+    energy += p[j] >= 0 ? p[j] : -p[j];
+  }
+  minEnergy = energy;
+  best = start;
+  for (i = start + 1; i + windowSize <= end; i++) {
+    p = samples + (i - 1) * numChannels;
+    for (j = 0; j < numChannels; j++) {
+      energy -= p[j] >= 0 ? p[j] : -p[j];
+      energy += p[windowSize * numChannels + j] >= 0
+                    ? p[windowSize * numChannels + j]
+                    : -p[windowSize * numChannels + j];
+    }
+    if (energy < minEnergy) {
+      minEnergy = energy;
+      best = i;
+    }
+  }
+  return best + (windowSize >> 1);
+}
+
+/* Append the output of one segment to the job's output.  The first fadeLength
+   samples are crossfaded with the last fadeLength samples already there.
+   Return the new number of output samples, which counts samples that did not
+   fit. */
+static int joinSegment(sonicBatchJob* job, sonicBatchJob* segment,
+                       int numOutputSamples, int fadeLength) {
+  int numChannels = job->numChannels;
+  int start, numSamples, i, j;
+  short* out;
+  short* in = segment->output;
+
+  if (fadeLength > numOutputSamples) {
+    fadeLength = numOutputSamples;
+  }
+  if (fadeLength > segment->numOutputSamples) {
+    fadeLength = segment->numOutputSamples;
+  }
+  start = numOutputSamples - fadeLength;
+  numSamples = segment->numOutputSamples;
+  if (numSamples > job->maxOutputSamples - start) {
+    numSamples = job->maxOutputSamples - start;
+  }
+  out = job->output + start * numChannels;
+  for (i = 0; i < numSamples; i++) {
+    for (j = 0; j < numChannels; j++) {
+      if (i < fadeLength) {
+        *out = (*out * (fadeLength - i) + *in * i) / fadeLength;
+      } else {
+        *out = *in;
+      }
+      out++;
+      in++;
+    }
+  }
+  return start + segment->numOutputSamples;
+}
+
+/* Run one long job on all of the batch's threads, by cutting it into segments
+   at quiet points.  Return 0 if out of memory, otherwise 1. */
+int sonicProcessLongJob(sonicBatch batch, sonicBatchJob* job,
+                        int segmentSamples) {
+  sonicBatchJob* segments;
+  sonicStream stream = NULL;
+  /* Chord pitch ignores the rate. */
+  double lengthRatio =
+      1.0 / (job->useChordPitch ? job->speed : job->speed * job->rate);
+  int numChannels = job->numChannels;
+  int overlap = job->sampleRate / CROSSFADE_FREQ;
+  int numSegments, numOutputSamples = 0, start, end, fadeLength, i;
+  int minPitch, maxPitch, windowSize;
+  int succeeded = 1;
+
+  if (segmentSamples < job->sampleRate) {
+    segmentSamples = job->sampleRate;
+  }
+  numSegments = (job->numSamples + (segmentSamples >> 1)) / segmentSamples;
+  if (numSegments <= 1) {
+    return sonicProcessBatch(batch, job, 1);
+  }
+  /* The cuts are found with a stream set up like the segments' streams. */
+  segments = (sonicBatchJob*)calloc(numSegments, sizeof(sonicBatchJob));
+  if (segments == NULL || getJobStream(&stream, job, NULL) == NULL) {
+    free(segments);
+    if (stream != NULL) {
+      sonicDestroyStream(stream);
+    }
+    return 0;
+  }
+  /* Quiet windows are as long as the longest pitch period searched for. */
+  getJobPitchRange(job, &minPitch, &maxPitch);
+  windowSize = job->sampleRate / minPitch;
+  if (windowSize < 2) {
+    windowSize = 2;
+  }
+  start = 0;
+  for (i = 0; i < numSegments; i++) {
+    if (i == numSegments - 1) {
+      end = job->numSamples;
+    } else {
+      /* Search a quarter of a segment either side of the even cut. */
+      end = (i + 1) * segmentSamples;
+      end = findQuietPoint(job->samples, numChannels,
+                           end - (segmentSamples >> 2),
+                           end + (segmentSamples >> 2), windowSize);
+      end = snapToPitchPeriod(stream, job->samples, job->numSamples,
+                              numChannels, end, windowSize);
+    }
+    segments[i] = *job;
+    segments[i].samples = job->samples + start * numChannels;
+    segments[i].numSamples = end - start;
+    if (i < numSegments - 1) {
+      segments[i].numSamples += overlap;
+    }
+    /* A guess with plenty of room.  Segments that overflow are rerun. */
+    segments[i].maxOutputSamples =
+        (int)(segments[i].numSamples * lengthRatio * 1.25) + 4 * windowSize;
+    segments[i].output = (short*)malloc(segments[i].maxOutputSamples *
+                                        sizeof(short) * numChannels);
+    if (segments[i].output == NULL) {
+      succeeded = 0;
+    }
+    start = end;
+  }
+  sonicDestroyStream(stream);
+  if (succeeded) {
+    succeeded = sonicProcessBatch(batch, segments, numSegments);
+  }
+  for (i = 0; i < numSegments && succeeded; i++) {
+    if (segments[i].numOutputSamples > segments[i].maxOutputSamples) {
+      free(segments[i].output);
+      segments[i].maxOutputSamples = segments[i].numOutputSamples;
+      segments[i].output = (short*)malloc(segments[i].maxOutputSamples *
+                                          sizeof(short) * numChannels);
+      succeeded = segments[i].output != NULL &&
+                  sonicProcessBatch(batch, segments + i, 1);
+    }
+    if (succeeded) {
+      /* Fade over the output made from the overlap of the previous segment. */
+      fadeLength = 0;
+      if (i > 0) {
+        fadeLength = (int)((double)overlap * segments[i - 1].numOutputSamples /
+                               segments[i - 1].numSamples + 0.5);
+      }
+      numOutputSamples =
+          joinSegment(job, segments + i, numOutputSamples, fadeLength);
+    }
+  }
+  job->numOutputSamples = numOutputSamples;
+  for (i = 0; i < numSegments; i++) {
+    free(segments[i].output);
+  }
+  free(segments);
+  return succeeded;
+}
+
+/* Find the pitch marks of the job's input on all of the batch's threads.
+   Each thread records the marks of a segment at least a second long, and
+   they are joined, dropping any each segment found in the silence it was
+   flushed with.  Return NULL if out of memory. */
+static sonicPitchMarks findPitchMarks(sonicBatch batch, sonicBatchJob* job) {
+  sonicPitchMarks pitchMarks = sonicCreatePitchMarks(job->sampleRate);
+  sonicPitchMarks* segmentMarks;
+  sonicBatchJob* segments;
+  long position;
+  int numSegments = batch->numThreads;
+  int segmentSamples, period, minDiff, maxDiff, i, j;
+  int succeeded = pitchMarks != NULL;
+
+  if (numSegments > job->numSamples / job->sampleRate) {
+    numSegments = job->numSamples / job->sampleRate;
+  }
+  if (numSegments < 1) {
+    numSegments = 1;
+  }
+  segmentSamples = (job->numSamples + numSegments - 1) / numSegments;
+  segments = (sonicBatchJob*)calloc(numSegments, sizeof(sonicBatchJob));
+  segmentMarks = (sonicPitchMarks*)calloc(numSegments, sizeof(sonicPitchMarks));
+  if (segments == NULL || segmentMarks == NULL) {
+    succeeded = 0;
+  }
+  for (i = 0; i < numSegments && succeeded; i++) {
+    segments[i] = *job;
+    segments[i].samples = job->samples + (long)i * segmentSamples *
+                                             job->numChannels;
+    segments[i].numSamples = job->numSamples - i * segmentSamples;
+    if (segments[i].numSamples > segmentSamples) {
+      segments[i].numSamples = segmentSamples;
+    }
+    segmentMarks[i] = sonicCreatePitchMarks(job->sampleRate);
+    succeeded = segmentMarks[i] != NULL;
+  }
+  if (succeeded) {
+    batch->recordMarks = segmentMarks;
+    succeeded = sonicProcessBatch(batch, segments, numSegments);
+    batch->recordMarks = NULL;
+  }
+  for (i = 0; i < numSegments && succeeded; i++) {
+    for (j = 0; j < sonicGetNumPitchMarks(segmentMarks[i]) && succeeded;
+         j++) {
+      sonicGetPitchMark(segmentMarks[i], j, &position, &period, &minDiff,
+                        &maxDiff);
+      if (position >= segments[i].numSamples) {
+        break;
+      }
+      succeeded = sonicAddPitchMark(pitchMarks,
+                                    position + (long)i * segmentSamples,
+                                    period, minDiff, maxDiff);
+    }
+  }
+  for (i = 0; segmentMarks != NULL && i < numSegments; i++) {
+    sonicDestroyPitchMarks(segmentMarks[i]);
+  }
+  free(segmentMarks);
+  free(segments);
+  if (!succeeded) {
+    sonicDestroyPitchMarks(pitchMarks);
+    return NULL;
+  }
+  return pitchMarks;
+}
+
+/* Run variants of the same input, sharing the pitch periods found for it.
+   Return 0 if out of memory, otherwise 1. */
+int sonicProcessFanout(sonicBatch batch, sonicBatchJob* jobs, int numJobs) {
+  sonicPitchMarks pitchMarks;
+  int succeeded;
+
+  if (numJobs <= 0) {
+    return 1;
+  }
+  pitchMarks = findPitchMarks(batch, jobs);
+  if (pitchMarks == NULL) {
+    return 0;
+  }
+  batch->pitchMarks = pitchMarks;
+  succeeded = sonicProcessBatch(batch, jobs, numJobs);
+  batch->pitchMarks = NULL;
+  sonicDestroyPitchMarks(pitchMarks);
+  return succeeded;
+}
+
+/* Create an empty stream pool.  Return NULL if out of memory. */
+sonicStreamPool sonicCreateStreamPool(void) {
+  sonicStreamPool pool =
+      (sonicStreamPool)calloc(1, sizeof(struct sonicStreamPoolStruct));
+
+  if (pool == NULL) {
+    return NULL;
+  }
+  pthread_mutex_init(&pool->mutex, NULL);
+  return pool;
+}
+
+/* Destroy the pool and the streams in it. */
+void sonicDestroyStreamPool(sonicStreamPool pool) {
+  int i;
+
+  for (i = 0; i < pool->numStreams; i++) {
+    sonicDestroyStream(pool->streams[i]);
+  }
+  pthread_mutex_destroy(&pool->mutex);
+  free(pool->streams);
+  free(pool);
+}
+
+/* Create numStreams streams in the pool ahead of time.  Return 0 if out of
+   memory. */
+int sonicPrewarmStreamPool(sonicStreamPool pool, int sampleRate,
+                           int numChannels, int numStreams) {
+  sonicStream stream;
+
+  while (numStreams-- > 0) {
+    stream = sonicCreateStream(sampleRate, numChannels);
+    if (stream == NULL) {
+      return 0;
+    }
+    sonicReleasePooledStream(pool, stream);
+  }
+  return 1;
+}
+
+/* Return a stream from the pool with the given sample rate and number of
+   channels, or a new one if there is none.  Return NULL if out of memory. */
+sonicStream sonicGetPooledStream(sonicStreamPool pool, int sampleRate,
+                                 int numChannels) {
+  sonicStream stream = NULL;
+  int i;
+
+  pthread_mutex_lock(&pool->mutex);
+  /* Take the most recently released match, which is most likely cached. */
+  for (i = pool->numStreams - 1; i >= 0; i--) {
+    if (sonicGetSampleRate(pool->streams[i]) == sampleRate &&
+        sonicGetNumChannels(pool->streams[i]) == numChannels) {
+      stream = pool->streams[i];
+      pool->streams[i] = pool->streams[--pool->numStreams];
+      break;
+    }
+  }
+  pthread_mutex_unlock(&pool->mutex);
+  if (stream == NULL) {
+    return sonicCreateStream(sampleRate, numChannels);
+  }
+  sonicSetSpeed(stream, 1.0f);
+  sonicSetPitch(stream, 1.0f);
+  sonicSetRate(stream, 1.0f);
+  sonicSetVolume(stream, 1.0f);
+  sonicSetChordPitch(stream, 0);
+  sonicSetQuality(stream, 0);
+  sonicSetPitchMethod(stream, SONIC_PITCH_AMDF);
+  sonicSetNonlinearSpeedup(stream, 0);
+  sonicSetPitchTracking(stream, 0);
+  sonicSetLowLatency(stream, 0);
+  sonicSetAmdfFreq(stream, SONIC_AMDF_FREQ);
+  sonicSetFixedCapacity(stream, 0, 0);
+  sonicSetPitchChannelMask(stream, 0);
+  sonicSetPitchMarks(stream, NULL);
+  return stream;
+}
+
+/* Give a stream back to the pool, which then owns it. */
+void sonicReleasePooledStream(sonicStreamPool pool, sonicStream stream) {
+  sonicStream* streams;
+  int allocatedStreams;
+
+  /* This also resets the stream.  If it runs out of memory, the stream keeps
+     its own range, and is not worth keeping. */
+  if (!sonicSetPitchRange(stream, SONIC_MIN_PITCH, SONIC_MAX_PITCH)) {
+    sonicDestroyStream(stream);
+    return;
+  }
+  pthread_mutex_lock(&pool->mutex);
+  if (pool->numStreams == pool->allocatedStreams) {
+    allocatedStreams = pool->allocatedStreams * 2 + 8;
+    streams = (sonicStream*)realloc(pool->streams,
+                                    allocatedStreams * sizeof(sonicStream));
+    if (streams == NULL) {
+      /* Not worth keeping it if we cannot remember it. */
+      pthread_mutex_unlock(&pool->mutex);
+      sonicDestroyStream(stream);
+      return;
+    }
+    pool->streams = streams;
+    pool->allocatedStreams = allocatedStreams;
+  }
+  pool->streams[pool->numStreams++] = stream;
+  pthread_mutex_unlock(&pool->mutex);
+}
+
+/* The queue counts are shared between threads without a lock.  Reading the
+   other side's count acquires the samples it wrote or freed, and changing our
+   own releases ours. */
+#define loadCount(count) __atomic_load_n(&(count), __ATOMIC_ACQUIRE)
+#define storeCount(count, value) \
+  __atomic_store_n(&(count), value, __ATOMIC_RELEASE)
+
+/* Allocate a queue of at least numSamples samples.  Return 0 if out of
+   memory. */
+static int createQueue(sonicQueue* queue, int numSamples, int numChannels) {
+  unsigned long size = 1;
+
+  while (size < (unsigned long)numSamples) {
+    size <<= 1;
+  }
+  queue->samples = (short*)malloc(size * numChannels * sizeof(short));
+  queue->mask = size - 1;
+  queue->writeCount = 0;
+  queue->readCount = 0;
+  return queue->samples != NULL;
+}
+
+/* Return how many samples can be read from the queue. */
+static int getQueueSamples(sonicQueue* queue, int producer) {
+  if (producer) {
+    return (int)(queue->writeCount - loadCount(queue->readCount));
+  }
+  return (int)(loadCount(queue->writeCount) - queue->readCount);
+}
+
+/* Copy up to numSamples samples into the queue.  Only the producer may call
+   this.  Return the number copied. */
+static int writeQueue(sonicQueue* queue, short* samples, int numSamples,
+                      int numChannels) {
+  int space = (int)(queue->mask + 1) - getQueueSamples(queue, 1);
+  int start = (int)(queue->writeCount & queue->mask);
+  int first;
+
+  if (numSamples > space) {
+    numSamples = space;
+  }
+  first = (int)(queue->mask + 1) - start;
+  if (first > numSamples) {
+    first = numSamples;
+  }
+  memcpy(queue->samples + start * numChannels, samples,
+         first * numChannels * sizeof(short));
+  memcpy(queue->samples, samples + first * numChannels,
+         (numSamples - first) * numChannels * sizeof(short));
+  storeCount(queue->writeCount, queue->writeCount + numSamples);
+  return numSamples;
+}
+
+/* Copy up to maxSamples samples out of the queue.  Only the consumer may call
+   this.  Return the number copied. */
+static int readQueue(sonicQueue* queue, short* samples, int maxSamples,
+                     int numChannels) {
+  int numSamples = getQueueSamples(queue, 0);
+  int start = (int)(queue->readCount & queue->mask);
+  int first;
+
+  if (numSamples > maxSamples) {
+    numSamples = maxSamples;
+  }
+  first = (int)(queue->mask + 1) - start;
+  if (first > numSamples) {
+    first = numSamples;
+  }
+  memcpy(samples, queue->samples + start * numChannels,
+         first * numChannels * sizeof(short));
+  memcpy(samples + first * numChannels, queue->samples,
+         (numSamples - first) * numChannels * sizeof(short));
+  storeCount(queue->readCount, queue->readCount + numSamples);
+  return numSamples;
+}
+
+/* Move the stream's output into the output queue, without wrapping around
+   in one read.  Return the number of samples moved. */
+static int drainStream(sonicThreadedStream threaded) {
+  sonicQueue* queue = &threaded->output;
+  int size = (int)(queue->mask + 1);
+  int start, numSamples, total = 0;
+
+  while (sonicSamplesAvailable(threaded->stream) > 0) {
+    start = (int)(queue->writeCount & queue->mask);
+    numSamples = size - getQueueSamples(queue, 1);
+    if (numSamples > size - start) {
+      numSamples = size - start;
+    }
+    if (numSamples == 0) {
+      break;
+    }
+    numSamples = sonicReadShortFromStream(
+        threaded->stream, queue->samples + start * threaded->numChannels,
+        numSamples);
+    storeCount(queue->writeCount, queue->writeCount + numSamples);
+    total += numSamples;
+  }
+  return total;
+}
+
+/* Apply the parameter changes from sonicSetThreadedParameter.  The mutex must
+   be held. */
+static void applyParameters(sonicThreadedStream threaded) {
+  sonicStream stream = threaded->stream;
+  float* values = threaded->paramValues;
+  int changed = threaded->changedParams;
+
+  if (changed & (1 << SONIC_PARAM_SPEED)) {
+    sonicSetSpeed(stream, values[SONIC_PARAM_SPEED]);
+  }
+  if (changed & (1 << SONIC_PARAM_PITCH)) {
+    sonicSetPitch(stream, values[SONIC_PARAM_PITCH]);
+  }
+  if (changed & (1 << SONIC_PARAM_RATE)) {
+    sonicSetRate(stream, values[SONIC_PARAM_RATE]);
+  }
+  if (changed & (1 << SONIC_PARAM_VOLUME)) {
+    sonicSetVolume(stream, values[SONIC_PARAM_VOLUME]);
+  }
+  threaded->changedParams = 0;
+}
+
+/* Feed the stream the next chunk of queued input, or flush it if a flush is
+   due.  Only the worker calls this, with the mutex released.  Return the
+   number of input samples used, or -1 if it flushed, or -2 if out of
+   memory. */
+static int feedStream(sonicThreadedStream threaded, int flushDue,
+                      unsigned long flushCount) {
+  sonicQueue* queue = &threaded->input;
+  int start = (int)(queue->readCount & queue->mask);
+  int numSamples = getQueueSamples(queue, 0);
+
+  if (flushDue && numSamples > (int)(flushCount - queue->readCount)) {
+    numSamples = (int)(flushCount - queue->readCount);
+  }
+  if (numSamples > (int)(queue->mask + 1) - start) {
+    numSamples = (int)(queue->mask + 1) - start;
+  }
+  if (numSamples > THREADED_CHUNK_SAMPLES) {
+    numSamples = THREADED_CHUNK_SAMPLES;
+  }
+  if (numSamples == 0) {
+    if (!flushDue || queue->readCount != flushCount) {
+      return 0;
+    }
+    return sonicFlushStream(threaded->stream) ? -1 : -2;
+  }
+  if (!sonicWriteShortToStream(threaded->stream,
+                               queue->samples + start * threaded->numChannels,
+                               numSamples)) {
+    return -2;
+  }
+  storeCount(queue->readCount, queue->readCount + numSamples);
+  return numSamples;
+}
+
+/* Return the time pollTime from now. */
+static struct timespec getWakeTime(sonicThreadedStream threaded) {
+  struct timespec time;
+
+  clock_gettime(CLOCK_REALTIME, &time);
+  time.tv_sec += threaded->pollTime.tv_sec;
+  time.tv_nsec += threaded->pollTime.tv_nsec;
+  if (time.tv_nsec >= 1000000000) {
+    time.tv_sec++;
+    time.tv_nsec -= 1000000000;
+  }
+  return time;
+}
+
+/* The main loop of a threaded stream's worker.  It only feeds the stream more
+   input once all of its output is in the output queue, so when the consumer
+   falls behind, the output queue fills, and then the input queue. */
+static void* runThreadedWorker(void* arg) {
+  sonicThreadedStream threaded = (sonicThreadedStream)arg;
+  struct timespec wakeTime;
+  unsigned long flushCount;
+  int flushDue, result, moved;
+
+  pthread_mutex_lock(&threaded->mutex);
+  while (!threaded->shutdown) {
+    applyParameters(threaded);
+    flushDue = threaded->numFlushes > 0;
+    flushCount = threaded->flushCounts[threaded->firstFlush];
+    pthread_mutex_unlock(&threaded->mutex);
+    moved = drainStream(threaded);
+    result = 0;
+    if (sonicSamplesAvailable(threaded->stream) == 0) {
+      result = feedStream(threaded, flushDue, flushCount);
+    }
+    pthread_mutex_lock(&threaded->mutex);
+    if (result == -2) {
+      threaded->failed = 1;
+      pthread_cond_broadcast(&threaded->spaceReady);
+      while (!threaded->shutdown) {
+        pthread_cond_wait(&threaded->inputReady, &threaded->mutex);
+      }
+    } else if (result == -1) {
+      threaded->firstFlush = (threaded->firstFlush + 1) % THREADED_MAX_FLUSHES;
+      threaded->numFlushes--;
+      pthread_cond_broadcast(&threaded->spaceReady);
+    } else if (result > 0) {
+      pthread_cond_broadcast(&threaded->spaceReady);
+    } else if (moved == 0 && !threaded->shutdown &&
+               threaded->changedParams == 0) {
+      if (sonicSamplesAvailable(threaded->stream) > 0) {
+        /* The consumer never signals, so check back for room. */
+        wakeTime = getWakeTime(threaded);
+        pthread_cond_timedwait(&threaded->inputReady, &threaded->mutex,
+                               &wakeTime);
+      } else if (getQueueSamples(&threaded->input, 0) == 0 &&
+                 threaded->numFlushes == 0) {
+        pthread_cond_wait(&threaded->inputReady, &threaded->mutex);
+      }
+    }
+  }
+  pthread_mutex_unlock(&threaded->mutex);
+  return NULL;
+}
+
+/* Run stream on its own worker thread, fed through a queue of inputSamples
+   samples, and read through a queue of outputSamples.  Return NULL if out of
+   memory, or if the thread cannot be created. */
+sonicThreadedStream sonicCreateThreadedStream(sonicStream stream,
+                                              int inputSamples,
+                                              int outputSamples) {
+  sonicThreadedStream threaded = (sonicThreadedStream)calloc(
+      1, sizeof(struct sonicThreadedStreamStruct));
+  double pollSeconds;
+
+  if (threaded == NULL) {
+    return NULL;
+  }
+  threaded->stream = stream;
+  threaded->numChannels = sonicGetNumChannels(stream);
+  if (!createQueue(&threaded->input, inputSamples, threaded->numChannels) ||
+      !createQueue(&threaded->output, outputSamples, threaded->numChannels)) {
+    free(threaded->input.samples);
+    free(threaded->output.samples);
+    free(threaded);
+    return NULL;
+  }
+  /* Check for room four times while the consumer drains a full queue. */
+  pollSeconds = (threaded->output.mask + 1) / 4.0 / sonicGetSampleRate(stream);
+  threaded->pollTime.tv_sec = (time_t)pollSeconds;
+  threaded->pollTime.tv_nsec =
+      (long)((pollSeconds - threaded->pollTime.tv_sec) * 1.0e9);
+  pthread_mutex_init(&threaded->mutex, NULL);
+  pthread_cond_init(&threaded->inputReady, NULL);
+  pthread_cond_init(&threaded->spaceReady, NULL);
+  if (pthread_create(&threaded->thread, NULL, runThreadedWorker, threaded) !=
+      0) {
+    pthread_cond_destroy(&threaded->spaceReady);
+    pthread_cond_destroy(&threaded->inputReady);
+    pthread_mutex_destroy(&threaded->mutex);
+    free(threaded->input.samples);
+    free(threaded->output.samples);
+    free(threaded);
+    return NULL;
+  }
+  return threaded;
+}
+
+/* Stop the worker, and free the queues.  The stream is not destroyed. */
+void sonicDestroyThreadedStream(sonicThreadedStream threaded) {
+  pthread_mutex_lock(&threaded->mutex);
+  threaded->shutdown = 1;
+  pthread_cond_signal(&threaded->inputReady);
+  pthread_mutex_unlock(&threaded->mutex);
+  pthread_join(threaded->thread, NULL);
+  pthread_cond_destroy(&threaded->spaceReady);
+  pthread_cond_destroy(&threaded->inputReady);
+  pthread_mutex_destroy(&threaded->mutex);
+  free(threaded->input.samples);
+  free(threaded->output.samples);
+  free(threaded);
+}
+
+/* Queue as many of the samples as fit, and wake the worker.  Return the
+   number queued. */
+int sonicWriteShortToThreadedStream(sonicThreadedStream threaded,
+                                    short* samples, int numSamples) {
+  numSamples =
+      writeQueue(&threaded->input, samples, numSamples, threaded->numChannels);
+  if (numSamples > 0) {
+    pthread_mutex_lock(&threaded->mutex);
+    pthread_cond_signal(&threaded->inputReady);
+    pthread_mutex_unlock(&threaded->mutex);
+  }
+  return numSamples;
+}
+
+/* Wait until the input queue has room for numSamples samples, or as many as
+   it holds.  Return 0 if the worker ran out of memory. */
+int sonicWaitForThreadedInputSpace(sonicThreadedStream threaded,
+                                   int numSamples) {
+  int size = (int)(threaded->input.mask + 1);
+  int failed;
+
+  if (numSamples > size) {
+    numSamples = size;
+  }
+  pthread_mutex_lock(&threaded->mutex);
+  while (!threaded->failed &&
+         size - getQueueSamples(&threaded->input, 1) < numSamples) {
+    pthread_cond_wait(&threaded->spaceReady, &threaded->mutex);
+  }
+  failed = threaded->failed;
+  pthread_mutex_unlock(&threaded->mutex);
+  return !failed;
+}
+
+/* Flush the stream once the worker has processed the input queued so far.
+   If THREADED_MAX_FLUSHES flushes are already waiting, wait for the worker to
+   do one.  Return 0 if the worker ran out of memory. */
+int sonicFlushThreadedStream(sonicThreadedStream threaded) {
+  int failed;
+
+  pthread_mutex_lock(&threaded->mutex);
+  while (!threaded->failed && threaded->numFlushes == THREADED_MAX_FLUSHES) {
+    pthread_cond_wait(&threaded->spaceReady, &threaded->mutex);
+  }
+  failed = threaded->failed;
+  if (!failed) {
+    threaded->flushCounts[(threaded->firstFlush + threaded->numFlushes) %
+                          THREADED_MAX_FLUSHES] = threaded->input.writeCount;
+    threaded->numFlushes++;
+    pthread_cond_signal(&threaded->inputReady);
+  }
+  pthread_mutex_unlock(&threaded->mutex);
+  return !failed;
+}
+
+/* Set parameter, one of the SONIC_PARAM values, before the worker processes
+   its next chunk of input. */
+void sonicSetThreadedParameter(sonicThreadedStream threaded, int parameter,
+                               float value) {
+  if (parameter < 0 || parameter >= SONIC_NUM_PARAMS) {
+    return;
+  }
+  pthread_mutex_lock(&threaded->mutex);
+  threaded->paramValues[parameter] = value;
+  threaded->changedParams |= 1 << parameter;
+  pthread_cond_signal(&threaded->inputReady);
+  pthread_mutex_unlock(&threaded->mutex);
+}
+
+/* Copy up to maxSamples processed samples to samples, without locking or
+   waiting.  Return the number copied. */
+int sonicReadShortFromThreadedStream(sonicThreadedStream threaded,
+                                     short* samples, int maxSamples) {
+  return readQueue(&threaded->output, samples, maxSamples,
+                   threaded->numChannels);
+}
+
+/* Return the number of processed samples waiting in the output queue. */
+int sonicThreadedSamplesAvailable(sonicThreadedStream threaded) {
+  return getQueueSamples(&threaded->output, 0);
+}
@@ -0,0 +1,254 @@
+/* Sonic library
+   Copyright 2026
+   Bill Cox
+   This file is part of the Sonic Library.
+
+   This file is licensed under the Apache 2.0 license.
+
+   This is a throughput benchmark for the sonic core.  It runs a fixed set of
+   configurations over synthetic speech-like input, and writes one CSV line per
+   configuration to stdout, so results from two builds can be diffed or
+   plotted.  Each configuration is run several times, and the fastest run is
+   reported.  The columns are:
+
+     sampleRate, numChannels, speed, pitch, rate, volume, chordPitch, quality:
+         the configuration.
+     inputSamples, outputSamples: samples per channel in and out.
+     seconds: wall time of the fastest run.
+     realTimeFactor: seconds of input audio processed per second of wall time.
+     nsPerSample: nanoseconds per input sample per channel.
+     changeSpeedNs, adjustPitchNs, adjustRateNs, scaleSamplesNs: nanoseconds
+         per input sample spent in each stage of the fastest run.  The read
+         calls apply the volume as they convert, so scaleSamplesNs is the time
+         spent reading output.
+
+   It must be built with SONIC_PROFILE defined, which "make bench" does. */
+
+/* clock_gettime is POSIX, not ANSI C. */
+#define _POSIX_C_SOURCE 199309L
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "sonic.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+#define BUFFER_SIZE 2048
+
+/* A set of stream parameters to benchmark. */
+typedef struct {
+  float speed;
+  float pitch;
+  float rate;
+  float volume;
+  int useChordPitch;
+  int quality;
+} benchConfig;
+
+static const int sampleRates[] = {8000, 16000, 44100, 48000};
+static const benchConfig configs[] = {
+    {1.0f, 1.0f, 1.0f, 1.0f, 0, 0},  {0.5f, 1.0f, 1.0f, 1.0f, 0, 0},
+    {0.8f, 1.0f, 1.0f, 1.0f, 0, 0},  {1.5f, 1.0f, 1.0f, 1.0f, 0, 0},
+    {2.0f, 1.0f, 1.0f, 1.0f, 0, 0},  {3.0f, 1.0f, 1.0f, 1.0f, 0, 0},
+    {2.0f, 1.0f, 1.0f, 1.0f, 0, 1},  {1.0f, 0.8f, 1.0f, 1.0f, 0, 0},
+    {1.0f, 1.25f, 1.0f, 1.0f, 0, 0}, {1.0f, 0.8f, 1.0f, 1.0f, 1, 0},
+    {1.0f, 1.25f, 1.0f, 1.0f, 1, 0}, {1.0f, 1.0f, 0.75f, 1.0f, 0, 0},
+    {1.0f, 1.0f, 1.5f, 1.0f, 0, 0},  {1.0f, 1.0f, 1.0f, 0.5f, 0, 0},
+    {2.0f, 1.25f, 1.5f, 0.5f, 0, 0}, {2.0f, 1.25f, 1.0f, 0.5f, 1, 1}};
+
+/* Return a monotonic time in seconds. */
+static double getTime(void) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec * 1.0e-9;
+}
+
+/* Fill samples with speech-like sound: a pulse train with a wandering pitch,
+   shaped by a few formant resonators, broken up by stretches of noise and
+   silence.  The same input is generated every time. */
+static void makeInput(short* samples, int numSamples, int sampleRate,
+                      int numChannels) {
+  static const double formants[3] = {700.0, 1200.0, 2600.0};
+  double state[3][2] = {{0.0}};
+  double coef[3][2];
+  double phase = 0.0, pitch, excitation, value, radius;
+  unsigned int seed = 1;
+  int i, j, k, segment, segmentLength = sampleRate / 5;
+
+  for (j = 0; j < 3; j++) {
+    radius = exp(-M_PI * 100.0 / sampleRate);
+    coef[j][0] = 2.0 * radius * cos(2.0 * M_PI * formants[j] / sampleRate);
+    coef[j][1] = -radius * radius;
+  }
+  for (i = 0; i < numSamples; i++) {
+    seed = seed * 1103515245 + 12345;
+    segment = (i / segmentLength) % 8;
+    pitch = 120.0 + 40.0 * sin(2.0 * M_PI * i / (3.0 * sampleRate));
+    phase += pitch / sampleRate;
+    excitation = 0.0;
+    if (segment < 5) {
+      /* Voiced. */
+      if (phase >= 1.0) {
+        phase -= 1.0;
+        excitation = 1.0;
+      }
+    } else if (segment < 7) {
+      /* Unvoiced. */
+      excitation = ((int)(seed >> 16 & 0x7fff) - 16384) / 65536.0;
+    }
+    value = 0.0;
+    for (j = 0; j < 3; j++) {
+      double out = excitation + coef[j][0] * state[j][0] +
+                   coef[j][1] * state[j][1];
+      state[j][1] = state[j][0];
+      state[j][0] = out;
+      value += out;
+    }
+    value *= 1500.0;
+    if (value > 32767.0) {
+      value = 32767.0;
+    } else if (value < -32768.0) {
+      value = -32768.0;
+    }
+    for (k = 0; k < numChannels; k++) {
+      /* Make the channels differ a little. */
+      samples[i * numChannels + k] = (short)(value / (k + 1));
+    }
+  }
+}
+
+/* Run one configuration over the input once.  Return the number of output
+   samples, and fill in the time spent in each stage. */
+static int runOnce(const benchConfig* config, short* input, int numSamples,
+                   int sampleRate, int numChannels, double* seconds,
+                   double* stageSeconds) {
+  sonicStream stream = sonicCreateStream(sampleRate, numChannels);
+  sonicStats stats;
+  short outBuffer[BUFFER_SIZE];
+  double start;
+  int i, numWrite, numOutputSamples = 0;
+  int bufferFrames = BUFFER_SIZE / numChannels;
+
+  if (stream == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    exit(1);
+  }
+  sonicSetSpeed(stream, config->speed);
+  sonicSetPitch(stream, config->pitch);
+  sonicSetRate(stream, config->rate);
+  sonicSetVolume(stream, config->volume);
+  sonicSetChordPitch(stream, config->useChordPitch);
+  sonicSetQuality(stream, config->quality);
+  start = getTime();
+  for (i = 0; i < numSamples; i += numWrite) {
+    numWrite = numSamples - i;
+    if (numWrite > bufferFrames) {
+      numWrite = bufferFrames;
+    }
+    sonicWriteShortToStream(stream, input + i * numChannels, numWrite);
+    numOutputSamples +=
+        sonicReadShortFromStream(stream, outBuffer, bufferFrames);
+  }
+  sonicFlushStream(stream);
+  do {
+    numWrite = sonicReadShortFromStream(stream, outBuffer, bufferFrames);
+    numOutputSamples += numWrite;
+  } while (numWrite > 0);
+  *seconds = getTime() - start;
+  sonicGetStats(stream, &stats);
+  memcpy(stageSeconds, stats.stageSeconds, sizeof(stats.stageSeconds));
+  sonicDestroyStream(stream);
+  return numOutputSamples;
+}
+
+/* Run one configuration numRuns times, and print the fastest run. */
+static void runConfig(const benchConfig* config, short* input, int numSamples,
+                      int sampleRate, int numChannels, int numRuns) {
+  double seconds, bestSeconds = 0.0, nsPerSample;
+  double stageSeconds[SONIC_NUM_STAGES], bestStageSeconds[SONIC_NUM_STAGES];
+  int i, run, numOutputSamples = 0;
+
+  for (run = 0; run < numRuns; run++) {
+    numOutputSamples = runOnce(config, input, numSamples, sampleRate,
+                               numChannels, &seconds, stageSeconds);
+    if (run == 0 || seconds < bestSeconds) {
+      bestSeconds = seconds;
+      memcpy(bestStageSeconds, stageSeconds, sizeof(stageSeconds));
+    }
+  }
+  nsPerSample = 1.0e9 / numSamples;
+  printf("%d,%d,%g,%g,%g,%g,%d,%d,%d,%d,%.6f,%.1f,%.2f", sampleRate,
+         numChannels, config->speed, config->pitch, config->rate,
+         config->volume, config->useChordPitch, config->quality, numSamples,
+         numOutputSamples, bestSeconds,
+         (double)numSamples / sampleRate / bestSeconds,
+         bestSeconds * nsPerSample);
+  for (i = 0; i < SONIC_NUM_STAGES; i++) {
+    printf(",%.2f", bestStageSeconds[i] * nsPerSample);
+  }
+  printf("\n");
+  fflush(stdout);
+}
+
+/* Print the usage. */
+static void usage(void) {
+  fprintf(stderr,
+          "Usage: sonicbench [OPTION]...\n"
+          "    -n runs     -- Run each configuration this many times, and "
+          "report the\n"
+          "                   fastest.  The default is 5.\n"
+          "    -t seconds  -- Seconds of input audio per run.  The default "
+          "is 10.\n");
+  exit(1);
+}
+
+int main(int argc, char** argv) {
+  double inputSeconds = 10.0;
+  int numRuns = 5;
+  int xArg = 1;
+  int numSampleRates = sizeof(sampleRates) / sizeof(sampleRates[0]);
+  int numConfigs = sizeof(configs) / sizeof(configs[0]);
+  int i, j, numChannels, numSamples;
+  short* input;
+
+  while (xArg < argc) {
+    if (!strcmp(argv[xArg], "-n") && xArg + 1 < argc) {
+      numRuns = atoi(argv[++xArg]);
+    } else if (!strcmp(argv[xArg], "-t") && xArg + 1 < argc) {
+      inputSeconds = atof(argv[++xArg]);
+    } else {
+      usage();
+    }
+    xArg++;
+  }
+  if (numRuns < 1 || inputSeconds <= 0.0) {
+    usage();
+  }
+  printf(
+      "sampleRate,numChannels,speed,pitch,rate,volume,chordPitch,quality,"
+      "inputSamples,outputSamples,seconds,realTimeFactor,nsPerSample,"
+      "changeSpeedNs,adjustPitchNs,adjustRateNs,scaleSamplesNs\n");
+  for (i = 0; i < numSampleRates; i++) {
+    for (numChannels = 1; numChannels <= 2; numChannels++) {
+      numSamples = (int)(inputSeconds * sampleRates[i]);
+      input = (short*)malloc(numSamples * numChannels * sizeof(short));
+      if (input == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+      }
+      makeInput(input, numSamples, sampleRates[i], numChannels);
+      for (j = 0; j < numConfigs; j++) {
+        runConfig(configs + j, input, numSamples, sampleRates[i],
+                  numChannels, numRuns);
+      }
+      free(input);
+    }
+  }
+  return 0;
+}
@@ -13,24 +13,118 @@
 
 #define BUFFER_SIZE 2048
 
-/* Run sonic. */
+/* Run 16-bit samples through the stream, and write the output if there is an
+   output file.  Memory mapped input is written straight to the stream. */
+static void processShortSamples(waveFile inFile, waveFile outFile,
+                                sonicStream stream, int numChannels) {
+  short inBuffer[BUFFER_SIZE], outBuffer[BUFFER_SIZE];
+  short *mappedSamples, *input;
+  int samplesRead, samplesWritten, numMappedSamples;
+  int maxSamples = BUFFER_SIZE / numChannels;
+
+  mappedSamples = getMappedWaveSamples(inFile, &numMappedSamples);
+  do {
+    if (mappedSamples != NULL) {
+      samplesRead =
+          numMappedSamples < maxSamples ? numMappedSamples : maxSamples;
+      input = mappedSamples;
+      mappedSamples += samplesRead * numChannels;
+      numMappedSamples -= samplesRead;
+    } else {
+      samplesRead = readFromWaveFile(inFile, inBuffer, maxSamples);
+      input = inBuffer;
+    }
+    if (samplesRead == 0) {
+      sonicFlushStream(stream);
+    } else {
+      sonicWriteShortToStream(stream, input, samplesRead);
+    }
+    if (outFile != NULL) {
+      do {
+        samplesWritten =
+            sonicReadShortFromStream(stream, outBuffer, maxSamples);
+        if (samplesWritten > 0) {
+          writeToWaveFile(outFile, outBuffer, samplesWritten);
+        }
+      } while (samplesWritten > 0);
+    }
+  } while (samplesRead > 0);
+}
+
+/* Run float samples through the stream, and write the output if there is an
+   output file.  This is used for 24-bit and float files, so they do not lose
+   precision by being converted to 16 bits. */
+static void processFloatSamples(waveFile inFile, waveFile outFile,
+                                sonicStream stream, int numChannels) {
+  float inBuffer[BUFFER_SIZE], outBuffer[BUFFER_SIZE];
+  int samplesRead, samplesWritten;
+  int maxSamples = BUFFER_SIZE / numChannels;
+
+  do {
+    samplesRead = readFloatFromWaveFile(inFile, inBuffer, maxSamples);
+    if (samplesRead == 0) {
+      sonicFlushStream(stream);
+    } else {
+      sonicWriteFloatToStream(stream, inBuffer, samplesRead);
+    }
+    if (outFile != NULL) {
+      do {
+        samplesWritten =
+            sonicReadFloatFromStream(stream, outBuffer, maxSamples);
+        if (samplesWritten > 0) {
+          writeFloatToWaveFile(outFile, outBuffer, samplesWritten);
+        }
+      } while (samplesWritten > 0);
+    }
+  } while (samplesRead > 0);
+}
+
+#ifdef SONIC_SPECTROGRAM
+/* Return true if the file name ends in .png. */
+static int isPNGFileName(char* fileName) {
+  size_t length = strlen(fileName);
+
+  return length >= 4 && !strcmp(fileName + length - 4, ".png");
+}
+#endif  /* SONIC_SPECTROGRAM */
+
+/* Run sonic.  The output file has the same sample format as the input.
+   Spectrograms are rendered on numThreads threads.  If recordMarks is set,
+   the pitch marks are written to the output file instead.  Pitch marks are
+   loaded from marksFileName, unless it is NULL.  Processing starts
+   startSeconds into the input. */
 static void runSonic(char* inFileName, char* outFileName, float speed,
                      float pitch, float rate, float volume,
-                     int emulateChordPitch, int quality,
-                     int enableNonlinearSpeedup, int computeSpectrogram,
-                     int numRows, int numCols) {
+                     int emulateChordPitch, int quality, int pitchMethod,
+                     int enableNonlinearSpeedup, int pitchTracking,
+                     int lowLatency, int computeSpectrogram, int numRows,
+                     int numCols, int numThreads, int recordMarks,
+                     char* marksFileName, double startSeconds) {
   waveFile inFile, outFile = NULL;
   sonicStream stream;
-  short inBuffer[BUFFER_SIZE], outBuffer[BUFFER_SIZE];
-  int sampleRate, numChannels, samplesRead, samplesWritten;
+  sonicPitchMarks pitchMarks = NULL;
+  int sampleRate, numChannels, format;
+  int writeSound = !computeSpectrogram && !recordMarks;
 
   inFile = openInputWaveFile(inFileName, &sampleRate, &numChannels);
   if (inFile == NULL) {
     fprintf(stderr, "Unable to read wave file %s\n", inFileName);
     exit(1);
   }
-  if (!computeSpectrogram) {
-    outFile = openOutputWaveFile(outFileName, sampleRate, numChannels);
+  format = getWaveFileFormat(inFile);
+  if (marksFileName != NULL) {
+    pitchMarks = sonicLoadPitchMarks(marksFileName);
+    if (pitchMarks == NULL) {
+      closeWaveFile(inFile);
+      fprintf(stderr, "Unable to read pitch marks from %s\n", marksFileName);
+      exit(1);
+    }
+  } else if (recordMarks) {
+    pitchMarks = sonicCreatePitchMarks(sampleRate);
+  }
+  if (writeSound) {
+    outFile = openOutputWaveFileWithFormat(outFileName, sampleRate,
+                                           numChannels, format);
     if (outFile == NULL) {
       closeWaveFile(inFile);
       fprintf(stderr, "Unable to open wave file %s for writing\n", outFileName);
@@ -44,60 +138,194 @@ static void runSonic(char* inFileName, char* outFileName, float speed,
   sonicSetVolume(stream, volume);
   sonicSetChordPitch(stream, emulateChordPitch);
   sonicSetQuality(stream, quality);
+  sonicSetPitchMethod(stream, pitchMethod);
+  sonicSetNonlinearSpeedup(stream, enableNonlinearSpeedup);
+  sonicSetPitchTracking(stream, pitchTracking);
+  sonicSetLowLatency(stream, lowLatency);
+  if (recordMarks) {
+    sonicRecordPitchMarks(stream, pitchMarks);
+  } else {
+    sonicSetPitchMarks(stream, pitchMarks);
+  }
 #ifdef SONIC_SPECTROGRAM
   if (computeSpectrogram) {
     sonicComputeSpectrogram(stream);
   }
 #endif  /* SONIC_SPECTROGRAM */
-  do {
-    samplesRead = readFromWaveFile(inFile, inBuffer, BUFFER_SIZE / numChannels);
-    if (samplesRead == 0) {
-      sonicFlushStream(stream);
-    } else {
-      sonicWriteShortToStream(stream, inBuffer, samplesRead);
-    }
-    if (!computeSpectrogram) {
-      do {
-        samplesWritten = sonicReadShortFromStream(stream, outBuffer,
-                                                  BUFFER_SIZE / numChannels);
-        if (samplesWritten > 0 && !computeSpectrogram) {
-          writeToWaveFile(outFile, outBuffer, samplesWritten);
-        }
-      } while (samplesWritten > 0);
-    }
-  } while (samplesRead > 0);
+  if (startSeconds > 0.0 &&
+      !seekWaveFile(inFile,
+                    sonicSeek(stream, (long)(startSeconds * sampleRate)))) {
+    fprintf(stderr, "Unable to seek in wave file %s\n", inFileName);
+    exit(1);
+  }
+  if (format == WAVE_PCM16) {
+    processShortSamples(inFile, outFile, stream, numChannels);
+  } else {
+    processFloatSamples(inFile, outFile, stream, numChannels);
+  }
 #ifdef SONIC_SPECTROGRAM
   if (computeSpectrogram) {
     sonicSpectrogram spectrogram = sonicGetSpectrogram(stream);
-    sonicBitmap bitmap =
-        sonicConvertSpectrogramToBitmap(spectrogram, numRows, numCols);
-    sonicWritePGM(bitmap, outFileName);
-    sonicDestroyBitmap(bitmap);
+    sonicBitmap bitmap = sonicConvertSpectrogramToBitmapInParallel(
+        spectrogram, numRows, numCols, numThreads);
+    int written = 0;
+
+    if (bitmap != NULL) {
+      if (isPNGFileName(outFileName)) {
+        written = sonicWritePNG(bitmap, outFileName);
+      } else {
+        written = sonicWritePGM(bitmap, outFileName);
+      }
+      sonicDestroyBitmap(bitmap);
+    }
+    if (!written) {
+      fprintf(stderr, "Unable to write spectrogram to %s\n", outFileName);
+      exit(1);
+    }
   }
 #endif  /* SONIC_SPECTROGRAM */
+  if (recordMarks && !sonicSavePitchMarks(pitchMarks, outFileName)) {
+    fprintf(stderr, "Unable to write pitch marks to %s\n", outFileName);
+    exit(1);
+  }
   sonicDestroyStream(stream);
+  sonicDestroyPitchMarks(pitchMarks);
   closeWaveFile(inFile);
-  if (!computeSpectrogram) {
+  if (writeSound) {
     closeWaveFile(outFile);
   }
 }
 
+#ifdef SONIC_BATCH
+/* Long files are cut into segments of about this many seconds for -j. */
+#define SEGMENT_SECONDS 30
+
+/* Map or read the whole input file into memory, and speed it up on
+   numThreads threads with sonicProcessLongJob. */
+static void runParallelSonic(char* inFileName, char* outFileName, float speed,
+                             float pitch, float rate, float volume,
+                             int emulateChordPitch, int quality,
+                             int pitchMethod, int pitchTracking,
+                             int numThreads) {
+  waveFile inFile, outFile;
+  sonicBatch batch;
+  sonicBatchJob job;
+  short* samples;
+  short* newSamples;
+  short* buffer = NULL;
+  int sampleRate, numChannels, samplesRead, format;
+  int numSamples = 0, allocatedSamples = 0;
+
+  inFile = openInputWaveFile(inFileName, &sampleRate, &numChannels);
+  if (inFile == NULL) {
+    fprintf(stderr, "Unable to read wave file %s\n", inFileName);
+    exit(1);
+  }
+  samples = getMappedWaveSamples(inFile, &numSamples);
+  while (samples == NULL) {
+    if (numSamples + BUFFER_SIZE > allocatedSamples) {
+      allocatedSamples += (allocatedSamples >> 1) + BUFFER_SIZE;
+      newSamples = (short*)realloc(
+          buffer, allocatedSamples * sizeof(short) * numChannels);
+      if (newSamples == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+      }
+      buffer = newSamples;
+    }
+    samplesRead = readFromWaveFile(inFile, buffer + numSamples * numChannels,
+                                   BUFFER_SIZE);
+    numSamples += samplesRead;
+    if (samplesRead == 0) {
+      samples = buffer;
+    }
+  }
+  memset(&job, 0, sizeof(job));
+  job.samples = samples;
+  job.numSamples = numSamples;
+  job.sampleRate = sampleRate;
+  job.numChannels = numChannels;
+  job.speed = speed;
+  job.pitch = pitch;
+  job.rate = rate;
+  job.volume = volume;
+  job.useChordPitch = emulateChordPitch;
+  job.quality = quality;
+  job.pitchMethod = pitchMethod;
+  job.pitchTracking = pitchTracking;
+  /* Chord pitch ignores the rate. */
+  job.maxOutputSamples =
+      (int)(numSamples / (emulateChordPitch ? speed : speed * rate) * 1.1) +
+      sampleRate;
+  batch = sonicCreateBatch(numThreads);
+  if (batch == NULL) {
+    fprintf(stderr, "Unable to create threads\n");
+    exit(1);
+  }
+  do {
+    job.output = (short*)malloc(job.maxOutputSamples * sizeof(short) *
+                                numChannels);
+    if (job.output == NULL ||
+        !sonicProcessLongJob(batch, &job, SEGMENT_SECONDS * sampleRate)) {
+      fprintf(stderr, "Out of memory\n");
+      exit(1);
+    }
+    if (job.numOutputSamples <= job.maxOutputSamples) {
+      break;
+    }
+    /* The guess was too small, so do it again with the right size. */
+    free(job.output);
+    job.maxOutputSamples = job.numOutputSamples;
+  } while (1);
+  sonicDestroyBatch(batch);
+  format = getWaveFileFormat(inFile);
+  closeWaveFile(inFile);
+  free(buffer);
+  outFile = openOutputWaveFileWithFormat(outFileName, sampleRate, numChannels,
+                                         format);
+  if (outFile == NULL) {
+    fprintf(stderr, "Unable to open wave file %s for writing\n", outFileName);
+    exit(1);
+  }
+  writeToWaveFile(outFile, job.output, job.numOutputSamples);
+  closeWaveFile(outFile);
+  free(job.output);
+}
+#endif  /* SONIC_BATCH */
+
 /* Print the usage. */
 static void usage(void) {
   fprintf(
       stderr,
       "Usage: sonic [OPTION]... infile outfile\n"
+      "Use - for infile or outfile to read standard input or write standard\n"
+      "output.\n"
+      "    -b seconds -- Begin this many seconds into infile.\n"
       "    -c         -- Modify pitch by emulating vocal chords vibrating\n"
       "                  faster or slower.\n"
-      "    -n         -- Enable nonlinear speedup\n"
+      "    -f         -- Use FFT based pitch detection.\n"
+#ifdef SONIC_BATCH
+      "    -j threads -- Process the whole file at once on this many "
+      "threads.\n"
+#endif  /* SONIC_BATCH */
+      "    -l         -- Find pitch from past input, for lower latency.\n"
+      "    -m         -- Write the pitch marks of infile to outfile, instead "
+      "of sound.\n"
+      "    -M marks   -- Use the pitch marks in the file marks, rather than "
+      "searching\n"
+      "                  for the pitch again.\n"
+      "    -n         -- Speed up silence and unvoiced sounds more than "
+      "vowels.\n"
       "    -p pitch   -- Set pitch scaling factor.  1.3 means 30%% higher.\n"
       "    -q         -- Disable speed-up heuristics.  May increase quality.\n"
       "    -r rate    -- Set playback rate.  2.0 means 2X faster, and 2X "
       "pitch.\n"
       "    -s speed   -- Set speed up factor.  2.0 means 2X faster.\n"
 #ifdef SONIC_SPECTROGRAM
-      "    -S width height -- Write a spectrogram in outfile in PGM format.\n"
+      "    -S width height -- Write a spectrogram in outfile in PGM format,\n"
+      "                  or PNG if outfile ends in .png.\n"
 #endif  /* SONIC_SPECTROGRAM */
+      "    -t         -- Search for pitch near the last pitch period first.\n"
       "    -v volume  -- Scale volume by a constant factor.\n");
   exit(1);
 }
@@ -114,27 +342,63 @@ int main(int argc, char** argv) {
   float volume = 1.0f;
   int emulateChordPitch = 0;
   int quality = 0;
+  int pitchMethod = SONIC_PITCH_AMDF;
   int xArg = 1;
   int enableNonlinearSpeedup = 0;
+  int pitchTracking = 0;
+  int lowLatency = 0;
   int computeSpectrogram = 0;
   int numRows = 0, numCols = 0;
+  int numThreads = 1;
+  int recordMarks = 0;
+  char* marksFileName = NULL;
+  double startSeconds = 0.0;
 
-  while (xArg < argc && *(argv[xArg]) == '-') {
-    if (!strcmp(argv[xArg], "-c")) {
+  while (xArg < argc && *(argv[xArg]) == '-' && argv[xArg][1] != '\0') {
+    if (!strcmp(argv[xArg], "-b")) {
+      xArg++;
+      if (xArg < argc) {
+        startSeconds = atof(argv[xArg]);
+        fprintf(stderr, "Starting at %0.2f seconds\n", startSeconds);
+      }
+    } else if (!strcmp(argv[xArg], "-c")) {
       emulateChordPitch = 1;
-      printf("Scaling pitch linearly.\n");
+      fprintf(stderr, "Scaling pitch linearly.\n");
+    } else if (!strcmp(argv[xArg], "-f")) {
+      pitchMethod = SONIC_PITCH_FFT;
+      fprintf(stderr, "Using FFT based pitch detection.\n");
+#ifdef SONIC_BATCH
+    } else if (!strcmp(argv[xArg], "-j")) {
+      xArg++;
+      if (xArg < argc) {
+        numThreads = atoi(argv[xArg]);
+        fprintf(stderr, "Using %d threads\n", numThreads);
+      }
+#endif  /* SONIC_BATCH */
+    } else if (!strcmp(argv[xArg], "-l")) {
+      lowLatency = 1;
+      fprintf(stderr, "Using low latency mode.\n");
+    } else if (!strcmp(argv[xArg], "-m")) {
+      recordMarks = 1;
+      fprintf(stderr, "Writing pitch marks.\n");
+    } else if (!strcmp(argv[xArg], "-M")) {
+      xArg++;
+      if (xArg < argc) {
+        marksFileName = argv[xArg];
+        fprintf(stderr, "Using pitch marks from %s\n", marksFileName);
+      }
     } else if (!strcmp(argv[xArg], "-n")) {
       enableNonlinearSpeedup = 1;
-      printf("Enabling nonlinear speedup.\n");
+      fprintf(stderr, "Enabling nonlinear speedup.\n");
     } else if (!strcmp(argv[xArg], "-p")) {
       xArg++;
       if (xArg < argc) {
         pitch = atof(argv[xArg]);
-        printf("Setting pitch to %0.2fX\n", pitch);
+        fprintf(stderr, "Setting pitch to %0.2fX\n", pitch);
       }
     } else if (!strcmp(argv[xArg], "-q")) {
       quality = 1;
-      printf("Disabling speed-up heuristics\n");
+      fprintf(stderr, "Disabling speed-up heuristics\n");
     } else if (!strcmp(argv[xArg], "-r")) {
       xArg++;
       if (xArg < argc) {
@@ -142,13 +406,13 @@ int main(int argc, char** argv) {
         if (rate == 0.0f) {
           usage();
         }
-        printf("Setting rate to %0.2fX\n", rate);
+        fprintf(stderr, "Setting rate to %0.2fX\n", rate);
       }
     } else if (!strcmp(argv[xArg], "-s")) {
       xArg++;
       if (xArg < argc) {
         speed = atof(argv[xArg]);
-        printf("Setting speed to %0.2fX\n", speed);
+        fprintf(stderr, "Setting speed to %0.2fX\n", speed);
       }
 #ifdef SONIC_SPECTROGRAM
     } else if (!strcmp(argv[xArg], "-S")) {
@@ -160,14 +424,18 @@ int main(int argc, char** argv) {
       if (xArg < argc) {
         numRows = atof(argv[xArg]);
         computeSpectrogram = 1;
-        printf("Computing spectrogram %d wide and %d tall\n", numCols, numRows);
+        fprintf(stderr, "Computing spectrogram %d wide and %d tall\n",
+                numCols, numRows);
       }
 #endif  /* SONIC_SPECTROGRAM */
+    } else if (!strcmp(argv[xArg], "-t")) {
+      pitchTracking = 1;
+      fprintf(stderr, "Tracking pitch.\n");
     } else if (!strcmp(argv[xArg], "-v")) {
       xArg++;
       if (xArg < argc) {
         volume = atof(argv[xArg]);
-        printf("Setting volume to %0.2f\n", volume);
+        fprintf(stderr, "Setting volume to %0.2f\n", volume);
       }
     }
     xArg++;
@@ -177,8 +445,22 @@ int main(int argc, char** argv) {
   }
   inFileName = argv[xArg];
   outFileName = argv[xArg + 1];
+#ifdef SONIC_BATCH
+  /* Nonlinear speedup makes segment lengths too hard to predict, low latency
+     is for streaming, and pitch mark positions count from the start of the
+     whole file. */
+  if (numThreads > 1 && !computeSpectrogram && !enableNonlinearSpeedup &&
+      !lowLatency && !recordMarks && marksFileName == NULL &&
+      startSeconds <= 0.0) {
+    runParallelSonic(inFileName, outFileName, speed, pitch, rate, volume,
+                     emulateChordPitch, quality, pitchMethod, pitchTracking,
+                     numThreads);
+    return 0;
+  }
+#endif  /* SONIC_BATCH */
   runSonic(inFileName, outFileName, speed, pitch, rate, volume,
-           emulateChordPitch, quality, enableNonlinearSpeedup,
-           computeSpectrogram, numRows, numCols);
+           emulateChordPitch, quality, pitchMethod, enableNonlinearSpeedup,
+           pitchTracking, lowLatency, computeSpectrogram, numRows, numCols,
+           numThreads, recordMarks, marksFileName, startSeconds);
   return 0;
 }
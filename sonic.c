@@ -6,6 +6,11 @@
    This file is licensed under the Apache 2.0 license.
 */
 
+/* clock_gettime is POSIX, not ANSI C. */
+#ifdef SONIC_PROFILE
+#define _POSIX_C_SOURCE 199309L
+#endif
+
 #include "sonic.h"
 
 #include <limits.h>
@@ -14,6 +19,33 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef SONIC_PROFILE
+#include <time.h>
+#endif
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+/* Promise the compiler that pointers do not alias, so it can vectorize simple
+   loops over separate arrays. */
+#ifdef __GNUC__
+#define SONIC_RESTRICT __restrict__
+#else
+#define SONIC_RESTRICT
+#endif
+
+/* Define SONIC_NO_SIMD to build only the portable scalar kernels.  Otherwise,
+   SSE2 and AVX2 kernels are compiled on x86 and selected at run time based on
+   what the CPU supports, and NEON kernels are used when the compiler targets
+   NEON. */
+#if !defined(SONIC_NO_SIMD) && defined(__GNUC__) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define SONIC_X86_SIMD
+#include <immintrin.h>
+#elif !defined(SONIC_NO_SIMD) && defined(__ARM_NEON)
+#define SONIC_NEON_SIMD
+#include <arm_neon.h>
+#endif
 
 /*
     The following code was used to generate the following sinc lookup table.
@@ -55,6 +87,27 @@
 #define SINC_FILTER_POINTS \
   12 /* I am not able to hear improvement with higher N. */
 #define SINC_TABLE_SIZE 601
+/* The most sinc filter phases adjustRate will cache.  adjustRate keeps both
+   sample rates at or below 1 << 14, so this covers every rate, at a cost of up
+   to 768KiB per stream for rates that do not reduce to a small ratio. */
+#define SONIC_MAX_SINC_PHASES (1 << 14)
+/* The sinc filter phases reserved for a stream with a fixed capacity.  Rates
+   that need more compute the weights for each output sample. */
+#define SONIC_FIXED_SINC_PHASES 1024
+/* In nonlinear speedup mode, silent pitch periods are sped up this many times
+   more than voiced ones, and unvoiced ones, where the AMDF minimum is a large
+   fraction of the maximum, are sped up less. */
+#define SONIC_SILENCE_WEIGHT 4.0f
+#define SONIC_UNVOICED_WEIGHT 2.0f
+/* A pitch period is silent if its power is below this fraction of the average
+   power of voiced periods. */
+#define SONIC_SILENCE_POWER 0.1f
+#define SONIC_UNVOICED_DIFF_RATIO 0.5f
+/* The time in seconds over which the overall nonlinear speed is averaged. */
+#define SONIC_NONLINEAR_SECONDS 4
+/* Marks a cached sinc filter phase that has not been computed yet.  Real
+   weights are never this small. */
+#define SONIC_SINC_UNUSED INT_MIN
 
 /* Lookup table for windowed sinc function of SINC_FILTER_POINTS points. */
 static short sincTable[SINC_TABLE_SIZE] = {
@@ -114,29 +167,123 @@ static short sincTable[SINC_TABLE_SIZE] = {
     -12,   -10,   -9,    -7,    -6,    -4,    -3,    -2,    -2,    -1,    -1,
     0,     0,     0,     0,     0,     0,     0};
 
+/* Overlap-add weights.  The tables for an overlap of n frames hold n - t and t
+   for frame t, and the sums are divided by n.  Integer builds keep them in 16
+   bits for the SIMD multipliers, so longer overlaps are worked out without
+   the tables. */
+#ifdef SONIC_USE_FLOAT
+typedef float sonicRampWeight;
+#define SONIC_MAX_RAMP_LENGTH INT_MAX
+#else
+typedef short sonicRampWeight;
+#define SONIC_MAX_RAMP_LENGTH SHRT_MAX
+#endif  /* SONIC_USE_FLOAT */
+
+/* A point that a parameter ramps to, from sonicRampParameter. */
+typedef struct {
+  long position;
+  float value;
+} sonicRamp;
+
+/* A pitch period found at a position in the input, and the minDiff and
+   maxDiff of the search that found it. */
+typedef struct {
+  long position;
+  int period;
+  int minDiff;
+  int maxDiff;
+} sonicPitchMark;
+
+/* Pitch marks in order of position.  Each period starts where the last one
+   ends. */
+struct sonicPitchMarksStruct {
+  sonicPitchMark* marks;
+  int numMarks;
+  int allocatedMarks;
+  int sampleRate;
+};
+
+/* The number of sync points kept, which covers several seconds of output. */
+#define SONIC_MAX_SYNC_POINTS 128
+
+/* An input position, and the output position it was turned into. */
+typedef struct {
+  long inputPosition;
+  long outputPosition;
+} sonicSyncPoint;
+
+/* The input, output and pitch buffers are sliding windows: each buffer pointer
+   points at the first unconsumed sample, and the matching *BufferStart field
+   counts the consumed samples in front of it.  Consuming samples just moves the
+   pointer, so the unconsumed samples are always contiguous, which the pitch
+   search and overlap-add code depend on.  Consumed space is reclaimed only
+   when more room is needed. */
 struct sonicStreamStruct {
 #ifdef SONIC_SPECTROGRAM
   sonicSpectrogram spectrogram;
 #endif  /* SONIC_SPECTROGRAM */
-  short* inputBuffer;
-  short* outputBuffer;
-  short* pitchBuffer;
-  short* downSampleBuffer;
+  sonicSample* inputBuffer;
+  sonicSample* outputBuffer;
+  sonicSample* pitchBuffer;
+  sonicSample* downSampleBuffer;
+  sonicSample* historyBuffer;
+  float* fftBuffer;
+  float* fftTwiddles;
+  int* fftBitReverse;
+  int* sincWeights;
+  sonicRampWeight* rampWeights;
+  sonicAllocFunc allocFunc;
+  sonicReallocFunc reallocFunc;
+  sonicFreeFunc freeFunc;
+  void* allocContext;
   float speed;
   float volume;
+  /* The volume every sample in the output buffer still has to be scaled by,
+     which is done as the samples are read. */
+  float outputVolume;
   float pitch;
   float rate;
   int oldRatePosition;
   int newRatePosition;
+  /* How far the output samples are behind the rate positions, in 1 /
+     rateNewSampleRate input samples, and the sample rates adjustRate last
+     counted positions in. */
+  int ratePhase;
+  int rateOldSampleRate;
+  int rateNewSampleRate;
   int useChordPitch;
   int quality;
+  int pitchMethod;
+  int pitchChannelMask;
+  /* The pitch marks used instead of searching, or recorded when
+     recordPitchMarks is set. */
+  sonicPitchMarks pitchMarks;
+  int recordPitchMarks;
+  int fftSize;
+  int fftCapacity;
+  int sincOldSampleRate;
+  int sincNewSampleRate;
+  int sincPhaseStep;
+  int sincNumPhases;
+  int sincCapacity;
+  int rampLength;
+  int fixedInputSamples;
+  int fixedOutputSamples;
   int numChannels;
   int inputBufferSize;
   int pitchBufferSize;
   int outputBufferSize;
+  int inputBufferStart;
+  int pitchBufferStart;
+  int outputBufferStart;
   int numInputSamples;
   int numOutputSamples;
   int numPitchSamples;
+  int numAcquiredSamples;
+  int minPitch;
+  int maxPitch;
+  int amdfFreq;
+  int pitchLowPass;
   int minPeriod;
   int maxPeriod;
   int maxRequired;
@@ -144,9 +291,93 @@ struct sonicStreamStruct {
   int sampleRate;
   int prevPeriod;
   int prevMinDiff;
+  int voicedMinDiff;
+  int voicedMaxDiff;
+  int nonlinearSpeedup;
+  int pitchTracking;
+  int lowLatency;
+  int numHistorySamples;
   float avePower;
+  float aveInverseWeight;
+  float nonlinearError;
+  /* Scheduled ramps for each parameter, and where the first one starts.
+     inputPosition is the input position of the first sample in the input
+     buffer. */
+  sonicRamp ramps[SONIC_NUM_PARAMS][SONIC_MAX_RAMPS];
+  int numRamps[SONIC_NUM_PARAMS];
+  long rampStartPositions[SONIC_NUM_PARAMS];
+  float rampStartValues[SONIC_NUM_PARAMS];
+  long inputPosition;
+  /* outputPosition is the output position of the first sample in the output
+     buffer.  Output positions count from the last seek.  The sync points are
+     a ring of recent positions where the input and output line up, oldest
+     first. */
+  long outputPosition;
+  sonicSyncPoint syncPoints[SONIC_MAX_SYNC_POINTS];
+  int firstSyncPoint;
+  int numSyncPoints;
+  /* The speed remainingInputToCopy was computed for. */
+  float copySpeed;
+  sonicStats stats;
+#ifdef SONIC_PROFILE
+  double stageStart;
+#endif
 };
 
+#ifdef SONIC_PROFILE
+/* Return a monotonic time in seconds. */
+static double getTime(void) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec * 1.0e-9;
+}
+
+/* Start timing a processing stage. */
+static void beginStage(sonicStream stream) { stream->stageStart = getTime(); }
+
+/* Add the time since beginStage to the stage's total. */
+static void endStage(sonicStream stream, int stage) {
+  stream->stats.stageSeconds[stage] += getTime() - stream->stageStart;
+}
+#else
+#define beginStage(stream)
+#define endStage(stream, stage)
+#endif  /* SONIC_PROFILE */
+
+/* The default allocator, which uses the C library. */
+static void* defaultAlloc(void* context, size_t size) { return malloc(size); }
+
+/* The default reallocator, which uses the C library. */
+static void* defaultRealloc(void* context, void* ptr, size_t size) {
+  return realloc(ptr, size);
+}
+
+/* The default deallocator, which uses the C library. */
+static void defaultFree(void* context, void* ptr) { free(ptr); }
+
+/* Allocate zeroed memory with the stream's allocator. */
+static void* streamCalloc(sonicStream stream, size_t num, size_t size) {
+  void* ptr = stream->allocFunc(stream->allocContext, num * size);
+
+  if (ptr != NULL) {
+    memset(ptr, 0, num * size);
+  }
+  return ptr;
+}
+
+/* Resize memory with the stream's allocator. */
+static void* streamRealloc(sonicStream stream, void* ptr, size_t size) {
+  return stream->reallocFunc(stream->allocContext, ptr, size);
+}
+
+/* Free memory with the stream's allocator.  NULL is ignored. */
+static void streamFree(sonicStream stream, void* ptr) {
+  if (ptr != NULL) {
+    stream->freeFunc(stream->allocContext, ptr);
+  }
+}
+
 #ifdef SONIC_SPECTROGRAM
 
 /* Compute a spectrogram on the fly. */
@@ -163,336 +394,2029 @@ sonicSpectrogram sonicGetSpectrogram(sonicStream stream) {
 
 #endif
 
-/* Scale the samples by the factor. */
-static void scaleSamples(short* samples, int numSamples, float volume) {
-  int fixedPointVolume = volume * 4096.0f;
-  int value;
+#ifndef SONIC_USE_FLOAT
 
-  while (numSamples--) {
-    value = (*samples * fixedPointVolume) >> 12;
-    if (value > 32767) {
-      value = 32767;
-    } else if (value < -32767) {
-      value = -32767;
-    }
-    *samples++ = value;
+/* Return the sum of |s[i] - p[i]| over numSamples samples.  This is the inner
+   loop of the AMDF pitch search.  Each difference is taken as an unsigned
+   short, so the SIMD versions below sum exactly the same values. */
+static unsigned long computeAmdfScalar(short* s, short* p, int numSamples) {
+  unsigned long diff = 0;
+  short sVal, pVal;
+  int i;
+
+  for (i = 0; i < numSamples; i++) {
+    sVal = *s++;
+    pVal = *p++;
+    diff += sVal >= pVal ? (unsigned short)(sVal - pVal)
+                         : (unsigned short)(pVal - sVal);
   }
+  return diff;
 }
 
-/* Get the speed of the stream. */
-float sonicGetSpeed(sonicStream stream) { return stream->speed; }
-
-/* Set the speed of the stream. */
-void sonicSetSpeed(sonicStream stream, float speed) { stream->speed = speed; }
+#ifdef SONIC_X86_SIMD
 
-/* Get the pitch of the stream. */
-float sonicGetPitch(sonicStream stream) { return stream->pitch; }
-
-/* Set the pitch of the stream. */
-void sonicSetPitch(sonicStream stream, float pitch) { stream->pitch = pitch; }
+/* SSE2 version of computeAmdfScalar. */
+__attribute__((target("sse2"))) static unsigned long computeAmdfSSE2(
+    short* s, short* p, int numSamples) {
+  __m128i zero = _mm_setzero_si128();
+  __m128i total = _mm_setzero_si128();
+  __m128i a, b, absDiff;
+  unsigned int lanes[4];
+  int i = 0;
 
-/* Get the rate of the stream. */
-float sonicGetRate(sonicStream stream) { return stream->rate; }
+  for (; i + 8 <= numSamples; i += 8) {
+    a = _mm_loadu_si128((__m128i*)(s + i));
+    b = _mm_loadu_si128((__m128i*)(p + i));
+    /* max - min is the absolute difference, which fits in 16 unsigned bits. */
+    absDiff = _mm_sub_epi16(_mm_max_epi16(a, b), _mm_min_epi16(a, b));
+    total = _mm_add_epi32(total, _mm_unpacklo_epi16(absDiff, zero));
+    total = _mm_add_epi32(total, _mm_unpackhi_epi16(absDiff, zero));
+  }
+  _mm_storeu_si128((__m128i*)lanes, total);
+  return (unsigned long)lanes[0] + lanes[1] + lanes[2] + lanes[3] +
+         computeAmdfScalar(s + i, p + i, numSamples - i);
+}
 
-/* Set the playback rate of the stream. This scales pitch and speed at the same
-   time. */
-void sonicSetRate(sonicStream stream, float rate) {
-  stream->rate = rate;
+/* AVX2 version of computeAmdfScalar. */
+__attribute__((target("avx2"))) static unsigned long computeAmdfAVX2(
+    short* s, short* p, int numSamples) {
+  __m256i zero = _mm256_setzero_si256();
+  __m256i total = _mm256_setzero_si256();
+  __m256i a, b, absDiff;
+  unsigned int lanes[8];
+  unsigned long diff = 0;
+  int i = 0, j;
 
-  stream->oldRatePosition = 0;
-  stream->newRatePosition = 0;
+  for (; i + 16 <= numSamples; i += 16) {
+    a = _mm256_loadu_si256((__m256i*)(s + i));
+    b = _mm256_loadu_si256((__m256i*)(p + i));
+    absDiff = _mm256_sub_epi16(_mm256_max_epi16(a, b), _mm256_min_epi16(a, b));
+    total = _mm256_add_epi32(total, _mm256_unpacklo_epi16(absDiff, zero));
+    total = _mm256_add_epi32(total, _mm256_unpackhi_epi16(absDiff, zero));
+  }
+  _mm256_storeu_si256((__m256i*)lanes, total);
+  for (j = 0; j < 8; j++) {
+    diff += lanes[j];
+  }
+  return diff + computeAmdfScalar(s + i, p + i, numSamples - i);
 }
 
-/* Get the vocal chord pitch setting. */
-int sonicGetChordPitch(sonicStream stream) { return stream->useChordPitch; }
+#endif  /* SONIC_X86_SIMD */
 
-/* Set the vocal chord mode for pitch computation.  Default is off. */
-void sonicSetChordPitch(sonicStream stream, int useChordPitch) {
-  stream->useChordPitch = useChordPitch;
-}
+#ifdef SONIC_NEON_SIMD
 
-/* Get the quality setting. */
-int sonicGetQuality(sonicStream stream) { return stream->quality; }
+/* NEON version of computeAmdfScalar. */
+static unsigned long computeAmdfNEON(short* s, short* p, int numSamples) {
+  uint32x4_t total = vdupq_n_u32(0);
+  uint16x8_t absDiff;
+  unsigned int lanes[4];
+  int i = 0;
 
-/* Set the "quality".  Default 0 is virtually as good as 1, but very much
-   faster. */
-void sonicSetQuality(sonicStream stream, int quality) {
-  stream->quality = quality;
+  for (; i + 8 <= numSamples; i += 8) {
+    absDiff = vreinterpretq_u16_s16(vabdq_s16(vld1q_s16(s + i),
+                                              vld1q_s16(p + i)));
+    total = vpadalq_u16(total, absDiff);
+  }
+  vst1q_u32(lanes, total);
+  return (unsigned long)lanes[0] + lanes[1] + lanes[2] + lanes[3] +
+         computeAmdfScalar(s + i, p + i, numSamples - i);
 }
 
-/* Get the scaling factor of the stream. */
-float sonicGetVolume(sonicStream stream) { return stream->volume; }
+#endif  /* SONIC_NEON_SIMD */
 
-/* Set the scaling factor of the stream. */
-void sonicSetVolume(sonicStream stream, float volume) {
-  stream->volume = volume;
-}
+/* Return the sum of in[i*numChannels]*weights[i] over the sinc filter points.
+   Every product fits in 32 bits and every partial sum fits in 53, so the
+   double sum is exact no matter what order we add the products in. */
+static double computeSincDotScalar(short* in, int* weights, int numChannels) {
+  double total0 = 0.0, total1 = 0.0;
+  int i;
 
-/* Free stream buffers. */
-static void freeStreamBuffers(sonicStream stream) {
-  if (stream->inputBuffer != NULL) {
-    free(stream->inputBuffer);
-  }
-  if (stream->outputBuffer != NULL) {
-    free(stream->outputBuffer);
+  for (i = 0; i + 2 <= SINC_FILTER_POINTS; i += 2) {
+    total0 += (double)in[i * numChannels] * weights[i];
+    total1 += (double)in[(i + 1) * numChannels] * weights[i + 1];
   }
-  if (stream->pitchBuffer != NULL) {
-    free(stream->pitchBuffer);
-  }
-  if (stream->downSampleBuffer != NULL) {
-    free(stream->downSampleBuffer);
+  for (; i < SINC_FILTER_POINTS; i++) {
+    total0 += (double)in[i * numChannels] * weights[i];
   }
+  return total0 + total1;
 }
 
-/* Destroy the sonic stream. */
-void sonicDestroyStream(sonicStream stream) {
-#ifdef SONIC_SPECTROGRAM
-  if (stream->spectrogram != NULL) {
-    sonicDestroySpectrogram(stream->spectrogram);
-  }
-#endif  /* SONIC_SPECTROGRAM */
-  freeStreamBuffers(stream);
-  free(stream);
-}
+#ifdef SONIC_X86_SIMD
 
-/* Allocate stream buffers. */
-static int allocateStreamBuffers(sonicStream stream, int sampleRate,
-                                 int numChannels) {
-  int minPeriod = sampleRate / SONIC_MAX_PITCH;
-  int maxPeriod = sampleRate / SONIC_MIN_PITCH;
-  int maxRequired = 2 * maxPeriod;
+/* AVX2 version of computeSincDotScalar.  Only mono samples are contiguous, so
+   other channel counts use the scalar version. */
+__attribute__((target("avx2"))) static double computeSincDotAVX2(
+    short* in, int* weights, int numChannels) {
+  __m256d total = _mm256_setzero_pd();
+  __m256d samples, sincWeights;
+  double lanes[4];
+  int i = 0;
 
-  stream->inputBufferSize = maxRequired;
-  stream->inputBuffer =
-      (short*)calloc(maxRequired, sizeof(short) * numChannels);
-  if (stream->inputBuffer == NULL) {
-    sonicDestroyStream(stream);
-    return 0;
-  }
-  stream->outputBufferSize = maxRequired;
-  stream->outputBuffer =
-      (short*)calloc(maxRequired, sizeof(short) * numChannels);
-  if (stream->outputBuffer == NULL) {
-    sonicDestroyStream(stream);
-    return 0;
+  if (numChannels != 1) {
+    return computeSincDotScalar(in, weights, numChannels);
   }
-  stream->pitchBufferSize = maxRequired;
-  stream->pitchBuffer =
-      (short*)calloc(maxRequired, sizeof(short) * numChannels);
-  if (stream->pitchBuffer == NULL) {
-    sonicDestroyStream(stream);
-    return 0;
+  for (; i + 4 <= SINC_FILTER_POINTS; i += 4) {
+    samples = _mm256_cvtepi32_pd(
+        _mm_cvtepi16_epi32(_mm_loadl_epi64((__m128i*)(in + i))));
+    sincWeights =
+        _mm256_cvtepi32_pd(_mm_loadu_si128((__m128i*)(weights + i)));
+    total = _mm256_add_pd(total, _mm256_mul_pd(samples, sincWeights));
   }
-  stream->downSampleBuffer = (short*)calloc(maxRequired, sizeof(short));
-  if (stream->downSampleBuffer == NULL) {
-    sonicDestroyStream(stream);
-    return 0;
+  _mm256_storeu_pd(lanes, total);
+  for (; i < SINC_FILTER_POINTS; i++) {
+    lanes[0] += (double)in[i] * weights[i];
   }
-  stream->sampleRate = sampleRate;
-  stream->numChannels = numChannels;
-  stream->oldRatePosition = 0;
-  stream->newRatePosition = 0;
-  stream->minPeriod = minPeriod;
-  stream->maxPeriod = maxPeriod;
-  stream->maxRequired = maxRequired;
-  stream->prevPeriod = 0;
-  return 1;
+  return lanes[0] + lanes[1] + lanes[2] + lanes[3];
 }
 
-/* Create a sonic stream.  Return NULL only if we are out of memory and cannot
-   allocate the stream. */
-sonicStream sonicCreateStream(int sampleRate, int numChannels) {
-  sonicStream stream = (sonicStream)calloc(1, sizeof(struct sonicStreamStruct));
+/* AVX2 version of computeSincDotsScalar.  Four neighbouring channels are
+   contiguous, so each filter point is one load. */
+__attribute__((target("avx2"))) static void computeSincDotsAVX2(
+    short* in, int* weights, int numChannels, double* totals) {
+  __m256d total = _mm256_setzero_pd();
+  __m256d samples;
+  int i;
 
-  if (stream == NULL) {
-    return NULL;
-  }
-  if (!allocateStreamBuffers(stream, sampleRate, numChannels)) {
-    return NULL;
+  for (i = 0; i < SINC_FILTER_POINTS; i++) {
+    samples = _mm256_cvtepi32_pd(_mm_cvtepi16_epi32(
+        _mm_loadl_epi64((__m128i*)(in + i * numChannels))));
+    total = _mm256_add_pd(total,
+                          _mm256_mul_pd(samples, _mm256_set1_pd(weights[i])));
   }
-  stream->speed = 1.0f;
-  stream->pitch = 1.0f;
-  stream->volume = 1.0f;
-  stream->rate = 1.0f;
-  stream->oldRatePosition = 0;
-  stream->newRatePosition = 0;
-  stream->useChordPitch = 0;
-  stream->quality = 0;
-  stream->avePower = 50.0f;
-  return stream;
+  _mm256_storeu_pd(totals, total);
 }
 
-/* Get the sample rate of the stream. */
-int sonicGetSampleRate(sonicStream stream) { return stream->sampleRate; }
+#endif  /* SONIC_X86_SIMD */
 
-/* Set the sample rate of the stream.  This will cause samples buffered in the
-   stream to be lost. */
-void sonicSetSampleRate(sonicStream stream, int sampleRate) {
-  freeStreamBuffers(stream);
-  allocateStreamBuffers(stream, sampleRate, stream->numChannels);
+/* Compute computeSincDot for four neighbouring channels at once, and put the
+   sums in totals. */
+static void computeSincDotsScalar(short* in, int* weights, int numChannels,
+                                  double* totals) {
+  int i;
+
+  for (i = 0; i < 4; i++) {
+    totals[i] = computeSincDotScalar(in + i, weights, numChannels);
+  }
 }
 
-/* Get the number of channels. */
-int sonicGetNumChannels(sonicStream stream) { return stream->numChannels; }
+/* The sinc filter kernels used by interpolate and interpolateFrame. */
+static double (*computeSincDot)(short* in, int* weights,
+                                int numChannels) = computeSincDotScalar;
+static void (*computeSincDots)(short* in, int* weights, int numChannels,
+                               double* totals) = computeSincDotsScalar;
 
-/* Set the num channels of the stream.  This will cause samples buffered in the
-   stream to be lost. */
-void sonicSetNumChannels(sonicStream stream, int numChannels) {
-  freeStreamBuffers(stream);
-  allocateStreamBuffers(stream, stream->sampleRate, numChannels);
+/* Return a little over 1 / divisor.  Truncating a sum of 16-bit samples times
+   this gives exactly what dividing the sum by divisor would, even when the sum
+   is a multiple of it, as long as the quotient is a 16-bit sample too.  That
+   holds for averages, and for overlap-add sums whose weights add up to
+   divisor.  Multiplying is much faster than dividing. */
+static double getAverageScale(int divisor) {
+  return (1.0 + 1e-12) / divisor;
 }
 
-/* Enlarge the output buffer if needed. */
-static int enlargeOutputBufferIfNeeded(sonicStream stream, int numSamples) {
-  if (stream->numOutputSamples + numSamples > stream->outputBufferSize) {
-    stream->outputBufferSize += (stream->outputBufferSize >> 1) + numSamples;
-    stream->outputBuffer = (short*)realloc(
-        stream->outputBuffer,
-        stream->outputBufferSize * sizeof(short) * stream->numChannels);
-    if (stream->outputBuffer == NULL) {
-      return 0;
+/* Average each block of samplesPerValue samples into one value, truncating
+   toward zero.  This down samples the input for the pitch search, mixing the
+   channels in the same pass. */
+static void averageBlocksScalar(short* SONIC_RESTRICT samples,
+                                short* SONIC_RESTRICT out, int numValues,
+                                int samplesPerValue) {
+  double scale = getAverageScale(samplesPerValue);
+  int i, j, sum;
+
+  for (i = 0; i < numValues; i++) {
+    sum = 0;
+    for (j = 0; j < samplesPerValue; j++) {
+      sum += *samples++;
     }
+    out[i] = (int)(sum * scale);
   }
-  return 1;
 }
 
-/* Enlarge the input buffer if needed. */
-static int enlargeInputBufferIfNeeded(sonicStream stream, int numSamples) {
-  if (stream->numInputSamples + numSamples > stream->inputBufferSize) {
-    stream->inputBufferSize += (stream->inputBufferSize >> 1) + numSamples;
-    stream->inputBuffer = (short*)realloc(
-        stream->inputBuffer,
-        stream->inputBufferSize * sizeof(short) * stream->numChannels);
-    if (stream->inputBuffer == NULL) {
-      return 0;
+#ifdef SONIC_X86_SIMD
+
+/* SSE2 version of averageBlocksScalar.  Multiplying by ones and adding pairs
+   sums the samples.  Pairs are stereo frames at full rate, and adding the sign
+   bit before the shift halves them toward zero.  Longer blocks are summed eight
+   samples at a time. */
+__attribute__((target("sse2"))) static void averageBlocksSSE2(
+    short* samples, short* out, int numValues, int samplesPerValue) {
+  __m128i ones = _mm_set1_epi16(1);
+  __m128i left, right, total;
+  double scale = getAverageScale(samplesPerValue);
+  int lanes[4];
+  int i = 0, j, sum;
+
+  if (samplesPerValue == 2) {
+    for (; i + 8 <= numValues; i += 8) {
+      left = _mm_madd_epi16(_mm_loadu_si128((__m128i*)(samples + 2 * i)),
+                            ones);
+      right = _mm_madd_epi16(
+          _mm_loadu_si128((__m128i*)(samples + 2 * i + 8)), ones);
+      left = _mm_add_epi32(left, _mm_srli_epi32(left, 31));
+      right = _mm_add_epi32(right, _mm_srli_epi32(right, 31));
+      _mm_storeu_si128((__m128i*)(out + i),
+                       _mm_packs_epi32(_mm_srai_epi32(left, 1),
+                                       _mm_srai_epi32(right, 1)));
     }
+  } else if (samplesPerValue >= 8) {
+    for (; i < numValues; i++) {
+      total = _mm_setzero_si128();
+      for (j = 0; j + 8 <= samplesPerValue; j += 8) {
+        total = _mm_add_epi32(
+            total, _mm_madd_epi16(_mm_loadu_si128((__m128i*)(samples + j)),
+                                  ones));
+      }
+      _mm_storeu_si128((__m128i*)lanes, total);
+      sum = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+      for (; j < samplesPerValue; j++) {
+        sum += samples[j];
+      }
+      out[i] = (int)(sum * scale);
+      samples += samplesPerValue;
+    }
+    return;
   }
-  return 1;
+  averageBlocksScalar(samples + samplesPerValue * i, out + i, numValues - i,
+                      samplesPerValue);
 }
 
-/* Add the input samples to the input buffer. */
-static int addFloatSamplesToInputBuffer(sonicStream stream, float* samples,
-                                        int numSamples) {
-  short* buffer;
-  int count = numSamples * stream->numChannels;
+#endif  /* SONIC_X86_SIMD */
 
-  if (numSamples == 0) {
-    return 1;
-  }
-  if (!enlargeInputBufferIfNeeded(stream, numSamples)) {
-    return 0;
-  }
-  buffer = stream->inputBuffer + stream->numInputSamples * stream->numChannels;
-  while (count--) {
-    *buffer++ = (*samples++) * 32767.0f;
-  }
-  stream->numInputSamples += numSamples;
-  return 1;
+#ifdef SONIC_NEON_SIMD
+
+/* Halve each lane toward zero, and narrow it to 16 bits. */
+static int16x4_t halveNEON(int32x4_t sums) {
+  uint32x4_t signs = vshrq_n_u32(vreinterpretq_u32_s32(sums), 31);
+
+  return vshrn_n_s32(vaddq_s32(sums, vreinterpretq_s32_u32(signs)), 1);
 }
 
-/* Add the input samples to the input buffer. */
-static int addShortSamplesToInputBuffer(sonicStream stream, short* samples,
-                                        int numSamples) {
-  if (numSamples == 0) {
-    return 1;
+/* NEON version of averageBlocksSSE2. */
+static void averageBlocksNEON(short* samples, short* out, int numValues,
+                              int samplesPerValue) {
+  int32x4_t total;
+  double scale = getAverageScale(samplesPerValue);
+  int lanes[4];
+  int i = 0, j, sum;
+
+  if (samplesPerValue == 2) {
+    for (; i + 8 <= numValues; i += 8) {
+      vst1q_s16(out + i,
+                vcombine_s16(halveNEON(vpaddlq_s16(vld1q_s16(samples + 2 * i))),
+                             halveNEON(vpaddlq_s16(
+                                 vld1q_s16(samples + 2 * i + 8)))));
+    }
+  } else if (samplesPerValue >= 8) {
+    for (; i < numValues; i++) {
+      total = vdupq_n_s32(0);
+      for (j = 0; j + 8 <= samplesPerValue; j += 8) {
+        total = vpadalq_s16(total, vld1q_s16(samples + j));
+      }
+      vst1q_s32(lanes, total);
+      sum = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+      for (; j < samplesPerValue; j++) {
+        sum += samples[j];
+      }
+      out[i] = (int)(sum * scale);
+      samples += samplesPerValue;
+    }
+    return;
   }
-  if (!enlargeInputBufferIfNeeded(stream, numSamples)) {
-    return 0;
+  averageBlocksScalar(samples + samplesPerValue * i, out + i, numValues - i,
+                      samplesPerValue);
+}
+
+#endif  /* SONIC_NEON_SIMD */
+
+/* The block averaging kernel used by downSampleInput. */
+static void (*averageBlocks)(short* samples, short* out, int numValues,
+                             int samplesPerValue) = averageBlocksScalar;
+
+#else  /* SONIC_USE_FLOAT */
+
+/* Return the sum of |s[i] - p[i]| over numSamples samples, scaled to the 16-bit
+   sample range so the pitch search thresholds work the same as with 16-bit
+   samples.  This is the inner loop of the AMDF pitch search.  The SIMD versions
+   below add in a different order, so they may round slightly differently. */
+static unsigned long computeAmdfScalar(float* s, float* p, int numSamples) {
+  float diff = 0.0f;
+  int i;
+
+  for (i = 0; i < numSamples; i++) {
+    diff += fabs(s[i] - p[i]);
   }
-  memcpy(stream->inputBuffer + stream->numInputSamples * stream->numChannels,
-         samples, numSamples * sizeof(short) * stream->numChannels);
-  stream->numInputSamples += numSamples;
-  return 1;
+  return (unsigned long)(diff * 32767.0f);
 }
 
-/* Add the input samples to the input buffer. */
-static int addUnsignedCharSamplesToInputBuffer(sonicStream stream,
-                                               unsigned char* samples,
-                                               int numSamples) {
-  short* buffer;
-  int count = numSamples * stream->numChannels;
+#ifdef SONIC_X86_SIMD
 
-  if (numSamples == 0) {
-    return 1;
+/* SSE2 version of computeAmdfScalar. */
+__attribute__((target("sse2"))) static unsigned long computeAmdfSSE2(
+    float* s, float* p, int numSamples) {
+  __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+  __m128 total = _mm_setzero_ps();
+  __m128 diff;
+  float lanes[4];
+  int i = 0;
+
+  for (; i + 4 <= numSamples; i += 4) {
+    diff = _mm_sub_ps(_mm_loadu_ps(s + i), _mm_loadu_ps(p + i));
+    total = _mm_add_ps(total, _mm_and_ps(absMask, diff));
   }
-  if (!enlargeInputBufferIfNeeded(stream, numSamples)) {
-    return 0;
+  _mm_storeu_ps(lanes, total);
+  return (unsigned long)((lanes[0] + lanes[1] + lanes[2] + lanes[3]) *
+                         32767.0f) +
+         computeAmdfScalar(s + i, p + i, numSamples - i);
+}
+
+/* AVX2 version of computeAmdfScalar. */
+__attribute__((target("avx2"))) static unsigned long computeAmdfAVX2(
+    float* s, float* p, int numSamples) {
+  __m256 absMask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+  __m256 total = _mm256_setzero_ps();
+  __m256 difference;
+  float lanes[8];
+  float diff = 0.0f;
+  int i = 0, j;
+
+  for (; i + 8 <= numSamples; i += 8) {
+    difference = _mm256_sub_ps(_mm256_loadu_ps(s + i), _mm256_loadu_ps(p + i));
+    total = _mm256_add_ps(total, _mm256_and_ps(absMask, difference));
   }
-  buffer = stream->inputBuffer + stream->numInputSamples * stream->numChannels;
-  while (count--) {
-    *buffer++ = (*samples++ - 128) << 8;
+  _mm256_storeu_ps(lanes, total);
+  for (j = 0; j < 8; j++) {
+    diff += lanes[j];
   }
-  stream->numInputSamples += numSamples;
-  return 1;
+  return (unsigned long)(diff * 32767.0f) +
+         computeAmdfScalar(s + i, p + i, numSamples - i);
 }
 
-/* Remove input samples that we have already processed. */
-static void removeInputSamples(sonicStream stream, int position) {
-  int remainingSamples = stream->numInputSamples - position;
+#endif  /* SONIC_X86_SIMD */
 
-  if (remainingSamples > 0) {
-    memmove(stream->inputBuffer,
-            stream->inputBuffer + position * stream->numChannels,
-            remainingSamples * sizeof(short) * stream->numChannels);
+#ifdef SONIC_NEON_SIMD
+
+/* NEON version of computeAmdfScalar. */
+static unsigned long computeAmdfNEON(float* s, float* p, int numSamples) {
+  float32x4_t total = vdupq_n_f32(0.0f);
+  float lanes[4];
+  int i = 0;
+
+  for (; i + 4 <= numSamples; i += 4) {
+    total = vaddq_f32(total, vabdq_f32(vld1q_f32(s + i), vld1q_f32(p + i)));
   }
-  stream->numInputSamples = remainingSamples;
+  vst1q_f32(lanes, total);
+  return (unsigned long)((lanes[0] + lanes[1] + lanes[2] + lanes[3]) *
+                         32767.0f) +
+         computeAmdfScalar(s + i, p + i, numSamples - i);
 }
 
-/* Just copy from the array to the output buffer */
-static int copyToOutput(sonicStream stream, short* samples, int numSamples) {
-  if (!enlargeOutputBufferIfNeeded(stream, numSamples)) {
-    return 0;
+#endif  /* SONIC_NEON_SIMD */
+
+#endif  /* SONIC_USE_FLOAT */
+
+/* The AMDF kernel used by findPitchPeriodInRange. */
+static unsigned long (*computeAmdf)(sonicSample* s, sonicSample* p,
+                                    int numSamples) = computeAmdfScalar;
+
+/* Mix numFrames interleaved frames of down and up into out, weighting frame t
+   by downWeights[t] and upWeights[t], and dividing by divisor.  This is the
+   inner loop of overlap-add.  The down and up samples may be the same. */
+static void overlapAddScalar(sonicSample* SONIC_RESTRICT out, sonicSample* down,
+                             sonicSample* up, sonicRampWeight* downWeights,
+                             sonicRampWeight* upWeights, int numFrames,
+                             int numChannels, int divisor) {
+  sonicRampWeight downWeight, upWeight;
+  int t, i;
+#ifndef SONIC_USE_FLOAT
+  double scale = getAverageScale(divisor);
+#endif  /* SONIC_USE_FLOAT */
+
+  if (numChannels == 1) {
+    for (t = 0; t < numFrames; t++) {
+#ifdef SONIC_USE_FLOAT
+      out[t] = (down[t] * downWeights[t] + up[t] * upWeights[t]) / divisor;
+#else
+      out[t] = (int)((down[t] * downWeights[t] + up[t] * upWeights[t]) * scale);
+#endif  /* SONIC_USE_FLOAT */
+    }
+    return;
+  }
+  for (t = 0; t < numFrames; t++) {
+    downWeight = downWeights[t];
+    upWeight = upWeights[t];
+    for (i = 0; i < numChannels; i++) {
+#ifdef SONIC_USE_FLOAT
+      *out++ = (*down++ * downWeight + *up++ * upWeight) / divisor;
+#else
+      *out++ = (int)((*down++ * downWeight + *up++ * upWeight) * scale);
+#endif  /* SONIC_USE_FLOAT */
+    }
   }
-  memcpy(stream->outputBuffer + stream->numOutputSamples * stream->numChannels,
-         samples, numSamples * sizeof(short) * stream->numChannels);
-  stream->numOutputSamples += numSamples;
-  return 1;
 }
 
-/* Just copy from the input buffer to the output buffer.  Return 0 if we fail to
-   resize the output buffer.  Otherwise, return numSamples */
-static int copyInputToOutput(sonicStream stream, int position) {
-  int numSamples = stream->remainingInputToCopy;
+/* Overlap-add numFrames frames like overlapAddScalar, but with weights that
+   start at downWeight and upWeight and change by downStep and upStep each
+   frame.  This handles overlaps too long for the tables. */
+static void overlapAddPlain(sonicSample* SONIC_RESTRICT out, sonicSample* down,
+                            sonicSample* up, int downWeight, int downStep,
+                            int upWeight, int upStep, int numFrames,
+                            int numChannels, int divisor) {
+  int t, i;
 
-  if (numSamples > stream->maxRequired) {
-    numSamples = stream->maxRequired;
-  }
-  if (!copyToOutput(stream,
-                    stream->inputBuffer + position * stream->numChannels,
-                    numSamples)) {
-    return 0;
+  for (t = 0; t < numFrames; t++) {
+    for (i = 0; i < numChannels; i++) {
+      *out++ = (*down++ * downWeight + *up++ * upWeight) / divisor;
+    }
+    downWeight += downStep;
+    upWeight += upStep;
   }
-  stream->remainingInputToCopy -= numSamples;
-  return numSamples;
 }
 
-/* Read data out of the stream.  Sometimes no data will be available, and zero
-   is returned, which is not an error condition. */
+#if !defined(SONIC_USE_FLOAT) && \
+    (defined(SONIC_X86_SIMD) || defined(SONIC_NEON_SIMD))
+
+/* Frames of more than two channels are overlap-added this many samples at a
+   time.  It is a multiple of both 6 and 8. */
+#define SONIC_OVERLAP_BLOCK 384
+
+/* Overlap-add frames of more than two channels with a mono kernel.  Each
+   frame's weights are repeated for all its channels, a block at a time, so the
+   mono kernel can run straight through the interleaved samples. */
+static void overlapAddBlocks(void (*overlapAddMono)(short*, short*, short*,
+                                                    short*, short*, int, int,
+                                                    int),
+                             short* out, short* down, short* up,
+                             short* downWeights, short* upWeights,
+                             int numFrames, int numChannels, int divisor) {
+  short downBlock[SONIC_OVERLAP_BLOCK + 8], upBlock[SONIC_OVERLAP_BLOCK + 8];
+  int framesPerBlock = SONIC_OVERLAP_BLOCK / numChannels;
+  int t, i, j, k, numBlockFrames, offset;
+  short downWeight, upWeight;
+
+  if (framesPerBlock < 8) {
+    overlapAddScalar(out, down, up, downWeights, upWeights, numFrames,
+                     numChannels, divisor);
+    return;
+  }
+  for (t = 0; t < numFrames; t += numBlockFrames) {
+    numBlockFrames = numFrames - t;
+    if (numBlockFrames > framesPerBlock) {
+      numBlockFrames = framesPerBlock;
+    }
+    /* Fill eight weights at a time, which the compiler can do with one
+       vector store.  The extra ones are overwritten by the next frame, or
+       land in the padding at the end. */
+    for (i = 0; i < numBlockFrames; i++) {
+      downWeight = downWeights[t + i];
+      upWeight = upWeights[t + i];
+      for (j = 0; j < numChannels; j += 8) {
+        for (k = 0; k < 8; k++) {
+          downBlock[i * numChannels + j + k] = downWeight;
+          upBlock[i * numChannels + j + k] = upWeight;
+        }
+      }
+    }
+    offset = t * numChannels;
+    overlapAddMono(out + offset, down + offset, up + offset, downBlock, upBlock,
+                   numBlockFrames * numChannels, 1, divisor);
+  }
+}
+
+#endif
+
+#if !defined(SONIC_USE_FLOAT) && defined(SONIC_X86_SIMD)
+
+/* Multiply four sums by scale from getAverageScale, truncating toward zero.
+   Doubles hold the products exactly enough for that to match dividing. */
+__attribute__((target("sse2"))) static __m128i divideSSE2(__m128i sums,
+                                                          __m128d scale) {
+  __m128i low = _mm_cvttpd_epi32(_mm_mul_pd(_mm_cvtepi32_pd(sums), scale));
+  __m128i high = _mm_cvttpd_epi32(
+      _mm_mul_pd(_mm_cvtepi32_pd(_mm_unpackhi_epi64(sums, sums)), scale));
+
+  return _mm_unpacklo_epi64(low, high);
+}
+
+/* SSE2 version of overlapAddScalar.  Interleaving the samples with their
+   weights lets one multiply-add do both products.  Stereo frames repeat each
+   weight for both channels, and more channels go through overlapAddBlocks. */
+__attribute__((target("sse2"))) static void overlapAddSSE2(
+    short* out, short* down, short* up, short* downWeights, short* upWeights,
+    int numFrames, int numChannels, int divisor) {
+  __m128d scale = _mm_set1_pd(getAverageScale(divisor));
+  __m128i samplesDown, samplesUp, weightsDown, weightsUp, low, high;
+  int numSamples = numFrames * numChannels;
+  int i = 0;
+
+  if (numChannels > 2) {
+    overlapAddBlocks(overlapAddSSE2, out, down, up, downWeights, upWeights,
+                     numFrames, numChannels, divisor);
+    return;
+  }
+  for (; i + 8 <= numSamples; i += 8) {
+    samplesDown = _mm_loadu_si128((__m128i*)(down + i));
+    samplesUp = _mm_loadu_si128((__m128i*)(up + i));
+    if (numChannels == 1) {
+      weightsDown = _mm_loadu_si128((__m128i*)(downWeights + i));
+      weightsUp = _mm_loadu_si128((__m128i*)(upWeights + i));
+    } else {
+      weightsDown = _mm_loadl_epi64((__m128i*)(downWeights + i / 2));
+      weightsDown = _mm_unpacklo_epi16(weightsDown, weightsDown);
+      weightsUp = _mm_loadl_epi64((__m128i*)(upWeights + i / 2));
+      weightsUp = _mm_unpacklo_epi16(weightsUp, weightsUp);
+    }
+    low = _mm_madd_epi16(_mm_unpacklo_epi16(samplesDown, samplesUp),
+                         _mm_unpacklo_epi16(weightsDown, weightsUp));
+    high = _mm_madd_epi16(_mm_unpackhi_epi16(samplesDown, samplesUp),
+                          _mm_unpackhi_epi16(weightsDown, weightsUp));
+    _mm_storeu_si128((__m128i*)(out + i),
+                     _mm_packs_epi32(divideSSE2(low, scale),
+                                     divideSSE2(high, scale)));
+  }
+  overlapAddScalar(out + i, down + i, up + i, downWeights + i / numChannels,
+                   upWeights + i / numChannels, numFrames - i / numChannels,
+                   numChannels, divisor);
+}
+
+#endif  /* SONIC_X86_SIMD */
+
+#if !defined(SONIC_USE_FLOAT) && defined(SONIC_NEON_SIMD)
+
+/* Divide four sums by divisor, truncating toward zero.  32 bit ARM has no
+   vector doubles or divide, but for these sums a float estimate of the
+   quotient is off by at most one, and the remainder says which way. */
+static int16x4_t divideNEON(int32x4_t sums, int32x4_t divisor,
+                            float32x4_t scale) {
+  int32x4_t signs = vshrq_n_s32(sums, 31);
+  int32x4_t magnitudes = vabsq_s32(sums);
+  int32x4_t quotients =
+      vcvtq_s32_f32(vmulq_f32(vcvtq_f32_s32(magnitudes), scale));
+  int32x4_t remainders = vmlsq_s32(magnitudes, quotients, divisor);
+
+  quotients = vaddq_s32(quotients, vreinterpretq_s32_u32(vcltq_s32(
+                                       remainders, vdupq_n_s32(0))));
+  quotients = vsubq_s32(quotients, vreinterpretq_s32_u32(
+                                       vcgeq_s32(remainders, divisor)));
+  return vqmovn_s32(vsubq_s32(veorq_s32(quotients, signs), signs));
+}
+
+/* NEON version of overlapAddSSE2. */
+static void overlapAddNEON(short* out, short* down, short* up,
+                           short* downWeights, short* upWeights, int numFrames,
+                           int numChannels, int divisor) {
+  int32x4_t divisors = vdupq_n_s32(divisor);
+  float32x4_t scale = vdupq_n_f32(1.0f / divisor);
+  int16x8_t samplesDown, samplesUp, weightsDown, weightsUp;
+  int16x4x2_t pairs;
+  int32x4_t low, high;
+  int numSamples = numFrames * numChannels;
+  int i = 0;
+
+  if (numChannels > 2) {
+    overlapAddBlocks(overlapAddNEON, out, down, up, downWeights, upWeights,
+                     numFrames, numChannels, divisor);
+    return;
+  }
+  for (; i + 8 <= numSamples; i += 8) {
+    samplesDown = vld1q_s16(down + i);
+    samplesUp = vld1q_s16(up + i);
+    if (numChannels == 1) {
+      weightsDown = vld1q_s16(downWeights + i);
+      weightsUp = vld1q_s16(upWeights + i);
+    } else {
+      pairs = vzip_s16(vld1_s16(downWeights + i / 2),
+                       vld1_s16(downWeights + i / 2));
+      weightsDown = vcombine_s16(pairs.val[0], pairs.val[1]);
+      pairs = vzip_s16(vld1_s16(upWeights + i / 2),
+                       vld1_s16(upWeights + i / 2));
+      weightsUp = vcombine_s16(pairs.val[0], pairs.val[1]);
+    }
+    low = vmull_s16(vget_low_s16(samplesDown), vget_low_s16(weightsDown));
+    low = vmlal_s16(low, vget_low_s16(samplesUp), vget_low_s16(weightsUp));
+    high = vmull_s16(vget_high_s16(samplesDown), vget_high_s16(weightsDown));
+    high = vmlal_s16(high, vget_high_s16(samplesUp), vget_high_s16(weightsUp));
+    vst1q_s16(out + i, vcombine_s16(divideNEON(low, divisors, scale),
+                                    divideNEON(high, divisors, scale)));
+  }
+  overlapAddScalar(out + i, down + i, up + i, downWeights + i / numChannels,
+                   upWeights + i / numChannels, numFrames - i / numChannels,
+                   numChannels, divisor);
+}
+
+#endif  /* SONIC_NEON_SIMD */
+
+/* The overlap-add kernel used by overlapAdd and overlapAddWithSeparation. */
+static void (*overlapAddFrames)(sonicSample* out, sonicSample* down,
+                                sonicSample* up, sonicRampWeight* downWeights,
+                                sonicRampWeight* upWeights, int numFrames,
+                                int numChannels,
+                                int divisor) = overlapAddScalar;
+
+/* Convert a float sample to 16 bits, clipping it if it is out of range. */
+static short floatToShort(float value) {
+  value *= 32767.0f;
+  if (value > 32767.0f) {
+    return 32767;
+  } else if (value < -32767.0f) {
+    return -32767;
+  }
+  return (short)value;
+}
+
+#ifndef SONIC_USE_FLOAT
+
+/* Volumes are applied to 16 bit samples as fixed point numbers with 12
+   fraction bits.  The kernels leave samples alone at SONIC_VOLUME_ONE, rather
+   than clipping them. */
+#define SONIC_VOLUME_BITS 12
+#define SONIC_VOLUME_ONE (1 << SONIC_VOLUME_BITS)
+
+/* Return the fixed point version of the volume. */
+static int getFixedPointVolume(float volume) {
+  return volume == 1.0f ? SONIC_VOLUME_ONE : (int)(volume * 4096.0f);
+}
+
+/* Scale the sample by the fixed point volume, and clip it. */
+static int scaleSample(int sample, int fixedPointVolume) {
+  int value = (sample * fixedPointVolume) >> SONIC_VOLUME_BITS;
+
+  if (value > 32767) {
+    return 32767;
+  } else if (value < -32767) {
+    return -32767;
+  }
+  return value;
+}
+
+/* Scale the sample like scaleSample, but leave it alone at SONIC_VOLUME_ONE,
+   like the kernels below. */
+static int applyVolume(int sample, int fixedPointVolume) {
+  if (fixedPointVolume == SONIC_VOLUME_ONE) {
+    return sample;
+  }
+  return scaleSample(sample, fixedPointVolume);
+}
+
+/* Copy count samples from in to out, scaled by the fixed point volume.  In and
+   out can be the same buffer. */
+static void scaleShortsScalar(short* in, short* out, int count,
+                              int fixedPointVolume) {
+  if (fixedPointVolume == SONIC_VOLUME_ONE) {
+    memmove(out, in, count * sizeof(short));
+    return;
+  }
+  while (count--) {
+    *out++ = scaleSample(*in++, fixedPointVolume);
+  }
+}
+
+/* Convert count samples to floats, scaling them by the volume on the way. */
+static void shortsToFloatsScalar(short* in, float* out, int count,
+                                 int fixedPointVolume) {
+  if (fixedPointVolume == SONIC_VOLUME_ONE) {
+    while (count--) {
+      *out++ = (*in++) / 32767.0f;
+    }
+  } else {
+    while (count--) {
+      *out++ = scaleSample(*in++, fixedPointVolume) / 32767.0f;
+    }
+  }
+}
+
+/* Convert count samples to unsigned chars, scaling them by the volume on the
+   way. */
+static void shortsToUnsignedCharsScalar(short* in, unsigned char* out,
+                                        int count, int fixedPointVolume) {
+  if (fixedPointVolume == SONIC_VOLUME_ONE) {
+    while (count--) {
+      *out++ = (char)((*in++) >> 8) + 128;
+    }
+  } else {
+    while (count--) {
+      *out++ = (char)(scaleSample(*in++, fixedPointVolume) >> 8) + 128;
+    }
+  }
+}
+
+/* Convert count float samples to 16 bits, clipping them. */
+static void floatsToShortsScalar(float* in, short* out, int count) {
+  while (count--) {
+    *out++ = floatToShort(*in++);
+  }
+}
+
+/* Convert count unsigned char samples to 16 bits. */
+static void unsignedCharsToShortsScalar(unsigned char* in, short* out,
+                                        int count) {
+  while (count--) {
+    *out++ = (*in++ - 128) * 256;
+  }
+}
+
+#ifdef SONIC_X86_SIMD
+
+/* Scale eight samples by a fixed point volume that fits in 16 bits, clipping
+   them just like scaleSample. */
+__attribute__((target("sse2"))) static __m128i scaleVectorSSE2(
+    __m128i samples, __m128i volume) {
+  __m128i low = _mm_mullo_epi16(samples, volume);
+  __m128i high = _mm_mulhi_epi16(samples, volume);
+
+  samples = _mm_packs_epi32(
+      _mm_srai_epi32(_mm_unpacklo_epi16(low, high), SONIC_VOLUME_BITS),
+      _mm_srai_epi32(_mm_unpackhi_epi16(low, high), SONIC_VOLUME_BITS));
+  return _mm_max_epi16(samples, _mm_set1_epi16(-32767));
+}
+
+/* SSE2 version of scaleShortsScalar. */
+__attribute__((target("sse2"))) static void scaleShortsSSE2(
+    short* in, short* out, int count, int fixedPointVolume) {
+  __m128i volume = _mm_set1_epi16((short)fixedPointVolume);
+  int i = 0;
+
+  if (fixedPointVolume != SONIC_VOLUME_ONE && fixedPointVolume >= -32768 &&
+      fixedPointVolume <= 32767) {
+    for (; i + 8 <= count; i += 8) {
+      _mm_storeu_si128(
+          (__m128i*)(out + i),
+          scaleVectorSSE2(_mm_loadu_si128((__m128i*)(in + i)), volume));
+    }
+  }
+  scaleShortsScalar(in + i, out + i, count - i, fixedPointVolume);
+}
+
+/* SSE2 version of shortsToFloatsScalar. */
+__attribute__((target("sse2"))) static void shortsToFloatsSSE2(
+    short* in, float* out, int count, int fixedPointVolume) {
+  __m128i volume = _mm_set1_epi16((short)fixedPointVolume);
+  __m128 scale = _mm_set1_ps(32767.0f);
+  __m128i samples, low, high;
+  int i = 0;
+
+  if (fixedPointVolume >= -32768 && fixedPointVolume <= 32767) {
+    for (; i + 8 <= count; i += 8) {
+      samples = _mm_loadu_si128((__m128i*)(in + i));
+      if (fixedPointVolume != SONIC_VOLUME_ONE) {
+        samples = scaleVectorSSE2(samples, volume);
+      }
+      low = _mm_srai_epi32(_mm_unpacklo_epi16(samples, samples), 16);
+      high = _mm_srai_epi32(_mm_unpackhi_epi16(samples, samples), 16);
+      _mm_storeu_ps(out + i, _mm_div_ps(_mm_cvtepi32_ps(low), scale));
+      _mm_storeu_ps(out + i + 4, _mm_div_ps(_mm_cvtepi32_ps(high), scale));
+    }
+  }
+  shortsToFloatsScalar(in + i, out + i, count - i, fixedPointVolume);
+}
+
+/* SSE2 version of shortsToUnsignedCharsScalar. */
+__attribute__((target("sse2"))) static void shortsToUnsignedCharsSSE2(
+    short* in, unsigned char* out, int count, int fixedPointVolume) {
+  __m128i volume = _mm_set1_epi16((short)fixedPointVolume);
+  __m128i offset = _mm_set1_epi8((char)0x80);
+  __m128i low, high;
+  int i = 0;
+
+  if (fixedPointVolume >= -32768 && fixedPointVolume <= 32767) {
+    for (; i + 16 <= count; i += 16) {
+      low = _mm_loadu_si128((__m128i*)(in + i));
+      high = _mm_loadu_si128((__m128i*)(in + i + 8));
+      if (fixedPointVolume != SONIC_VOLUME_ONE) {
+        low = scaleVectorSSE2(low, volume);
+        high = scaleVectorSSE2(high, volume);
+      }
+      low = _mm_packs_epi16(_mm_srai_epi16(low, 8), _mm_srai_epi16(high, 8));
+      _mm_storeu_si128((__m128i*)(out + i), _mm_xor_si128(low, offset));
+    }
+  }
+  shortsToUnsignedCharsScalar(in + i, out + i, count - i, fixedPointVolume);
+}
+
+/* SSE2 version of floatsToShortsScalar. */
+__attribute__((target("sse2"))) static void floatsToShortsSSE2(float* in,
+                                                               short* out,
+                                                               int count) {
+  __m128 scale = _mm_set1_ps(32767.0f);
+  __m128 maximum = _mm_set1_ps(32767.0f);
+  __m128 minimum = _mm_set1_ps(-32767.0f);
+  __m128 low, high;
+  int i = 0;
+
+  for (; i + 8 <= count; i += 8) {
+    low = _mm_mul_ps(_mm_loadu_ps(in + i), scale);
+    high = _mm_mul_ps(_mm_loadu_ps(in + i + 4), scale);
+    low = _mm_max_ps(_mm_min_ps(low, maximum), minimum);
+    high = _mm_max_ps(_mm_min_ps(high, maximum), minimum);
+    _mm_storeu_si128((__m128i*)(out + i),
+                     _mm_packs_epi32(_mm_cvttps_epi32(low),
+                                     _mm_cvttps_epi32(high)));
+  }
+  floatsToShortsScalar(in + i, out + i, count - i);
+}
+
+/* SSE2 version of unsignedCharsToShortsScalar. */
+__attribute__((target("sse2"))) static void unsignedCharsToShortsSSE2(
+    unsigned char* in, short* out, int count) {
+  __m128i offset = _mm_set1_epi8((char)0x80);
+  __m128i zero = _mm_setzero_si128();
+  __m128i samples;
+  int i = 0;
+
+  for (; i + 16 <= count; i += 16) {
+    samples = _mm_xor_si128(_mm_loadu_si128((__m128i*)(in + i)), offset);
+    _mm_storeu_si128((__m128i*)(out + i), _mm_unpacklo_epi8(zero, samples));
+    _mm_storeu_si128((__m128i*)(out + i + 8),
+                     _mm_unpackhi_epi8(zero, samples));
+  }
+  unsignedCharsToShortsScalar(in + i, out + i, count - i);
+}
+
+#endif  /* SONIC_X86_SIMD */
+
+#ifdef SONIC_NEON_SIMD
+
+/* NEON version of scaleVectorSSE2. */
+static int16x8_t scaleVectorNEON(int16x8_t samples, int16x4_t volume) {
+  int32x4_t low = vmull_s16(vget_low_s16(samples), volume);
+  int32x4_t high = vmull_s16(vget_high_s16(samples), volume);
+
+  samples =
+      vcombine_s16(vqmovn_s32(vshrq_n_s32(low, SONIC_VOLUME_BITS)),
+                   vqmovn_s32(vshrq_n_s32(high, SONIC_VOLUME_BITS)));
+  return vmaxq_s16(samples, vdupq_n_s16(-32767));
+}
+
+/* NEON version of scaleShortsScalar. */
+static void scaleShortsNEON(short* in, short* out, int count,
+                            int fixedPointVolume) {
+  int16x4_t volume = vdup_n_s16((short)fixedPointVolume);
+  int i = 0;
+
+  if (fixedPointVolume != SONIC_VOLUME_ONE && fixedPointVolume >= -32768 &&
+      fixedPointVolume <= 32767) {
+    for (; i + 8 <= count; i += 8) {
+      vst1q_s16(out + i, scaleVectorNEON(vld1q_s16(in + i), volume));
+    }
+  }
+  scaleShortsScalar(in + i, out + i, count - i, fixedPointVolume);
+}
+
+#ifdef __aarch64__
+/* NEON version of shortsToFloatsScalar.  32 bit ARM has no vector divide,
+   which is needed to match the scalar results, so this is 64 bit only. */
+static void shortsToFloatsNEON(short* in, float* out, int count,
+                               int fixedPointVolume) {
+  int16x4_t volume = vdup_n_s16((short)fixedPointVolume);
+  float32x4_t scale = vdupq_n_f32(32767.0f);
+  int16x8_t samples;
+  int i = 0;
+
+  if (fixedPointVolume >= -32768 && fixedPointVolume <= 32767) {
+    for (; i + 8 <= count; i += 8) {
+      samples = vld1q_s16(in + i);
+      if (fixedPointVolume != SONIC_VOLUME_ONE) {
+        samples = scaleVectorNEON(samples, volume);
+      }
+      vst1q_f32(out + i,
+                vdivq_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(samples))),
+                          scale));
+      vst1q_f32(out + i + 4,
+                vdivq_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(samples))),
+                          scale));
+    }
+  }
+  shortsToFloatsScalar(in + i, out + i, count - i, fixedPointVolume);
+}
+#endif  /* __aarch64__ */
+
+/* NEON version of shortsToUnsignedCharsScalar. */
+static void shortsToUnsignedCharsNEON(short* in, unsigned char* out,
+                                      int count, int fixedPointVolume) {
+  int16x4_t volume = vdup_n_s16((short)fixedPointVolume);
+  int16x8_t samples;
+  int i = 0;
+
+  if (fixedPointVolume >= -32768 && fixedPointVolume <= 32767) {
+    for (; i + 8 <= count; i += 8) {
+      samples = vld1q_s16(in + i);
+      if (fixedPointVolume != SONIC_VOLUME_ONE) {
+        samples = scaleVectorNEON(samples, volume);
+      }
+      vst1_u8(out + i,
+              veor_u8(vreinterpret_u8_s8(vqmovn_s16(vshrq_n_s16(samples, 8))),
+                      vdup_n_u8(0x80)));
+    }
+  }
+  shortsToUnsignedCharsScalar(in + i, out + i, count - i, fixedPointVolume);
+}
+
+/* NEON version of floatsToShortsScalar. */
+static void floatsToShortsNEON(float* in, short* out, int count) {
+  float32x4_t maximum = vdupq_n_f32(32767.0f);
+  float32x4_t minimum = vdupq_n_f32(-32767.0f);
+  float32x4_t low, high;
+  int i = 0;
+
+  for (; i + 8 <= count; i += 8) {
+    low = vmulq_n_f32(vld1q_f32(in + i), 32767.0f);
+    high = vmulq_n_f32(vld1q_f32(in + i + 4), 32767.0f);
+    low = vmaxq_f32(vminq_f32(low, maximum), minimum);
+    high = vmaxq_f32(vminq_f32(high, maximum), minimum);
+    vst1q_s16(out + i, vcombine_s16(vqmovn_s32(vcvtq_s32_f32(low)),
+                                    vqmovn_s32(vcvtq_s32_f32(high))));
+  }
+  floatsToShortsScalar(in + i, out + i, count - i);
+}
+
+/* NEON version of unsignedCharsToShortsScalar. */
+static void unsignedCharsToShortsNEON(unsigned char* in, short* out,
+                                      int count) {
+  uint16x8_t samples;
+  int i = 0;
+
+  for (; i + 8 <= count; i += 8) {
+    samples = vmovl_u8(veor_u8(vld1_u8(in + i), vdup_n_u8(0x80)));
+    vst1q_s16(out + i, vreinterpretq_s16_u16(vshlq_n_u16(samples, 8)));
+  }
+  unsignedCharsToShortsScalar(in + i, out + i, count - i);
+}
+
+#endif  /* SONIC_NEON_SIMD */
+
+/* The sample format conversion kernels used by the read and write
+   functions. */
+static void (*scaleShorts)(short* in, short* out, int count,
+                           int fixedPointVolume) = scaleShortsScalar;
+static void (*shortsToFloats)(short* in, float* out, int count,
+                              int fixedPointVolume) = shortsToFloatsScalar;
+static void (*shortsToUnsignedChars)(short* in, unsigned char* out, int count,
+                                     int fixedPointVolume) =
+    shortsToUnsignedCharsScalar;
+static void (*floatsToShorts)(float* in, short* out,
+                              int count) = floatsToShortsScalar;
+static void (*unsignedCharsToShorts)(unsigned char* in, short* out,
+                                     int count) = unsignedCharsToShortsScalar;
+
+#endif  /* SONIC_USE_FLOAT */
+
+/* Pick the fastest kernels this CPU supports.  This is called whenever a
+   stream is created.  Every call writes the same values, so it is safe to
+   call from multiple threads. */
+static void selectSimdKernels(void) {
+#if defined(SONIC_X86_SIMD)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    computeAmdf = computeAmdfAVX2;
+#ifndef SONIC_USE_FLOAT
+    computeSincDot = computeSincDotAVX2;
+    computeSincDots = computeSincDotsAVX2;
+#endif  /* SONIC_USE_FLOAT */
+  } else if (__builtin_cpu_supports("sse2")) {
+    computeAmdf = computeAmdfSSE2;
+  }
+#ifndef SONIC_USE_FLOAT
+  if (__builtin_cpu_supports("sse2")) {
+    averageBlocks = averageBlocksSSE2;
+    overlapAddFrames = overlapAddSSE2;
+    scaleShorts = scaleShortsSSE2;
+    shortsToFloats = shortsToFloatsSSE2;
+    shortsToUnsignedChars = shortsToUnsignedCharsSSE2;
+    floatsToShorts = floatsToShortsSSE2;
+    unsignedCharsToShorts = unsignedCharsToShortsSSE2;
+  }
+#endif  /* SONIC_USE_FLOAT */
+#elif defined(SONIC_NEON_SIMD)
+  computeAmdf = computeAmdfNEON;
+#ifndef SONIC_USE_FLOAT
+  averageBlocks = averageBlocksNEON;
+  overlapAddFrames = overlapAddNEON;
+  scaleShorts = scaleShortsNEON;
+#ifdef __aarch64__
+  shortsToFloats = shortsToFloatsNEON;
+#endif  /* __aarch64__ */
+  shortsToUnsignedChars = shortsToUnsignedCharsNEON;
+  floatsToShorts = floatsToShortsNEON;
+  unsignedCharsToShorts = unsignedCharsToShortsNEON;
+#endif  /* SONIC_USE_FLOAT */
+#endif
+}
+
+/* Scale the samples by the volume, in place. */
+#ifdef SONIC_USE_FLOAT
+static void scaleSamples(float* samples, int numSamples, float volume) {
+  while (numSamples--) {
+    *samples++ *= volume;
+  }
+}
+#else
+static void scaleSamples(short* samples, int numSamples, float volume) {
+  scaleShorts(samples, samples, numSamples, getFixedPointVolume(volume));
+}
+#endif  /* SONIC_USE_FLOAT */
+
+/* Get the speed of the stream. */
+float sonicGetSpeed(sonicStream stream) { return stream->speed; }
+
+/* Set the speed of the stream. */
+void sonicSetSpeed(sonicStream stream, float speed) {
+  stream->speed = speed;
+  stream->numRamps[SONIC_PARAM_SPEED] = 0;
+}
+
+/* Get the pitch of the stream. */
+float sonicGetPitch(sonicStream stream) { return stream->pitch; }
+
+/* Set the pitch of the stream. */
+void sonicSetPitch(sonicStream stream, float pitch) {
+  stream->pitch = pitch;
+  stream->numRamps[SONIC_PARAM_PITCH] = 0;
+}
+
+/* Get the rate of the stream. */
+float sonicGetRate(sonicStream stream) { return stream->rate; }
+
+/* Set the playback rate of the stream. This scales pitch and speed at the same
+   time.  adjustRate picks up from where it was at the old rate. */
+void sonicSetRate(sonicStream stream, float rate) {
+  stream->rate = rate;
+  stream->numRamps[SONIC_PARAM_RATE] = 0;
+}
+
+/* Get the vocal chord pitch setting. */
+int sonicGetChordPitch(sonicStream stream) { return stream->useChordPitch; }
+
+/* Set the vocal chord mode for pitch computation.  Default is off. */
+void sonicSetChordPitch(sonicStream stream, int useChordPitch) {
+  stream->useChordPitch = useChordPitch;
+}
+
+/* Get the nonlinear speedup setting. */
+int sonicGetNonlinearSpeedup(sonicStream stream) {
+  return stream->nonlinearSpeedup;
+}
+
+/* Speed up silence and unvoiced sounds more than voiced speech.  Default is
+   off. */
+void sonicSetNonlinearSpeedup(sonicStream stream, int enable) {
+  stream->nonlinearSpeedup = enable;
+}
+
+/* Get the down sampled rate for the pitch search. */
+int sonicGetAmdfFreq(sonicStream stream) { return stream->amdfFreq; }
+
+/* Set the down sampled rate for the pitch search.  0 means never down
+   sample. */
+void sonicSetAmdfFreq(sonicStream stream, int amdfFreq) {
+  stream->amdfFreq = amdfFreq;
+}
+
+/* Get the pitch low-pass setting. */
+int sonicGetPitchLowPass(sonicStream stream) { return stream->pitchLowPass; }
+
+/* Low-pass filter the down sampled pitch search input.  Default is off. */
+void sonicSetPitchLowPass(sonicStream stream, int enable) {
+  stream->pitchLowPass = enable;
+}
+
+/* Get the pitch tracking setting. */
+int sonicGetPitchTracking(sonicStream stream) { return stream->pitchTracking; }
+
+/* Search near the last pitch period before searching the whole range.  Default
+   is off. */
+void sonicSetPitchTracking(sonicStream stream, int enable) {
+  stream->pitchTracking = enable;
+}
+
+/* Get the low latency setting. */
+int sonicGetLowLatency(sonicStream stream) { return stream->lowLatency; }
+
+/* Find pitch periods from input that has already been processed, rather than
+   waiting for future input.  Default is off. */
+void sonicSetLowLatency(sonicStream stream, int enable) {
+  stream->lowLatency = enable;
+}
+
+/* Get the quality setting. */
+int sonicGetQuality(sonicStream stream) { return stream->quality; }
+
+/* Set the "quality".  Default 0 is virtually as good as 1, but very much
+   faster. */
+void sonicSetQuality(sonicStream stream, int quality) {
+  stream->quality = quality;
+}
+
+/* Get the pitch detection method. */
+int sonicGetPitchMethod(sonicStream stream) { return stream->pitchMethod; }
+
+/* Set the pitch detection method, either SONIC_PITCH_AMDF or SONIC_PITCH_FFT.
+   The FFT work buffers are allocated on the first pitch search that needs
+   them. */
+void sonicSetPitchMethod(sonicStream stream, int pitchMethod) {
+  stream->pitchMethod = pitchMethod;
+}
+
+/* Get the mask of channels the pitch search listens to. */
+int sonicGetPitchChannelMask(sonicStream stream) {
+  return stream->pitchChannelMask;
+}
+
+/* Set the mask of channels whose mix drives the pitch search.  Bit i selects
+   channel i.  0, the default, selects them all. */
+void sonicSetPitchChannelMask(sonicStream stream, int mask) {
+  stream->pitchChannelMask = mask;
+}
+
+/* Get the pitch marks the stream uses or records. */
+sonicPitchMarks sonicGetPitchMarks(sonicStream stream) {
+  return stream->pitchMarks;
+}
+
+/* Use the pitch periods in pitchMarks rather than searching for them.  NULL,
+   the default, searches. */
+void sonicSetPitchMarks(sonicStream stream, sonicPitchMarks pitchMarks) {
+  stream->pitchMarks = pitchMarks;
+  stream->recordPitchMarks = 0;
+}
+
+/* Add the pitch periods found in the input to pitchMarks, rather than
+   changing its speed. */
+void sonicRecordPitchMarks(sonicStream stream, sonicPitchMarks pitchMarks) {
+  stream->pitchMarks = pitchMarks;
+  stream->recordPitchMarks = pitchMarks != NULL;
+}
+
+/* Get the scaling factor of the stream. */
+float sonicGetVolume(sonicStream stream) { return stream->volume; }
+
+/* Set the scaling factor of the stream. */
+void sonicSetVolume(sonicStream stream, float volume) {
+  stream->volume = volume;
+  stream->numRamps[SONIC_PARAM_VOLUME] = 0;
+}
+
+/* Return a pointer to the stream's value for parameter. */
+static float* getParameter(sonicStream stream, int parameter) {
+  switch (parameter) {
+    case SONIC_PARAM_SPEED:
+      return &stream->speed;
+    case SONIC_PARAM_PITCH:
+      return &stream->pitch;
+    case SONIC_PARAM_RATE:
+      return &stream->rate;
+    default:
+      return &stream->volume;
+  }
+}
+
+/* Return the input position just after the last sample written. */
+long sonicGetInputPosition(sonicStream stream) {
+  return stream->inputPosition + stream->numInputSamples;
+}
+
+/* Schedule a linear ramp of parameter to value at input position. */
+int sonicRampParameter(sonicStream stream, int parameter, long position,
+                       float value) {
+  sonicRamp* ramp;
+  int numRamps;
+
+  if (parameter < 0 || parameter >= SONIC_NUM_PARAMS) {
+    return 0;
+  }
+  numRamps = stream->numRamps[parameter];
+  if (numRamps == SONIC_MAX_RAMPS ||
+      position <= sonicGetInputPosition(stream) ||
+      (numRamps > 0 &&
+       position <= stream->ramps[parameter][numRamps - 1].position)) {
+    return 0;
+  }
+  if (numRamps == 0) {
+    stream->rampStartPositions[parameter] = sonicGetInputPosition(stream);
+    stream->rampStartValues[parameter] = *getParameter(stream, parameter);
+  }
+  ramp = stream->ramps[parameter] + numRamps;
+  ramp->position = position;
+  ramp->value = value;
+  stream->numRamps[parameter]++;
+  return 1;
+}
+
+/* Return true if any parameter has ramps scheduled. */
+static int rampsPending(sonicStream stream) {
+  int parameter;
+
+  for (parameter = 0; parameter < SONIC_NUM_PARAMS; parameter++) {
+    if (stream->numRamps[parameter] != 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Set the ramped parameters to their values at input position, and drop the
+   ramps that have ended.  Positions only move forward. */
+static void applyRamps(sonicStream stream, long position) {
+  sonicRamp* ramps;
+  long startPosition;
+  float startValue;
+  float* value;
+  int parameter;
+
+  for (parameter = 0; parameter < SONIC_NUM_PARAMS; parameter++) {
+    ramps = stream->ramps[parameter];
+    value = getParameter(stream, parameter);
+    while (stream->numRamps[parameter] > 0 && ramps->position <= position) {
+      stream->rampStartPositions[parameter] = ramps->position;
+      stream->rampStartValues[parameter] = ramps->value;
+      *value = ramps->value;
+      stream->numRamps[parameter]--;
+      memmove(ramps, ramps + 1,
+              stream->numRamps[parameter] * sizeof(sonicRamp));
+    }
+    startPosition = stream->rampStartPositions[parameter];
+    if (stream->numRamps[parameter] > 0 && position > startPosition) {
+      startValue = stream->rampStartValues[parameter];
+      *value = startValue + (ramps->value - startValue) *
+                                (position - startPosition) /
+                                (ramps->position - startPosition);
+    }
+  }
+}
+
+/* Start counting input positions from position, and output positions from
+   zero. */
+static void startPositionsAt(sonicStream stream, long position) {
+  stream->inputPosition = position;
+  stream->outputPosition = 0;
+  stream->syncPoints[0].inputPosition = position;
+  stream->syncPoints[0].outputPosition = 0;
+  stream->firstSyncPoint = 0;
+  stream->numSyncPoints = 1;
+}
+
+/* Drop all scheduled ramps, and start counting positions over. */
+static void clearRamps(sonicStream stream) {
+  memset(stream->numRamps, 0, sizeof(stream->numRamps));
+  startPositionsAt(stream, 0);
+}
+
+/* Return how many output samples the stream makes from each input sample with
+   its current parameters.  Chord pitch ignores the rate. */
+static double getOutputRatio(sonicStream stream) {
+  if (stream->useChordPitch) {
+    return 1.0 / stream->speed;
+  }
+  return 1.0 / (stream->speed * stream->rate);
+}
+
+/* Return the sync point index steps after the oldest one. */
+static sonicSyncPoint* getSyncPoint(sonicStream stream, int index) {
+  return stream->syncPoints +
+         (stream->firstSyncPoint + index) % SONIC_MAX_SYNC_POINTS;
+}
+
+/* Record that the processed input lines up with the output made so far,
+   counting the samples waiting in the pitch buffer as the output they will
+   become.  Points closer together than maxRequired input samples are merged,
+   and points the new one makes out of order, as flushing does, are dropped. */
+static void addSyncPoint(sonicStream stream) {
+  long inputPosition = stream->inputPosition;
+  long outputPosition = stream->outputPosition + stream->numOutputSamples;
+  float rate = stream->pitch;
+  sonicSyncPoint *last, *point;
+
+  if (!stream->useChordPitch) {
+    rate *= stream->rate;
+  }
+  outputPosition += (long)(stream->numPitchSamples / rate + 0.5f);
+  while (stream->numSyncPoints > 1) {
+    last = getSyncPoint(stream, stream->numSyncPoints - 1);
+    if (last->inputPosition < inputPosition &&
+        last->outputPosition <= outputPosition &&
+        last->inputPosition - getSyncPoint(stream, stream->numSyncPoints - 2)
+                ->inputPosition >= stream->maxRequired) {
+      break;
+    }
+    stream->numSyncPoints--;
+  }
+  last = getSyncPoint(stream, stream->numSyncPoints - 1);
+  if (last->inputPosition >= inputPosition ||
+      last->outputPosition > outputPosition) {
+    /* Only the point from the last seek is left, and it stays. */
+    return;
+  }
+  if (stream->numSyncPoints == SONIC_MAX_SYNC_POINTS) {
+    stream->firstSyncPoint =
+        (stream->firstSyncPoint + 1) % SONIC_MAX_SYNC_POINTS;
+    stream->numSyncPoints--;
+  }
+  point = getSyncPoint(stream, stream->numSyncPoints);
+  point->inputPosition = inputPosition;
+  point->outputPosition = outputPosition;
+  stream->numSyncPoints++;
+}
+
+/* Forget the stream buffers without freeing them. */
+static void forgetStreamBuffers(sonicStream stream) {
+  stream->inputBuffer = NULL;
+  stream->outputBuffer = NULL;
+  stream->pitchBuffer = NULL;
+  stream->inputBufferStart = 0;
+  stream->outputBufferStart = 0;
+  stream->pitchBufferStart = 0;
+  stream->downSampleBuffer = NULL;
+  stream->historyBuffer = NULL;
+  stream->rampWeights = NULL;
+  stream->rampLength = 0;
+  stream->fftBuffer = NULL;
+  stream->fftTwiddles = NULL;
+  stream->fftBitReverse = NULL;
+  stream->fftSize = 0;
+  stream->fftCapacity = 0;
+  stream->sincWeights = NULL;
+  stream->sincCapacity = 0;
+  stream->sincNumPhases = 0;
+  stream->sincOldSampleRate = 0;
+  stream->sincNewSampleRate = 0;
+}
+
+/* Free stream buffers. */
+static void freeStreamBuffers(sonicStream stream) {
+  int numChannels = stream->numChannels;
+
+  if (stream->inputBuffer != NULL) {
+    streamFree(stream,
+               stream->inputBuffer - stream->inputBufferStart * numChannels);
+  }
+  if (stream->outputBuffer != NULL) {
+    streamFree(stream,
+               stream->outputBuffer - stream->outputBufferStart * numChannels);
+  }
+  if (stream->pitchBuffer != NULL) {
+    streamFree(stream,
+               stream->pitchBuffer - stream->pitchBufferStart * numChannels);
+  }
+  streamFree(stream, stream->downSampleBuffer);
+  streamFree(stream, stream->historyBuffer);
+  streamFree(stream, stream->rampWeights);
+  streamFree(stream, stream->fftBuffer);
+  streamFree(stream, stream->fftTwiddles);
+  streamFree(stream, stream->fftBitReverse);
+  streamFree(stream, stream->sincWeights);
+  forgetStreamBuffers(stream);
+}
+
+/* Destroy the sonic stream. */
+void sonicDestroyStream(sonicStream stream) {
+#ifdef SONIC_SPECTROGRAM
+  if (stream->spectrogram != NULL) {
+    sonicDestroySpectrogram(stream->spectrogram);
+  }
+#endif  /* SONIC_SPECTROGRAM */
+  freeStreamBuffers(stream);
+  streamFree(stream, stream);
+}
+
+/* Replace the FFT buffers with ones that can hold fftSize points.  Return 0 if
+   we are out of memory. */
+static int reserveFFTBuffers(sonicStream stream, int fftSize) {
+  streamFree(stream, stream->fftBuffer);
+  streamFree(stream, stream->fftTwiddles);
+  streamFree(stream, stream->fftBitReverse);
+  stream->fftSize = 0;
+  stream->fftBuffer = (float*)streamCalloc(stream, 2 * fftSize, sizeof(float));
+  stream->fftTwiddles =
+      (float*)streamCalloc(stream, 2 * fftSize, sizeof(float));
+  stream->fftBitReverse = (int*)streamCalloc(stream, fftSize, sizeof(int));
+  if (stream->fftBuffer == NULL || stream->fftTwiddles == NULL ||
+      stream->fftBitReverse == NULL) {
+    stream->fftCapacity = 0;
+    return 0;
+  }
+  stream->fftCapacity = fftSize;
+  return 1;
+}
+
+/* Replace the polyphase sinc table with one that holds numPhases phases.
+   Return 0 if we are out of memory. */
+static int reserveSincWeights(sonicStream stream, int numPhases) {
+  streamFree(stream, stream->sincWeights);
+  stream->sincNumPhases = 0;
+  stream->sincWeights = (int*)streamCalloc(
+      stream, numPhases * SINC_FILTER_POINTS, sizeof(int));
+  if (stream->sincWeights == NULL) {
+    stream->sincCapacity = 0;
+    return 0;
+  }
+  stream->sincCapacity = numPhases;
+  return 1;
+}
+
+/* Raise the peak buffer sizes in the stats to the current sizes. */
+static void updatePeakBufferSizes(sonicStream stream) {
+  int* peaks = stream->stats.peakBufferSizes;
+
+  if (stream->inputBufferSize > peaks[SONIC_INPUT_BUFFER]) {
+    peaks[SONIC_INPUT_BUFFER] = stream->inputBufferSize;
+  }
+  if (stream->pitchBufferSize > peaks[SONIC_PITCH_BUFFER]) {
+    peaks[SONIC_PITCH_BUFFER] = stream->pitchBufferSize;
+  }
+  if (stream->outputBufferSize > peaks[SONIC_OUTPUT_BUFFER]) {
+    peaks[SONIC_OUTPUT_BUFFER] = stream->outputBufferSize;
+  }
+}
+
+/* Resize a sliding window buffer to hold exactly bufferSize samples, moving
+   the used samples to the start.  Return 0 if we are out of memory. */
+static int resizeBuffer(sonicStream stream, sonicSample** buffer,
+                        int* bufferSize, int* start, int numUsed,
+                        int newBufferSize) {
+  int numChannels = stream->numChannels;
+  sonicSample* base = *buffer - *start * numChannels;
+
+  if (*start > 0 && numUsed > 0) {
+    memmove(base, base + *start * numChannels,
+            numUsed * sizeof(sonicSample) * numChannels);
+  }
+  *buffer = base;
+  *start = 0;
+  if (newBufferSize < numUsed) {
+    newBufferSize = numUsed;
+  }
+  base = (sonicSample*)streamRealloc(
+      stream, base, newBufferSize * sizeof(sonicSample) * numChannels);
+  if (base == NULL) {
+    return 0;
+  }
+  *buffer = base;
+  *bufferSize = newBufferSize;
+  return 1;
+}
+
+/* Allocate everything a stream with a fixed capacity could need, so that
+   processing never allocates.  Return 0 if we are out of memory. */
+static int reserveFixedCapacity(sonicStream stream, int maxInputSamples,
+                                int maxOutputSamples) {
+  /* Room for a partial pitch period left over from the last write, and for
+     the silence sonicFlushStream adds. */
+  int slack = 3 * stream->maxRequired;
+  int fftSize = 1;
+
+  if (!resizeBuffer(stream, &stream->inputBuffer, &stream->inputBufferSize,
+                    &stream->inputBufferStart, stream->numInputSamples,
+                    maxInputSamples + slack) ||
+      !resizeBuffer(stream, &stream->pitchBuffer, &stream->pitchBufferSize,
+                    &stream->pitchBufferStart, stream->numPitchSamples,
+                    maxOutputSamples + slack) ||
+      !resizeBuffer(stream, &stream->outputBuffer, &stream->outputBufferSize,
+                    &stream->outputBufferStart, stream->numOutputSamples,
+                    maxOutputSamples + slack)) {
+    return 0;
+  }
+  /* The largest FFT pitch search is over the full sample rate. */
+  while (fftSize < stream->maxPeriod / 2 + stream->maxPeriod) {
+    fftSize <<= 1;
+  }
+  if (stream->fftCapacity < fftSize && !reserveFFTBuffers(stream, fftSize)) {
+    return 0;
+  }
+  if (stream->sincCapacity < SONIC_FIXED_SINC_PHASES &&
+      !reserveSincWeights(stream, SONIC_FIXED_SINC_PHASES)) {
+    return 0;
+  }
+  updatePeakBufferSizes(stream);
+  return 1;
+}
+
+/* Allocate stream buffers.  Return 0 if we are out of memory, in which case
+   the stream has no buffers left. */
+static int allocateStreamBuffers(sonicStream stream, int sampleRate,
+                                 int numChannels) {
+  int minPeriod = sampleRate / stream->maxPitch;
+  int maxPeriod = sampleRate / stream->minPitch;
+  int maxRequired;
+
+  if (minPeriod < 1) {
+    minPeriod = 1;
+  }
+  if (maxPeriod < minPeriod) {
+    maxPeriod = minPeriod;
+  }
+  maxRequired = 2 * maxPeriod;
+
+  stream->inputBufferSize = maxRequired;
+  stream->inputBuffer = (sonicSample*)streamCalloc(
+      stream, maxRequired, sizeof(sonicSample) * numChannels);
+  if (stream->inputBuffer == NULL) {
+    freeStreamBuffers(stream);
+    return 0;
+  }
+  stream->outputBufferSize = maxRequired;
+  stream->outputBuffer = (sonicSample*)streamCalloc(
+      stream, maxRequired, sizeof(sonicSample) * numChannels);
+  if (stream->outputBuffer == NULL) {
+    freeStreamBuffers(stream);
+    return 0;
+  }
+  stream->pitchBufferSize = maxRequired;
+  stream->pitchBuffer = (sonicSample*)streamCalloc(
+      stream, maxRequired, sizeof(sonicSample) * numChannels);
+  if (stream->pitchBuffer == NULL) {
+    freeStreamBuffers(stream);
+    return 0;
+  }
+  stream->downSampleBuffer =
+      (sonicSample*)streamCalloc(stream, maxRequired, sizeof(sonicSample));
+  if (stream->downSampleBuffer == NULL) {
+    freeStreamBuffers(stream);
+    return 0;
+  }
+  /* Low latency mode searches the last maxRequired input samples, and keeps
+     room for as many again so they rarely need to be moved. */
+  stream->historyBuffer = (sonicSample*)streamCalloc(
+      stream, 2 * maxRequired, sizeof(sonicSample) * numChannels);
+  if (stream->historyBuffer == NULL) {
+    freeStreamBuffers(stream);
+    return 0;
+  }
+  /* The ramp down and ramp up weights, followed by a run of zero weights for
+     the ends of overlapAddWithSeparation.  No overlap is longer than
+     maxPeriod. */
+  stream->rampWeights = (sonicRampWeight*)streamCalloc(
+      stream, 3 * maxPeriod, sizeof(sonicRampWeight));
+  if (stream->rampWeights == NULL) {
+    freeStreamBuffers(stream);
+    return 0;
+  }
+  stream->numHistorySamples = maxRequired;
+  stream->sampleRate = sampleRate;
+  stream->numChannels = numChannels;
+  stream->oldRatePosition = 0;
+  stream->newRatePosition = 0;
+  stream->ratePhase = 0;
+  stream->rateNewSampleRate = 0;
+  clearRamps(stream);
+  stream->minPeriod = minPeriod;
+  stream->maxPeriod = maxPeriod;
+  stream->maxRequired = maxRequired;
+  stream->prevPeriod = 0;
+  updatePeakBufferSizes(stream);
+  if (stream->fixedInputSamples != 0 &&
+      !reserveFixedCapacity(stream, stream->fixedInputSamples,
+                            stream->fixedOutputSamples)) {
+    freeStreamBuffers(stream);
+    return 0;
+  }
+  return 1;
+}
+
+/* Create a sonic stream that gets all its memory from allocFunc, reallocFunc
+   and freeFunc, which are passed context.  Return NULL only if we are out of
+   memory and cannot allocate the stream. */
+sonicStream sonicCreateStreamWithAllocator(int sampleRate, int numChannels,
+                                           sonicAllocFunc allocFunc,
+                                           sonicReallocFunc reallocFunc,
+                                           sonicFreeFunc freeFunc,
+                                           void* context) {
+  sonicStream stream =
+      (sonicStream)allocFunc(context, sizeof(struct sonicStreamStruct));
+
+  if (stream == NULL) {
+    return NULL;
+  }
+  memset(stream, 0, sizeof(struct sonicStreamStruct));
+  stream->allocFunc = allocFunc;
+  stream->reallocFunc = reallocFunc;
+  stream->freeFunc = freeFunc;
+  stream->allocContext = context;
+  stream->minPitch = SONIC_MIN_PITCH;
+  stream->maxPitch = SONIC_MAX_PITCH;
+  stream->amdfFreq = SONIC_AMDF_FREQ;
+  selectSimdKernels();
+  if (!allocateStreamBuffers(stream, sampleRate, numChannels)) {
+    sonicDestroyStream(stream);
+    return NULL;
+  }
+  stream->speed = 1.0f;
+  stream->pitch = 1.0f;
+  stream->volume = 1.0f;
+  stream->outputVolume = 1.0f;
+  stream->rate = 1.0f;
+  stream->oldRatePosition = 0;
+  stream->newRatePosition = 0;
+  stream->useChordPitch = 0;
+  stream->quality = 0;
+  stream->pitchMethod = SONIC_PITCH_AMDF;
+  stream->avePower = 50.0f;
+  stream->aveInverseWeight = 1.0f;
+  stream->nonlinearError = 0.0f;
+  return stream;
+}
+
+/* Create a sonic stream.  Return NULL only if we are out of memory and cannot
+   allocate the stream. */
+sonicStream sonicCreateStream(int sampleRate, int numChannels) {
+  return sonicCreateStreamWithAllocator(sampleRate, numChannels, defaultAlloc,
+                                        defaultRealloc, defaultFree, NULL);
+}
+
+/* Get the sample rate of the stream. */
+int sonicGetSampleRate(sonicStream stream) { return stream->sampleRate; }
+
+/* Set the sample rate of the stream.  This will cause samples buffered in the
+   stream to be lost. */
+void sonicSetSampleRate(sonicStream stream, int sampleRate) {
+  if (sampleRate == stream->sampleRate) {
+    sonicResetStream(stream);
+    return;
+  }
+  freeStreamBuffers(stream);
+  if (!allocateStreamBuffers(stream, sampleRate, stream->numChannels)) {
+    sonicDestroyStream(stream);
+  }
+}
+
+/* Get the number of channels. */
+int sonicGetNumChannels(sonicStream stream) { return stream->numChannels; }
+
+/* Set the num channels of the stream.  This will cause samples buffered in the
+   stream to be lost. */
+void sonicSetNumChannels(sonicStream stream, int numChannels) {
+  if (numChannels == stream->numChannels) {
+    sonicResetStream(stream);
+    return;
+  }
+  freeStreamBuffers(stream);
+  if (!allocateStreamBuffers(stream, stream->sampleRate, numChannels)) {
+    sonicDestroyStream(stream);
+  }
+}
+
+/* Get the lowest pitch searched for. */
+int sonicGetMinPitch(sonicStream stream) { return stream->minPitch; }
+
+/* Get the highest pitch searched for. */
+int sonicGetMaxPitch(sonicStream stream) { return stream->maxPitch; }
+
+/* Set the range of pitches searched for.  The buffers depend on the longest
+   period, so this drops buffered samples.  The new buffers are allocated
+   before the old ones are freed, so running out of memory leaves the stream
+   as it was.  Return 0 if the range is not valid or we are out of memory. */
+int sonicSetPitchRange(sonicStream stream, int minPitch, int maxPitch) {
+  struct sonicStreamStruct resized;
+
+  if (minPitch <= 0 || maxPitch < minPitch) {
+    return 0;
+  }
+  if (minPitch == stream->minPitch && maxPitch == stream->maxPitch) {
+    sonicResetStream(stream);
+    return 1;
+  }
+  resized = *stream;
+  resized.minPitch = minPitch;
+  resized.maxPitch = maxPitch;
+  resized.numInputSamples = 0;
+  resized.numOutputSamples = 0;
+  resized.numPitchSamples = 0;
+  resized.numAcquiredSamples = 0;
+  forgetStreamBuffers(&resized);
+  if (!allocateStreamBuffers(&resized, stream->sampleRate,
+                             stream->numChannels)) {
+    return 0;
+  }
+  freeStreamBuffers(stream);
+  *stream = resized;
+  sonicResetStream(stream);
+  return 1;
+}
+
+/* Allocate buffers for writes of up to maxInputSamples samples, and for up to
+   maxOutputSamples unread output samples, and never allocate memory while
+   processing after that.  Writes that would not fit fail instead.  Set
+   maxInputSamples to 0 to let the buffers grow again.  Return 0 if we are out
+   of memory, in which case the buffers can still grow. */
+int sonicSetFixedCapacity(sonicStream stream, int maxInputSamples,
+                          int maxOutputSamples) {
+  if (maxInputSamples <= 0) {
+    stream->fixedInputSamples = 0;
+    stream->fixedOutputSamples = 0;
+    return 1;
+  }
+  if (!reserveFixedCapacity(stream, maxInputSamples, maxOutputSamples)) {
+    return 0;
+  }
+  stream->fixedInputSamples = maxInputSamples;
+  stream->fixedOutputSamples = maxOutputSamples;
+  return 1;
+}
+
+/* Make room for numSamples more samples after the used samples in a sliding
+   window buffer.  Consumed samples at the start are reclaimed by moving the
+   used samples down, but only once there are at least as many consumed samples
+   as used ones, so each sample is moved at most a constant number of times on
+   average.  Otherwise the buffer grows. */
+static int enlargeBufferIfNeeded(sonicStream stream, int whichBuffer,
+                                 sonicSample** buffer, int* bufferSize,
+                                 int* start, int numUsed, int numSamples) {
+  int numChannels = stream->numChannels;
+  sonicSample* base = *buffer - *start * numChannels;
+
+  if (*start + numUsed + numSamples <= *bufferSize) {
+    return 1;
+  }
+  if (stream->fixedInputSamples != 0) {
+    /* Never reallocate with a fixed capacity, but always reclaim space. */
+    if (numUsed + numSamples > *bufferSize) {
+      return 0;
+    }
+  } else if (*start < numUsed || numUsed + numSamples > *bufferSize) {
+    *bufferSize += (*bufferSize >> 1) + numSamples;
+    base = (sonicSample*)streamRealloc(
+        stream, base, *bufferSize * sizeof(sonicSample) * numChannels);
+    if (base == NULL) {
+      *buffer = NULL;
+      *start = 0;
+      return 0;
+    }
+    stream->stats.bufferGrowths[whichBuffer]++;
+    if (*bufferSize > stream->stats.peakBufferSizes[whichBuffer]) {
+      stream->stats.peakBufferSizes[whichBuffer] = *bufferSize;
+    }
+  }
+  if (*start > 0 && numUsed > 0) {
+    memmove(base, base + *start * numChannels,
+            numUsed * sizeof(sonicSample) * numChannels);
+  }
+  *buffer = base;
+  *start = 0;
+  return 1;
+}
+
+/* Mark numSamples at the start of a sliding window buffer as consumed.  If the
+   buffer becomes empty, start over at the beginning of the allocation. */
+static void consumeBufferSamples(sonicSample** buffer, int* start, int* numUsed,
+                                 int numSamples, int numChannels) {
+  *numUsed -= numSamples;
+  if (*numUsed == 0) {
+    *buffer -= *start * numChannels;
+    *start = 0;
+  } else {
+    *buffer += numSamples * numChannels;
+    *start += numSamples;
+  }
+}
+
+/* Enlarge the output buffer if needed. */
+static int enlargeOutputBufferIfNeeded(sonicStream stream, int numSamples) {
+  return enlargeBufferIfNeeded(
+      stream, SONIC_OUTPUT_BUFFER, &stream->outputBuffer,
+      &stream->outputBufferSize, &stream->outputBufferStart,
+      stream->numOutputSamples, numSamples);
+}
+
+/* Enlarge the input buffer if needed. */
+static int enlargeInputBufferIfNeeded(sonicStream stream, int numSamples) {
+  return enlargeBufferIfNeeded(
+      stream, SONIC_INPUT_BUFFER, &stream->inputBuffer,
+      &stream->inputBufferSize, &stream->inputBufferStart,
+      stream->numInputSamples, numSamples);
+}
+
+/* Enlarge the pitch buffer if needed. */
+static int enlargePitchBufferIfNeeded(sonicStream stream, int numSamples) {
+  return enlargeBufferIfNeeded(
+      stream, SONIC_PITCH_BUFFER, &stream->pitchBuffer,
+      &stream->pitchBufferSize, &stream->pitchBufferStart,
+      stream->numPitchSamples, numSamples);
+}
+
+/* Return where numSamples samples being written should go, or NULL if we fail
+   to resize the buffer.  If passThrough is set, processing would only copy
+   them to the output, so they go straight to the end of the output buffer. */
+static sonicSample* getWriteBuffer(sonicStream stream, int numSamples,
+                                   int passThrough) {
+  int numChannels = stream->numChannels;
+
+  if (passThrough) {
+    if (!enlargeOutputBufferIfNeeded(stream, numSamples)) {
+      return NULL;
+    }
+    return stream->outputBuffer + stream->numOutputSamples * numChannels;
+  }
+  if (!enlargeInputBufferIfNeeded(stream, numSamples)) {
+    return NULL;
+  }
+  return stream->inputBuffer + stream->numInputSamples * numChannels;
+}
+
+/* Convert samples being written into the stream's buffer.  The caller counts
+   them with finishWrite. */
+static int addFloatSamples(sonicStream stream, float* samples, int numSamples,
+                           int passThrough) {
+  sonicSample* buffer;
+  int count = numSamples * stream->numChannels;
+
+  if (numSamples == 0) {
+    return 1;
+  }
+  buffer = getWriteBuffer(stream, numSamples, passThrough);
+  if (buffer == NULL) {
+    return 0;
+  }
+#ifdef SONIC_USE_FLOAT
+  memcpy(buffer, samples, count * sizeof(float));
+#else
+  floatsToShorts(samples, buffer, count);
+#endif  /* SONIC_USE_FLOAT */
+  return 1;
+}
+
+/* Convert samples being written into the stream's buffer. */
+static int addShortSamples(sonicStream stream, short* samples, int numSamples,
+                           int passThrough) {
+  sonicSample* buffer;
+  int count = numSamples * stream->numChannels;
+
+  if (numSamples == 0) {
+    return 1;
+  }
+  buffer = getWriteBuffer(stream, numSamples, passThrough);
+  if (buffer == NULL) {
+    return 0;
+  }
+#ifdef SONIC_USE_FLOAT
+  while (count--) {
+    *buffer++ = (*samples++) / 32767.0f;
+  }
+#else
+  memcpy(buffer, samples, count * sizeof(short));
+#endif  /* SONIC_USE_FLOAT */
+  return 1;
+}
+
+/* Convert samples being written into the stream's buffer. */
+static int addUnsignedCharSamples(sonicStream stream, unsigned char* samples,
+                                  int numSamples, int passThrough) {
+  sonicSample* buffer;
+  int count = numSamples * stream->numChannels;
+
+  if (numSamples == 0) {
+    return 1;
+  }
+  buffer = getWriteBuffer(stream, numSamples, passThrough);
+  if (buffer == NULL) {
+    return 0;
+  }
+#ifdef SONIC_USE_FLOAT
+  while (count--) {
+    *buffer++ = ((*samples++ - 128) << 8) / 32767.0f;
+  }
+#else
+  unsignedCharsToShorts(samples, buffer, count);
+#endif  /* SONIC_USE_FLOAT */
+  return 1;
+}
+
+/* Interleave samples being written from one buffer per channel into the
+   stream's buffer. */
+static int addFloatPlanarSamples(sonicStream stream, float** channels,
+                                 int numSamples, int passThrough) {
+  int numChannels = stream->numChannels;
+  sonicSample* buffer;
+  float* samples;
+  int i, j;
+
+  if (numSamples == 0) {
+    return 1;
+  }
+  buffer = getWriteBuffer(stream, numSamples, passThrough);
+  if (buffer == NULL) {
+    return 0;
+  }
+  for (j = 0; j < numChannels; j++) {
+    samples = channels[j];
+    for (i = 0; i < numSamples; i++) {
+#ifdef SONIC_USE_FLOAT
+      buffer[i * numChannels + j] = samples[i];
+#else
+      buffer[i * numChannels + j] = floatToShort(samples[i]);
+#endif  /* SONIC_USE_FLOAT */
+    }
+  }
+  return 1;
+}
+
+/* Interleave samples being written from one buffer per channel into the
+   stream's buffer. */
+static int addShortPlanarSamples(sonicStream stream, short** channels,
+                                 int numSamples, int passThrough) {
+  int numChannels = stream->numChannels;
+  sonicSample* buffer;
+  short* samples;
+  int i, j;
+
+  if (numSamples == 0) {
+    return 1;
+  }
+  buffer = getWriteBuffer(stream, numSamples, passThrough);
+  if (buffer == NULL) {
+    return 0;
+  }
+  for (j = 0; j < numChannels; j++) {
+    samples = channels[j];
+    for (i = 0; i < numSamples; i++) {
+#ifdef SONIC_USE_FLOAT
+      buffer[i * numChannels + j] = samples[i] / 32767.0f;
+#else
+      buffer[i * numChannels + j] = samples[i];
+#endif  /* SONIC_USE_FLOAT */
+    }
+  }
+  return 1;
+}
+
+/* Remove input samples that we have already processed. */
+static void removeInputSamples(sonicStream stream, int position) {
+  stream->inputPosition += position;
+  consumeBufferSamples(&stream->inputBuffer, &stream->inputBufferStart,
+                       &stream->numInputSamples, position, stream->numChannels);
+}
+
+/* Remove output samples that have been read. */
+static void removeOutputSamples(sonicStream stream, int numSamples) {
+  stream->outputPosition += numSamples;
+  consumeBufferSamples(&stream->outputBuffer, &stream->outputBufferStart,
+                       &stream->numOutputSamples, numSamples,
+                       stream->numChannels);
+}
+
+/* Just copy from the array to the output buffer */
+static int copyToOutput(sonicStream stream, sonicSample* samples,
+                        int numSamples) {
+  if (!enlargeOutputBufferIfNeeded(stream, numSamples)) {
+    return 0;
+  }
+  memcpy(stream->outputBuffer + stream->numOutputSamples * stream->numChannels,
+         samples, numSamples * sizeof(sonicSample) * stream->numChannels);
+  stream->numOutputSamples += numSamples;
+  return 1;
+}
+
+/* Just copy up to maxSamples from the input buffer to the output buffer.
+   Return 0 if we fail to resize the output buffer.  Otherwise, return the
+   number of samples copied. */
+static int copyInputToOutput(sonicStream stream, int position,
+                             int maxSamples) {
+  int numSamples = stream->remainingInputToCopy;
+
+  if (numSamples > maxSamples) {
+    numSamples = maxSamples;
+  }
+  if (!copyToOutput(stream,
+                    stream->inputBuffer + position * stream->numChannels,
+                    numSamples)) {
+    return 0;
+  }
+  stream->remainingInputToCopy -= numSamples;
+  stream->stats.copiedSamples += numSamples;
+  return numSamples;
+}
+
+/* Read data out of the stream.  Sometimes no data will be available, and zero
+   is returned, which is not an error condition.  The read functions apply the
+   volume as they convert the samples. */
 int sonicReadFloatFromStream(sonicStream stream, float* samples,
                              int maxSamples) {
   int numSamples = stream->numOutputSamples;
-  int remainingSamples = 0;
-  short* buffer;
   int count;
+#ifdef SONIC_USE_FLOAT
+  float* buffer;
+  float volume = stream->outputVolume;
+#endif  /* SONIC_USE_FLOAT */
 
   if (numSamples == 0) {
     return 0;
   }
   if (numSamples > maxSamples) {
-    remainingSamples = numSamples - maxSamples;
     numSamples = maxSamples;
   }
-  buffer = stream->outputBuffer;
+  beginStage(stream);
   count = numSamples * stream->numChannels;
-  while (count--) {
-    *samples++ = (*buffer++) / 32767.0f;
-  }
-  if (remainingSamples > 0) {
-    memmove(stream->outputBuffer,
-            stream->outputBuffer + numSamples * stream->numChannels,
-            remainingSamples * sizeof(short) * stream->numChannels);
+#ifdef SONIC_USE_FLOAT
+  buffer = stream->outputBuffer;
+  if (volume == 1.0f) {
+    memcpy(samples, buffer, count * sizeof(float));
+  } else {
+    while (count--) {
+      *samples++ = (*buffer++) * volume;
+    }
   }
-  stream->numOutputSamples = remainingSamples;
+#else
+  shortsToFloats(stream->outputBuffer, samples, count,
+                 getFixedPointVolume(stream->outputVolume));
+#endif  /* SONIC_USE_FLOAT */
+  endStage(stream, SONIC_STAGE_SCALE_SAMPLES);
+  removeOutputSamples(stream, numSamples);
   return numSamples;
 }
 
@@ -501,23 +2425,41 @@ int sonicReadFloatFromStream(sonicStream stream, float* samples,
 int sonicReadShortFromStream(sonicStream stream, short* samples,
                              int maxSamples) {
   int numSamples = stream->numOutputSamples;
-  int remainingSamples = 0;
+  int count;
+#ifdef SONIC_USE_FLOAT
+  float* buffer;
+  float volume = stream->outputVolume;
+#endif  /* SONIC_USE_FLOAT */
 
   if (numSamples == 0) {
     return 0;
   }
   if (numSamples > maxSamples) {
-    remainingSamples = numSamples - maxSamples;
     numSamples = maxSamples;
   }
-  memcpy(samples, stream->outputBuffer,
-         numSamples * sizeof(short) * stream->numChannels);
-  if (remainingSamples > 0) {
-    memmove(stream->outputBuffer,
-            stream->outputBuffer + numSamples * stream->numChannels,
-            remainingSamples * sizeof(short) * stream->numChannels);
+  beginStage(stream);
+  count = numSamples * stream->numChannels;
+#ifdef SONIC_USE_FLOAT
+  buffer = stream->outputBuffer;
+  if (volume == 1.0f) {
+    while (count--) {
+      *samples++ = floatToShort(*buffer++);
+    }
+  } else {
+    while (count--) {
+      *samples++ = floatToShort((*buffer++) * volume);
+    }
+  }
+#else
+  if (stream->outputVolume == 1.0f) {
+    memcpy(samples, stream->outputBuffer, count * sizeof(short));
+  } else {
+    scaleShorts(stream->outputBuffer, samples, count,
+                getFixedPointVolume(stream->outputVolume));
   }
-  stream->numOutputSamples = remainingSamples;
+#endif  /* SONIC_USE_FLOAT */
+  endStage(stream, SONIC_STAGE_SCALE_SAMPLES);
+  removeOutputSamples(stream, numSamples);
   return numSamples;
 }
 
@@ -526,28 +2468,109 @@ int sonicReadShortFromStream(sonicStream stream, short* samples,
 int sonicReadUnsignedCharFromStream(sonicStream stream, unsigned char* samples,
                                     int maxSamples) {
   int numSamples = stream->numOutputSamples;
-  int remainingSamples = 0;
-  short* buffer;
   int count;
+#ifdef SONIC_USE_FLOAT
+  float* buffer;
+  float volume = stream->outputVolume;
+#endif  /* SONIC_USE_FLOAT */
 
   if (numSamples == 0) {
     return 0;
   }
   if (numSamples > maxSamples) {
-    remainingSamples = numSamples - maxSamples;
     numSamples = maxSamples;
   }
-  buffer = stream->outputBuffer;
+  beginStage(stream);
   count = numSamples * stream->numChannels;
+#ifdef SONIC_USE_FLOAT
+  buffer = stream->outputBuffer;
   while (count--) {
-    *samples++ = (char)((*buffer++) >> 8) + 128;
+    *samples++ = (char)(floatToShort((*buffer++) * volume) >> 8) + 128;
+  }
+#else
+  shortsToUnsignedChars(stream->outputBuffer, samples, count,
+                        getFixedPointVolume(stream->outputVolume));
+#endif  /* SONIC_USE_FLOAT */
+  endStage(stream, SONIC_STAGE_SCALE_SAMPLES);
+  removeOutputSamples(stream, numSamples);
+  return numSamples;
+}
+
+/* Read float data out of the stream into one buffer per channel.  Sometimes
+   no data will be available, and zero is returned, which is not an error
+   condition. */
+int sonicReadFloatPlanar(sonicStream stream, float** channels,
+                         int maxSamples) {
+  int numSamples = stream->numOutputSamples;
+  int numChannels = stream->numChannels;
+  sonicSample* buffer = stream->outputBuffer;
+  float* samples;
+  int i, j;
+#ifdef SONIC_USE_FLOAT
+  float volume = stream->outputVolume;
+#else
+  int fixedPointVolume = getFixedPointVolume(stream->outputVolume);
+#endif  /* SONIC_USE_FLOAT */
+
+  if (numSamples == 0) {
+    return 0;
+  }
+  if (numSamples > maxSamples) {
+    numSamples = maxSamples;
+  }
+  beginStage(stream);
+  for (j = 0; j < numChannels; j++) {
+    samples = channels[j];
+    for (i = 0; i < numSamples; i++) {
+#ifdef SONIC_USE_FLOAT
+      samples[i] = buffer[i * numChannels + j] * volume;
+#else
+      samples[i] =
+          applyVolume(buffer[i * numChannels + j], fixedPointVolume) /
+          32767.0f;
+#endif  /* SONIC_USE_FLOAT */
+    }
   }
-  if (remainingSamples > 0) {
-    memmove(stream->outputBuffer,
-            stream->outputBuffer + numSamples * stream->numChannels,
-            remainingSamples * sizeof(short) * stream->numChannels);
+  endStage(stream, SONIC_STAGE_SCALE_SAMPLES);
+  removeOutputSamples(stream, numSamples);
+  return numSamples;
+}
+
+/* Read short data out of the stream into one buffer per channel.  Sometimes
+   no data will be available, and zero is returned, which is not an error
+   condition. */
+int sonicReadShortPlanar(sonicStream stream, short** channels,
+                         int maxSamples) {
+  int numSamples = stream->numOutputSamples;
+  int numChannels = stream->numChannels;
+  sonicSample* buffer = stream->outputBuffer;
+  short* samples;
+  int i, j;
+#ifdef SONIC_USE_FLOAT
+  float volume = stream->outputVolume;
+#else
+  int fixedPointVolume = getFixedPointVolume(stream->outputVolume);
+#endif  /* SONIC_USE_FLOAT */
+
+  if (numSamples == 0) {
+    return 0;
+  }
+  if (numSamples > maxSamples) {
+    numSamples = maxSamples;
+  }
+  beginStage(stream);
+  for (j = 0; j < numChannels; j++) {
+    samples = channels[j];
+    for (i = 0; i < numSamples; i++) {
+#ifdef SONIC_USE_FLOAT
+      samples[i] = floatToShort(buffer[i * numChannels + j] * volume);
+#else
+      samples[i] = applyVolume(buffer[i * numChannels + j], fixedPointVolume);
+#endif  /* SONIC_USE_FLOAT */
+    }
   }
-  stream->numOutputSamples = remainingSamples;
+  endStage(stream, SONIC_STAGE_SCALE_SAMPLES);
+  removeOutputSamples(stream, numSamples);
   return numSamples;
 }
 
@@ -564,11 +2587,11 @@ int sonicFlushStream(sonicStream stream) {
       (int)((remainingSamples / speed + stream->numPitchSamples) / rate + 0.5f);
 
   /* Add enough silence to flush both input and pitch buffers. */
-  if (!enlargeInputBufferIfNeeded(stream, remainingSamples + 2 * maxRequired)) {
+  if (!enlargeInputBufferIfNeeded(stream, 2 * maxRequired)) {
     return 0;
   }
   memset(stream->inputBuffer + remainingSamples * stream->numChannels, 0,
-         2 * maxRequired * sizeof(short) * stream->numChannels);
+         2 * maxRequired * sizeof(sonicSample) * stream->numChannels);
   stream->numInputSamples += 2 * maxRequired;
   if (!sonicWriteShortToStream(stream, NULL, 0)) {
     return 0;
@@ -577,59 +2600,180 @@ int sonicFlushStream(sonicStream stream) {
   if (stream->numOutputSamples > expectedOutputSamples) {
     stream->numOutputSamples = expectedOutputSamples;
   }
-  /* Empty input and pitch buffers */
-  stream->numInputSamples = 0;
+  /* Empty input and pitch buffers, and do not count the silence as input. */
+  removeInputSamples(stream, stream->numInputSamples);
+  stream->inputPosition -= 2 * maxRequired;
   stream->remainingInputToCopy = 0;
-  stream->numPitchSamples = 0;
+  consumeBufferSamples(&stream->pitchBuffer, &stream->pitchBufferStart,
+                       &stream->numPitchSamples, stream->numPitchSamples,
+                       stream->numChannels);
+  addSyncPoint(stream);
   return 1;
 }
 
+/* Drop all buffered samples and forget the pitch history, so the stream can
+   start on unrelated audio as if it were new.  Parameters such as speed and
+   pitch are kept, scheduled ramps are dropped, and no memory is freed. */
+void sonicResetStream(sonicStream stream) {
+  removeInputSamples(stream, stream->numInputSamples);
+  clearRamps(stream);
+  removeOutputSamples(stream, stream->numOutputSamples);
+  consumeBufferSamples(&stream->pitchBuffer, &stream->pitchBufferStart,
+                       &stream->numPitchSamples, stream->numPitchSamples,
+                       stream->numChannels);
+  stream->remainingInputToCopy = 0;
+  stream->oldRatePosition = 0;
+  stream->newRatePosition = 0;
+  stream->ratePhase = 0;
+  stream->rateNewSampleRate = 0;
+  stream->prevPeriod = 0;
+  stream->prevMinDiff = 0;
+  memset(stream->historyBuffer, 0,
+         stream->maxRequired * sizeof(sonicSample) * stream->numChannels);
+  stream->numHistorySamples = stream->maxRequired;
+  stream->avePower = 50.0f;
+  stream->aveInverseWeight = 1.0f;
+  stream->nonlinearError = 0.0f;
+  memset(&stream->stats, 0, sizeof(sonicStats));
+  updatePeakBufferSizes(stream);
+}
+
+/* Copy the stream's counters to stats. */
+void sonicGetStats(sonicStream stream, sonicStats* stats) {
+  *stats = stream->stats;
+}
+
 /* Return the number of samples in the output buffer */
 int sonicSamplesAvailable(sonicStream stream) {
   return stream->numOutputSamples;
 }
 
-/* If skip is greater than one, average skip samples together and write them to
-   the down-sample buffer.  If numChannels is greater than one, mix the channels
-   together as we down sample. */
-static void downSampleInput(sonicStream stream, short* samples, int skip) {
+/* Return the mask of the channels the pitch search mixes, or 0 if that is all
+   of them.  Only the first SONIC_MAX_MASK_CHANNELS channels can be selected,
+   and masks that select none of the stream's channels select them all. */
+static int getPitchChannelMask(sonicStream stream) {
+  int numChannels = stream->numChannels;
+  int mask = stream->pitchChannelMask;
+  int allChannels;
+
+  if (numChannels < SONIC_MAX_MASK_CHANNELS) {
+    allChannels = (1 << numChannels) - 1;
+    mask &= allChannels;
+    if (mask == allChannels) {
+      return 0;
+    }
+  }
+  return mask;
+}
+
+/* Down sample the selected channels of the input for the pitch search.  This
+   works like downSampleInput, but adds up the selected channels of each frame
+   rather than every sample. */
+static void downSampleChannels(sonicStream stream, sonicSample* samples,
+                               int skip, int mask) {
   int numSamples = stream->maxRequired / skip;
-  int samplesPerValue = stream->numChannels * skip;
-  int i, j;
+  int numChannels = stream->numChannels;
+  int maskChannels = numChannels < SONIC_MAX_MASK_CHANNELS
+                         ? numChannels
+                         : SONIC_MAX_MASK_CHANNELS;
+  int numSummed = 0;
+  sonicSample* downSamples = stream->downSampleBuffer;
+  int i, j, k;
+#ifdef SONIC_USE_FLOAT
+  float value;
+#else
+  double scale;
   int value;
-  short* downSamples = stream->downSampleBuffer;
+#endif  /* SONIC_USE_FLOAT */
 
+  for (k = 0; k < maskChannels; k++) {
+    numSummed += mask >> k & 1;
+  }
+  numSummed *= skip;
+#ifndef SONIC_USE_FLOAT
+  scale = getAverageScale(numSummed);
+#endif  /* SONIC_USE_FLOAT */
   for (i = 0; i < numSamples; i++) {
     value = 0;
-    for (j = 0; j < samplesPerValue; j++) {
-      value += *samples++;
+    for (j = 0; j < skip; j++) {
+      for (k = 0; k < maskChannels; k++) {
+        if (mask >> k & 1) {
+          value += samples[k];
+        }
+      }
+      samples += numChannels;
+    }
+#ifdef SONIC_USE_FLOAT
+    *downSamples++ = value / numSummed;
+#else
+    *downSamples++ = (int)(value * scale);
+#endif  /* SONIC_USE_FLOAT */
+  }
+}
+
+/* Average each down sampled value with the one after it.  Following the block
+   averages, this is a triangular low-pass filter, whose sidelobes are about
+   twice as far down as those of one block average.  The last value has none
+   after it and is left alone. */
+static void lowPassDownSamples(sonicSample* downSamples, int numSamples) {
+  int i;
+
+  for (i = 0; i + 1 < numSamples; i++) {
+#ifdef SONIC_USE_FLOAT
+    downSamples[i] = (downSamples[i] + downSamples[i + 1]) * 0.5f;
+#else
+    downSamples[i] = (downSamples[i] + downSamples[i + 1]) >> 1;
+#endif  /* SONIC_USE_FLOAT */
+  }
+}
+
+/* Down sample the input by skip for the pitch search, mixing the channels
+   together in the same pass.  Each value is the average of skip frames,
+   truncated toward zero, and then low-pass filtered if pitchLowPass is set
+   and skip is greater than one. */
+static void downSampleInput(sonicStream stream, sonicSample* samples,
+                            int skip) {
+  int numSamples = stream->maxRequired / skip;
+  int samplesPerValue = stream->numChannels * skip;
+  int mask = getPitchChannelMask(stream);
+#ifdef SONIC_USE_FLOAT
+  sonicSample* downSamples = stream->downSampleBuffer;
+  float value;
+  int i, j;
+#endif  /* SONIC_USE_FLOAT */
+
+  if (mask != 0) {
+    downSampleChannels(stream, samples, skip, mask);
+  } else {
+#ifdef SONIC_USE_FLOAT
+    for (i = 0; i < numSamples; i++) {
+      value = 0;
+      for (j = 0; j < samplesPerValue; j++) {
+        value += *samples++;
+      }
+      value /= samplesPerValue;
+      *downSamples++ = value;
     }
-    value /= samplesPerValue;
-    *downSamples++ = value;
+#else
+    averageBlocks(samples, stream->downSampleBuffer, numSamples,
+                  samplesPerValue);
+#endif  /* SONIC_USE_FLOAT */
+  }
+  if (stream->pitchLowPass && skip > 1) {
+    lowPassDownSamples(stream->downSampleBuffer, numSamples);
   }
 }
 
 /* Find the best frequency match in the range, and given a sample skip multiple.
-   For now, just find the pitch of the first channel. */
-static int findPitchPeriodInRange(short* samples, int minPeriod, int maxPeriod,
-                                  int* retMinDiff, int* retMaxDiff) {
+   Multichannel input is mixed down by downSampleInput first. */
+static int findPitchPeriodInRange(sonicSample* samples, int minPeriod,
+                                  int maxPeriod, int* retMinDiff,
+                                  int* retMaxDiff) {
   int period, bestPeriod = 0, worstPeriod = 255;
-  short* s;
-  short* p;
-  short sVal, pVal;
   unsigned long diff, minDiff = 1, maxDiff = 0;
-  int i;
 
   for (period = minPeriod; period <= maxPeriod; period++) {
-    diff = 0;
-    s = samples;
-    p = samples + period;
-    for (i = 0; i < period; i++) {
-      sVal = *s++;
-      pVal = *p++;
-      diff += sVal >= pVal ? (unsigned short)(sVal - pVal)
-                           : (unsigned short)(pVal - sVal);
-    }
+    diff = computeAmdf(samples, samples + period, period);
     /* Note that the highest number of samples we add into diff will be less
        than 256, since we skip samples.  Thus, diff is a 24 bit number, and
        we can safely multiply by numSamples without overflow */
@@ -649,6 +2793,227 @@ static int findPitchPeriodInRange(short* samples, int minPeriod, int maxPeriod,
   return bestPeriod;
 }
 
+/* Make sure the FFT buffers are set up for a transform of fftSize points, which
+   must be a power of 2.  Return 0 if we are out of memory, or if the buffers
+   are too small and the stream has a fixed capacity. */
+static int allocateFFTBuffers(sonicStream stream, int fftSize) {
+  float* twiddles;
+  int* bitReverse;
+  int half, i, j, k;
+
+  if (stream->fftSize == fftSize) {
+    return 1;
+  }
+  if (fftSize > stream->fftCapacity) {
+    if (stream->fixedInputSamples != 0 || !reserveFFTBuffers(stream, fftSize)) {
+      return 0;
+    }
+  }
+  bitReverse = stream->fftBitReverse;
+  for (i = 1, j = 0; i < fftSize; i++) {
+    k = fftSize >> 1;
+    while (j & k) {
+      j ^= k;
+      k >>= 1;
+    }
+    j |= k;
+    bitReverse[i] = j;
+  }
+  /* The butterflies of length 2*half use the twiddles at [half, 2*half), with
+     the real parts first and the imaginary parts fftSize entries later. */
+  twiddles = stream->fftTwiddles;
+  for (half = 1; half < fftSize; half <<= 1) {
+    for (k = 0; k < half; k++) {
+      twiddles[half + k] = cos(M_PI * k / half);
+      twiddles[fftSize + half + k] = -sin(M_PI * k / half);
+    }
+  }
+  stream->fftSize = fftSize;
+  return 1;
+}
+
+/* Compute half radix-2 butterflies, combining the upper and lower halves of
+   one block of FFT data in place. */
+static void computeButterflies(float* SONIC_RESTRICT upperRe,
+                               float* SONIC_RESTRICT upperIm,
+                               float* SONIC_RESTRICT lowerRe,
+                               float* SONIC_RESTRICT lowerIm,
+                               const float* SONIC_RESTRICT twiddleRe,
+                               const float* SONIC_RESTRICT twiddleIm,
+                               float sign, int half) {
+  float tr, ti, wr, wi;
+  int k;
+
+  for (k = 0; k < half; k++) {
+    wr = twiddleRe[k];
+    wi = sign * twiddleIm[k];
+    tr = lowerRe[k] * wr - lowerIm[k] * wi;
+    ti = lowerRe[k] * wi + lowerIm[k] * wr;
+    lowerRe[k] = upperRe[k] - tr;
+    lowerIm[k] = upperIm[k] - ti;
+    upperRe[k] += tr;
+    upperIm[k] += ti;
+  }
+}
+
+/* In-place radix-2 FFT of the data in the stream's FFT buffer, which holds the
+   real parts followed by the imaginary parts.  If inverse is set, compute the
+   unscaled inverse transform instead.  Keeping the real and imaginary parts
+   in separate arrays lets the compiler vectorize the butterflies. */
+static void computeFFT(sonicStream stream, int inverse) {
+  int n = stream->fftSize;
+  float* re = stream->fftBuffer;
+  float* im = re + n;
+  float* twiddleRe = stream->fftTwiddles;
+  float* twiddleIm = twiddleRe + n;
+  int* bitReverse = stream->fftBitReverse;
+  float sign = inverse ? -1.0f : 1.0f;
+  int i, j, half;
+  float tr, ti;
+
+  for (i = 1; i < n; i++) {
+    j = bitReverse[i];
+    if (i < j) {
+      tr = re[i];
+      re[i] = re[j];
+      re[j] = tr;
+      ti = im[i];
+      im[i] = im[j];
+      im[j] = ti;
+    }
+  }
+  for (half = 1; half < n; half <<= 1) {
+    for (i = 0; i < n; i += 2 * half) {
+      computeButterflies(re + i, im + i, re + i + half, im + i + half,
+                         twiddleRe + half, twiddleIm + half, sign, half);
+    }
+  }
+}
+
+/* Find the best frequency match in the range using the squared difference
+   function over a fixed window of W = maxPeriod/2 samples:
+
+       d(period) = sum((s[i] - s[i + period])^2), i = 0 .. W - 1
+
+   This expands to two energy terms, which come from running sums, minus twice
+   the cross-correlation of the first W samples with the W + maxPeriod sample
+   window.  The cross-correlation for every period is computed at once with
+   one forward and one inverse FFT, so the search costs O(N log N) rather than
+   the O(N^2) brute-force AMDF search.  The reported differences are RMS
+   differences per sample, which have the same scale as the average magnitude
+   differences reported by findPitchPeriodInRange.  Return 0 if we cannot
+   allocate the FFT buffers. */
+static int findPitchPeriodInRangeFFT(sonicStream stream, sonicSample* samples,
+                                     int minPeriod, int maxPeriod,
+                                     int* retMinDiff, int* retMaxDiff) {
+  int windowSize = maxPeriod >> 1;
+  int numSamples = windowSize + maxPeriod;
+  int fftSize = 1;
+  int period, bestPeriod = 0, worstPeriod = 0;
+  int i, k;
+  float* re;
+  float* im;
+  float xr, xi, ar, ai, zr, zi, yr, yi;
+  double firstEnergy = 0.0, periodEnergy = 0.0;
+  double diff, minDiff = 0.0, maxDiff = 0.0;
+
+  /* Correlating the window with no more than fftSize samples never wraps
+     around, so there is no need to pad to twice the length. */
+  while (fftSize < numSamples) {
+    fftSize <<= 1;
+  }
+  if (!allocateFFTBuffers(stream, fftSize)) {
+    return 0;
+  }
+  /* Pack the whole window into the real part and the first W samples into the
+     imaginary part, so one complex FFT transforms both. */
+  re = stream->fftBuffer;
+  im = re + fftSize;
+  memset(re, 0, 2 * fftSize * sizeof(float));
+  for (i = 0; i < numSamples; i++) {
+    re[i] = samples[i];
+  }
+  for (i = 0; i < windowSize; i++) {
+    im[i] = samples[i];
+    firstEnergy += (double)samples[i] * samples[i];
+  }
+  computeFFT(stream, 0);
+  /* Separate the two spectra X and A, and replace the data with X*conj(A). */
+  for (k = 0; k <= fftSize / 2; k++) {
+    i = (fftSize - k) & (fftSize - 1);
+    zr = re[k];
+    zi = im[k];
+    yr = re[i];
+    yi = im[i];
+    xr = (zr + yr) * 0.5f;
+    xi = (zi - yi) * 0.5f;
+    ar = (zi + yi) * 0.5f;
+    ai = (yr - zr) * 0.5f;
+    re[k] = xr * ar + xi * ai;
+    im[k] = xi * ar - xr * ai;
+    re[i] = re[k];
+    im[i] = -im[k];
+  }
+  computeFFT(stream, 1);
+  for (i = 0; i < windowSize; i++) {
+    periodEnergy += (double)samples[i + minPeriod] * samples[i + minPeriod];
+  }
+  for (period = minPeriod; period <= maxPeriod; period++) {
+    diff = firstEnergy + periodEnergy - 2.0 * re[period] / fftSize;
+    if (bestPeriod == 0 || diff < minDiff) {
+      minDiff = diff;
+      bestPeriod = period;
+    }
+    if (worstPeriod == 0 || diff > maxDiff) {
+      maxDiff = diff;
+      worstPeriod = period;
+    }
+    if (period < maxPeriod) {
+      periodEnergy += (double)samples[period + windowSize] *
+                          samples[period + windowSize] -
+                      (double)samples[period] * samples[period];
+    }
+  }
+  /* Rounding error can make a perfect match slightly negative. */
+#ifdef SONIC_USE_FLOAT
+  /* Report differences in the 16-bit sample range, like the AMDF search. */
+  minDiff *= 32767.0 * 32767.0;
+  maxDiff *= 32767.0 * 32767.0;
+#endif  /* SONIC_USE_FLOAT */
+  *retMinDiff = minDiff > 0.0 ? (int)(sqrt(minDiff / windowSize) + 0.5) : 0;
+  *retMaxDiff = maxDiff > 0.0 ? (int)(sqrt(maxDiff / windowSize) + 0.5) : 0;
+  return bestPeriod;
+}
+
+/* Search the whole range of pitch periods using the stream's pitch detection
+   method.  The FFT search falls back to a full AMDF search if we run out of
+   memory. */
+static int findPitchPeriodInFullRange(sonicStream stream, sonicSample* samples,
+                                      int minPeriod, int maxPeriod,
+                                      int* retMinDiff, int* retMaxDiff) {
+  int period, maxDiff;
+
+  if (stream->pitchMethod == SONIC_PITCH_FFT) {
+    period = findPitchPeriodInRangeFFT(stream, samples, minPeriod, maxPeriod,
+                                       retMinDiff, &maxDiff);
+    if (period != 0) {
+      /* Refine the estimate with a narrow AMDF search, so that in voiced
+         speech we usually land on exactly the period AMDF would find.  The
+         worst match still comes from the whole range. */
+      minPeriod = period - 4 > minPeriod ? period - 4 : minPeriod;
+      maxPeriod = period + 4 < maxPeriod ? period + 4 : maxPeriod;
+      period = findPitchPeriodInRange(samples, minPeriod, maxPeriod,
+                                      retMinDiff, retMaxDiff);
+      if (maxDiff > *retMaxDiff) {
+        *retMaxDiff = maxDiff;
+      }
+      return period;
+    }
+  }
+  return findPitchPeriodInRange(samples, minPeriod, maxPeriod, retMinDiff,
+                                retMaxDiff);
+}
+
 /* At abrupt ends of voiced words, we can have pitch periods that are better
    approximated by the previous pitch period estimate.  Try to detect this case.
  */
@@ -671,7 +3036,43 @@ static int prevPeriodBetter(sonicStream stream, int period, int minDiff,
       return 0;
     }
   }
-  return 1;
+  return 1;
+}
+
+/* In pitch tracking mode, search only within about a quarter of the last
+   period found, in samples down sampled by skip.  Return 0 if there is no last
+   period, or if the best match is at the edge of the window, or is not clearly
+   better than the worst match of the last full search, in which case the full
+   range must be searched.  Otherwise the worst match of the last full search
+   is returned as maxDiff, since the window is too narrow to say how voiced
+   this is. */
+static int trackPitchPeriod(sonicStream stream, sonicSample* samples,
+                            int minPeriod, int maxPeriod, int skip,
+                            int* retMinDiff, int* retMaxDiff) {
+  int center = stream->prevPeriod / skip;
+  int width = (center >> 2) + 2;
+  int low = center - width;
+  int high = center + width;
+  int period;
+
+  if (!stream->pitchTracking || stream->prevPeriod == 0) {
+    return 0;
+  }
+  if (low < minPeriod) {
+    low = minPeriod;
+  }
+  if (high > maxPeriod) {
+    high = maxPeriod;
+  }
+  period = findPitchPeriodInRange(samples, low, high, retMinDiff, retMaxDiff);
+  if ((period == low && low != minPeriod) ||
+      (period == high && high != maxPeriod) ||
+      *retMinDiff * 3 >= stream->voicedMaxDiff) {
+    return 0;
+  }
+  *retMaxDiff = stream->voicedMaxDiff;
+  stream->stats.trackedPeriods++;
+  return period;
 }
 
 /* Find the pitch period.  This is a critical step, and we may have to try
@@ -679,29 +3080,52 @@ static int prevPeriodBetter(sonicStream stream, int period, int minDiff,
    Difference Function (AMDF).  To improve speed, we down sample by an integer
    factor get in the 11KHz range, and then do it again with a narrower
    frequency range without down sampling */
-static int findPitchPeriod(sonicStream stream, short* samples,
+static int findPitchPeriod(sonicStream stream, sonicSample* samples,
                            int preferNewPeriod) {
   int minPeriod = stream->minPeriod;
   int maxPeriod = stream->maxPeriod;
   int sampleRate = stream->sampleRate;
   int minDiff, maxDiff, retPeriod;
   int skip = 1;
-  int period;
+  int period, radius;
 
-  if (sampleRate > SONIC_AMDF_FREQ && stream->quality == 0) {
-    skip = sampleRate / SONIC_AMDF_FREQ;
+  if (stream->amdfFreq > 0 && sampleRate > stream->amdfFreq &&
+      stream->quality == 0) {
+    skip = sampleRate / stream->amdfFreq;
+    /* Never down sample so far that the shortest period is lost. */
+    if (skip > minPeriod) {
+      skip = minPeriod;
+    }
   }
   if (stream->numChannels == 1 && skip == 1) {
-    period = findPitchPeriodInRange(samples, minPeriod, maxPeriod, &minDiff,
-                                    &maxDiff);
+    period = trackPitchPeriod(stream, samples, minPeriod, maxPeriod, 1,
+                              &minDiff, &maxDiff);
+    if (period == 0) {
+      period = findPitchPeriodInFullRange(stream, samples, minPeriod,
+                                          maxPeriod, &minDiff, &maxDiff);
+    }
+    stream->voicedMinDiff = minDiff;
+    stream->voicedMaxDiff = maxDiff;
   } else {
     downSampleInput(stream, samples, skip);
-    period = findPitchPeriodInRange(stream->downSampleBuffer, minPeriod / skip,
-                                    maxPeriod / skip, &minDiff, &maxDiff);
+    period = trackPitchPeriod(stream, stream->downSampleBuffer,
+                              minPeriod / skip, maxPeriod / skip, skip,
+                              &minDiff, &maxDiff);
+    /* A tracked period is close, so it needs less refining. */
+    radius = skip;
+    if (period == 0) {
+      period = findPitchPeriodInFullRange(stream, stream->downSampleBuffer,
+                                          minPeriod / skip, maxPeriod / skip,
+                                          &minDiff, &maxDiff);
+      radius = skip << 2;
+    }
+    /* The refined search below is too narrow to say how voiced this is. */
+    stream->voicedMinDiff = minDiff;
+    stream->voicedMaxDiff = maxDiff;
     if (skip != 1) {
       period *= skip;
-      minPeriod = period - (skip << 2);
-      maxPeriod = period + (skip << 2);
+      minPeriod = period - radius;
+      maxPeriod = period + radius;
       if (minPeriod < stream->minPeriod) {
         minPeriod = stream->minPeriod;
       }
@@ -718,8 +3142,10 @@ static int findPitchPeriod(sonicStream stream, short* samples,
       }
     }
   }
+  stream->stats.pitchPeriods++;
   if (prevPeriodBetter(stream, period, minDiff, maxDiff, preferNewPeriod)) {
     retPeriod = stream->prevPeriod;
+    stream->stats.prevPeriodsUsed++;
   } else {
     retPeriod = period;
   }
@@ -728,80 +3154,134 @@ static int findPitchPeriod(sonicStream stream, short* samples,
   return retPeriod;
 }
 
+/* Fill in the ramp weights for an overlap of numSamples, unless they are
+   already there.  Pitch periods change slowly, so the same length is often
+   used many times in a row. */
+static void computeRampWeights(sonicStream stream, int numSamples) {
+  sonicRampWeight* down = stream->rampWeights;
+  sonicRampWeight* up = down + stream->maxPeriod;
+  int t;
+
+  if (numSamples == stream->rampLength) {
+    return;
+  }
+  for (t = 0; t < numSamples; t++) {
+    down[t] = numSamples - t;
+    up[t] = t;
+  }
+  stream->rampLength = numSamples;
+}
+
+/* Overlap-add numFrames frames of a linear overlap of numSamples.  The ramp
+   down is at frame downStart of its ramp, and the ramp up at frame upStart, or
+   they are -1 if that ramp is not running.  Overlaps too long for the tables
+   are worked out directly. */
+static void overlapAddRamps(sonicStream stream, sonicSample* out,
+                            sonicSample* rampDown, sonicSample* rampUp,
+                            int downStart, int upStart, int numFrames,
+                            int numSamples) {
+  sonicRampWeight* down = stream->rampWeights;
+  sonicRampWeight* up = down + stream->maxPeriod;
+  sonicRampWeight* zeros = up + stream->maxPeriod;
+  int numChannels = stream->numChannels;
+
+  if (numSamples > SONIC_MAX_RAMP_LENGTH ||
+      downStart + numFrames > numSamples || upStart + numFrames > numSamples) {
+    overlapAddPlain(out, rampDown, rampUp,
+                    downStart < 0 ? 0 : numSamples - downStart,
+                    downStart < 0 ? 0 : -1, upStart < 0 ? 0 : upStart,
+                    upStart < 0 ? 0 : 1, numFrames, numChannels, numSamples);
+    return;
+  }
+  computeRampWeights(stream, numSamples);
+  overlapAddFrames(out, rampDown, rampUp,
+                   downStart < 0 ? zeros : down + downStart,
+                   upStart < 0 ? zeros : up + upStart, numFrames, numChannels,
+                   numSamples);
+}
+
 /* Overlap two sound segments, ramp the volume of one down, while ramping the
    other one from zero up, and add them, storing the result at the output. */
-static void overlapAdd(int numSamples, int numChannels, short* out,
-                       short* rampDown, short* rampUp) {
-  short* o;
-  short* u;
-  short* d;
-  int i, t;
-
-  for (i = 0; i < numChannels; i++) {
-    o = out + i;
-    u = rampUp + i;
-    d = rampDown + i;
-    for (t = 0; t < numSamples; t++) {
+static void overlapAdd(sonicStream stream, int numSamples, sonicSample* out,
+                       sonicSample* rampDown, sonicSample* rampUp) {
 #ifdef SONIC_USE_SIN
-      float ratio = sin(t * M_PI / (2 * numSamples));
-      *o = *d * (1.0f - ratio) + *u * ratio;
-#else
-      *o = (*d * (numSamples - t) + *u * t) / numSamples;
-#endif
-      o += numChannels;
-      d += numChannels;
-      u += numChannels;
+  int numChannels = stream->numChannels;
+  float ratio;
+  int t, i;
+
+  /* Sine ramps are worked out once per frame rather than kept in a table. */
+  for (t = 0; t < numSamples; t++) {
+    ratio = sin(t * M_PI / (2 * numSamples));
+    for (i = 0; i < numChannels; i++) {
+      *out++ = *rampDown++ * (1.0f - ratio) + *rampUp++ * ratio;
     }
   }
+#else
+  overlapAddRamps(stream, out, rampDown, rampUp, 0, 0, numSamples,
+                  numSamples);
+#endif  /* SONIC_USE_SIN */
 }
 
 /* Overlap two sound segments, ramp the volume of one down, while ramping the
-   other one from zero up, and add them, storing the result at the output. */
-static void overlapAddWithSeparation(int numSamples, int numChannels,
-                                     int separation, short* out,
-                                     short* rampDown, short* rampUp) {
-  short *o, *u, *d;
-  int i, t;
+   other one from zero up, and add them, storing the result at the output.  The
+   ramp up starts separation samples after the ramp down.  When that is after
+   the ramp down ends, the gap between them is silent. */
+static void overlapAddWithSeparation(sonicStream stream, int numSamples,
+                                     int separation, sonicSample* out,
+                                     sonicSample* rampDown,
+                                     sonicSample* rampUp) {
+  int numChannels = stream->numChannels;
+  int overlap = numSamples - separation;
 
-  for (i = 0; i < numChannels; i++) {
-    o = out + i;
-    u = rampUp + i;
-    d = rampDown + i;
-    for (t = 0; t < numSamples + separation; t++) {
-      if (t < separation) {
-        *o = *d * (numSamples - t) / numSamples;
-        d += numChannels;
-      } else if (t < numSamples) {
-        *o = (*d * (numSamples - t) + *u * (t - separation)) / numSamples;
-        d += numChannels;
-        u += numChannels;
-      } else {
-        *o = *u * (t - separation) / numSamples;
-        u += numChannels;
-      }
-      o += numChannels;
-    }
+  if (overlap > 0) {
+    overlapAddRamps(stream, out, rampDown, rampDown, 0, -1, separation,
+                    numSamples);
+    overlapAddRamps(stream, out + separation * numChannels,
+                    rampDown + separation * numChannels, rampUp, separation, 0,
+                    overlap, numSamples);
+    overlapAddRamps(stream, out + numSamples * numChannels,
+                    rampUp + overlap * numChannels,
+                    rampUp + overlap * numChannels, -1, overlap, separation,
+                    numSamples);
+  } else {
+    overlapAddRamps(stream, out, rampDown, rampDown, 0, -1, numSamples,
+                    numSamples);
+    memset(out + numSamples * numChannels, 0,
+           (separation - numSamples) * sizeof(sonicSample) * numChannels);
+    overlapAddRamps(stream, out + separation * numChannels, rampUp, rampUp, -1,
+                    0, numSamples, numSamples);
   }
 }
 
+/* Copy the pitch search history to history, which has four entries. */
+static void savePitchHistory(sonicStream stream, int* history) {
+  history[0] = stream->prevPeriod;
+  history[1] = stream->prevMinDiff;
+  history[2] = stream->voicedMinDiff;
+  history[3] = stream->voicedMaxDiff;
+}
+
+/* Put back the pitch search history saved by savePitchHistory, so a period
+   that failed is searched the same way when it is tried again. */
+static void restorePitchHistory(sonicStream stream, int* history) {
+  stream->prevPeriod = history[0];
+  stream->prevMinDiff = history[1];
+  stream->voicedMinDiff = history[2];
+  stream->voicedMaxDiff = history[3];
+}
+
 /* Just move the new samples in the output buffer to the pitch buffer */
 static int moveNewSamplesToPitchBuffer(sonicStream stream,
                                        int originalNumOutputSamples) {
   int numSamples = stream->numOutputSamples - originalNumOutputSamples;
   int numChannels = stream->numChannels;
 
-  if (stream->numPitchSamples + numSamples > stream->pitchBufferSize) {
-    stream->pitchBufferSize += (stream->pitchBufferSize >> 1) + numSamples;
-    stream->pitchBuffer =
-        (short*)realloc(stream->pitchBuffer,
-                        stream->pitchBufferSize * sizeof(short) * numChannels);
-    if (stream->pitchBuffer == NULL) {
-      return 0;
-    }
+  if (!enlargePitchBufferIfNeeded(stream, numSamples)) {
+    return 0;
   }
   memcpy(stream->pitchBuffer + stream->numPitchSamples * numChannels,
          stream->outputBuffer + originalNumOutputSamples * numChannels,
-         numSamples * sizeof(short) * numChannels);
+         numSamples * sizeof(sonicSample) * numChannels);
   stream->numOutputSamples = originalNumOutputSamples;
   stream->numPitchSamples += numSamples;
   return 1;
@@ -809,18 +3289,9 @@ static int moveNewSamplesToPitchBuffer(sonicStream stream,
 
 /* Remove processed samples from the pitch buffer. */
 static void removePitchSamples(sonicStream stream, int numSamples) {
-  int numChannels = stream->numChannels;
-  short* source = stream->pitchBuffer + numSamples * numChannels;
-
-  if (numSamples == 0) {
-    return;
-  }
-  if (numSamples != stream->numPitchSamples) {
-    memmove(
-        stream->pitchBuffer, source,
-        (stream->numPitchSamples - numSamples) * sizeof(short) * numChannels);
-  }
-  stream->numPitchSamples -= numSamples;
+  consumeBufferSamples(&stream->pitchBuffer, &stream->pitchBufferStart,
+                       &stream->numPitchSamples, numSamples,
+                       stream->numChannels);
 }
 
 /* Change the pitch.  The latency this introduces could be reduced by looking at
@@ -830,21 +3301,27 @@ static int adjustPitch(sonicStream stream, int originalNumOutputSamples) {
   int numChannels = stream->numChannels;
   int period, newPeriod, separation;
   int position = 0;
-  short* out;
-  short* rampDown;
-  short* rampUp;
+  int pitchHistory[4];
+  sonicSample* out;
+  sonicSample* rampDown;
+  sonicSample* rampUp;
 
-  if (stream->numOutputSamples == originalNumOutputSamples) {
+  /* A write that ran out of output room may have left periods to do. */
+  if (stream->numOutputSamples == originalNumOutputSamples &&
+      stream->numPitchSamples < stream->maxRequired) {
     return 1;
   }
   if (!moveNewSamplesToPitchBuffer(stream, originalNumOutputSamples)) {
     return 0;
   }
   while (stream->numPitchSamples - position >= stream->maxRequired) {
+    savePitchHistory(stream, pitchHistory);
     period = findPitchPeriod(stream,
                              stream->pitchBuffer + position * numChannels, 0);
     newPeriod = period / pitch;
     if (!enlargeOutputBufferIfNeeded(stream, newPeriod)) {
+      restorePitchHistory(stream, pitchHistory);
+      removePitchSamples(stream, position);
       return 0;
     }
     out = stream->outputBuffer + stream->numOutputSamples * numChannels;
@@ -852,12 +3329,12 @@ static int adjustPitch(sonicStream stream, int originalNumOutputSamples) {
       rampDown = stream->pitchBuffer + position * numChannels;
       rampUp =
           stream->pitchBuffer + (position + period - newPeriod) * numChannels;
-      overlapAdd(newPeriod, numChannels, out, rampDown, rampUp);
+      overlapAdd(stream, newPeriod, out, rampDown, rampUp);
     } else {
       rampDown = stream->pitchBuffer + position * numChannels;
       rampUp = stream->pitchBuffer + position * numChannels;
       separation = newPeriod - period;
-      overlapAddWithSeparation(period, numChannels, separation, out, rampDown,
+      overlapAddWithSeparation(stream, period, separation, out, rampDown,
                                rampUp);
     }
     stream->numOutputSamples += newPeriod;
@@ -867,54 +3344,176 @@ static int adjustPitch(sonicStream stream, int originalNumOutputSamples) {
   return 1;
 }
 
-/* Aproximate the sinc function times a Hann window from the sinc table. */
-static int findSincCoefficient(int i, int ratio, int width) {
+/* Aproximate the sinc function times a Hann window from the sinc table, for
+   each point of the FIR filter for one output sample.  The fractional position
+   between table entries is the same for every point. */
+static void computeSincWeights(int ratio, int width, int* weights) {
   int lobePoints = (SINC_TABLE_SIZE - 1) / SINC_FILTER_POINTS;
-  int left = i * lobePoints + (ratio * lobePoints) / width;
-  int right = left + 1;
-  int position = i * lobePoints * width + ratio * lobePoints - left * width;
-  int leftVal = sincTable[left];
-  int rightVal = sincTable[right];
+  int left = (ratio * lobePoints) / width;
+  int position = ratio * lobePoints - left * width;
+  int leftVal, rightVal;
+  int i;
+
+  for (i = 0; i < SINC_FILTER_POINTS; i++) {
+    leftVal = sincTable[left];
+    rightVal = sincTable[left + 1];
+    weights[i] =
+        ((leftVal * (width - position) + rightVal * position) << 1) / width;
+    left += lobePoints;
+  }
+}
 
-  return ((leftVal * (width - position) + rightVal * position) << 1) / width;
+/* Return the greatest common divisor of a and b. */
+static int greatestCommonDivisor(int a, int b) {
+  int t;
+
+  while (b != 0) {
+    t = a % b;
+    a = b;
+    b = t;
+  }
+  return a;
 }
 
-/* Return 1 if value >= 0, else -1.  This represents the sign of value. */
-static int getSign(int value) { return value >= 0 ? 1 : -1; }
+/* Set up the polyphase filter bank for resampling from oldSampleRate to
+   newSampleRate, unless we already have it.  adjustRate only ever needs the
+   filter at ratio + 1 values that are multiples of gcd(oldSampleRate,
+   newSampleRate, ratePhase), so there are newSampleRate/gcd phases.  Phases
+   are filled in by getSincWeights the first time they are used, so changing
+   the rate often costs nothing extra.  If there are more than
+   SONIC_MAX_SINC_PHASES, or the stream has a fixed capacity and the table
+   does not fit, no table is used, and the weights are computed for each
+   output sample instead.  Return 0 if out of memory. */
+static int updateSincWeights(sonicStream stream, int oldSampleRate,
+                             int newSampleRate) {
+  int phaseStep = greatestCommonDivisor(
+      greatestCommonDivisor(oldSampleRate, newSampleRate), stream->ratePhase);
+  int numPhases, phase;
 
-/* Interpolate the new output sample. */
-static short interpolate(sonicStream stream, short* in, int oldSampleRate,
-                         int newSampleRate) {
-  /* Compute N-point sinc FIR-filter here.  Clip rather than overflow. */
+  if (stream->sincOldSampleRate == oldSampleRate &&
+      stream->sincNewSampleRate == newSampleRate &&
+      stream->sincPhaseStep == phaseStep) {
+    return 1;
+  }
+  stream->sincOldSampleRate = oldSampleRate;
+  stream->sincNewSampleRate = newSampleRate;
+  stream->sincPhaseStep = phaseStep;
+  stream->sincNumPhases = 0;
+  numPhases = newSampleRate / phaseStep;
+  if (numPhases > SONIC_MAX_SINC_PHASES) {
+    return 1;
+  }
+  if (numPhases > stream->sincCapacity) {
+    if (stream->fixedInputSamples != 0) {
+      return 1;
+    }
+    if (!reserveSincWeights(stream, numPhases)) {
+      stream->sincOldSampleRate = 0;
+      return 0;
+    }
+  }
+  stream->sincNumPhases = numPhases;
+  for (phase = 0; phase < numPhases; phase++) {
+    stream->sincWeights[phase * SINC_FILTER_POINTS] = SONIC_SINC_UNUSED;
+  }
+  return 1;
+}
+
+/* Return the sinc FIR filter weights for the output sample at ratio.  If there
+   is no polyphase table, compute them into localWeights. */
+static int* getSincWeights(sonicStream stream, int ratio, int width,
+                           int* localWeights) {
+  int* weights;
+
+  if (stream->sincNumPhases == 0) {
+    computeSincWeights(ratio, width, localWeights);
+    return localWeights;
+  }
+  weights = stream->sincWeights +
+            ((ratio + 1) / stream->sincPhaseStep - 1) * SINC_FILTER_POINTS;
+  if (weights[0] == SONIC_SINC_UNUSED) {
+    computeSincWeights(ratio, width, weights);
+  }
+  return weights;
+}
+
+#ifdef SONIC_USE_FLOAT
+/* Interpolate the new output sample.  The float version needs no overflow
+   checks. */
+static float interpolate(float* in, int* weights, int numChannels) {
   int i;
-  int total = 0;
-  int position = stream->newRatePosition * oldSampleRate;
-  int leftPosition = stream->oldRatePosition * newSampleRate;
-  int rightPosition = (stream->oldRatePosition + 1) * newSampleRate;
-  int ratio = rightPosition - position - 1;
-  int width = rightPosition - leftPosition;
-  int weight, value;
-  int oldSign;
-  int overflowCount = 0;
+  float total = 0.0f;
 
   for (i = 0; i < SINC_FILTER_POINTS; i++) {
-    weight = findSincCoefficient(i, ratio, width);
-    /* printf("%u %f\n", i, weight); */
-    value = in[i * stream->numChannels] * weight;
-    oldSign = getSign(total);
-    total += value;
-    if (oldSign != getSign(total) && getSign(value) == oldSign) {
-      /* We must have overflowed.  This can happen with a sinc filter. */
-      overflowCount += oldSign;
-    }
-  }
-  /* It is better to clip than to wrap if there was a overflow. */
-  if (overflowCount > 0) {
+    total += in[i * numChannels] * weights[i];
+  }
+  return total * (1.0f / 65536.0f);
+}
+
+/* Interpolate a new output frame into out. */
+static void interpolateFrame(float* in, int* weights, int numChannels,
+                             float* out) {
+  int i;
+
+  for (i = 0; i < numChannels; i++) {
+    out[i] = interpolate(in + i, weights, numChannels);
+  }
+}
+#else
+/* Convert an exact sinc filter sum to a sample, clipping it if it does not fit
+   in an int, rather than letting it wrap. */
+static short sincTotalToSample(double total) {
+  if (total > INT_MAX) {
     return SHRT_MAX;
-  } else if (overflowCount < 0) {
+  } else if (total < INT_MIN) {
     return SHRT_MIN;
   }
-  return total >> 16;
+  return (int)total >> 16;
+}
+
+/* Interpolate the new output sample. */
+static short interpolate(short* in, int* weights, int numChannels) {
+  return sincTotalToSample(computeSincDot(in, weights, numChannels));
+}
+
+/* Interpolate a new output frame into out.  Channels are filtered four at a
+   time where there are enough of them, since their samples sit together. */
+static void interpolateFrame(short* in, int* weights, int numChannels,
+                             short* out) {
+  double totals[4];
+  int i = 0, j;
+
+  for (; i + 4 <= numChannels; i += 4) {
+    computeSincDots(in + i, weights, numChannels, totals);
+    for (j = 0; j < 4; j++) {
+      out[i + j] = sincTotalToSample(totals[j]);
+    }
+  }
+  for (; i < numChannels; i++) {
+    out[i] = interpolate(in + i, weights, numChannels);
+  }
+}
+#endif  /* SONIC_USE_FLOAT */
+
+/* Switch the rate positions to count in new sample rates, keeping the time of
+   the next output sample, so changing the rate does not restart the
+   resampling with a glitch. */
+static void convertRatePositions(sonicStream stream, int oldSampleRate,
+                                 int newSampleRate) {
+  double nextOutput;
+
+  if (stream->rateNewSampleRate != 0) {
+    /* The next output sample is this many input samples ahead. */
+    nextOutput = ((double)stream->newRatePosition * stream->rateOldSampleRate +
+                  stream->ratePhase) /
+                     stream->rateNewSampleRate -
+                 stream->oldRatePosition;
+    stream->oldRatePosition = 0;
+    stream->newRatePosition = 0;
+    stream->ratePhase = (int)(nextOutput * newSampleRate + 0.5);
+  }
+  stream->rateOldSampleRate = oldSampleRate;
+  stream->rateNewSampleRate = newSampleRate;
 }
 
 /* Change the rate.  Interpolate with a sinc FIR filter using a Hann window. */
@@ -924,214 +3523,1210 @@ static int adjustRate(sonicStream stream, float rate,
   int oldSampleRate = stream->sampleRate;
   int numChannels = stream->numChannels;
   int position = 0;
-  short *in, *out;
-  int i;
+  sonicSample *in, *out;
+  int localWeights[SINC_FILTER_POINTS];
+  int* weights;
+  int ratio;
   int N = SINC_FILTER_POINTS;
 
-  /* Set these values to help with the integer math */
-  while (newSampleRate > (1 << 14) || oldSampleRate > (1 << 14)) {
-    newSampleRate >>= 1;
-    oldSampleRate >>= 1;
+  /* Set these values to help with the integer math */
+  while (newSampleRate > (1 << 14) || oldSampleRate > (1 << 14)) {
+    newSampleRate >>= 1;
+    oldSampleRate >>= 1;
+  }
+  /* A write that ran out of output room may have left samples to do. */
+  if (stream->numOutputSamples == originalNumOutputSamples &&
+      stream->numPitchSamples <= N) {
+    return 1;
+  }
+  if (!moveNewSamplesToPitchBuffer(stream, originalNumOutputSamples)) {
+    return 0;
+  }
+  if (oldSampleRate != stream->rateOldSampleRate ||
+      newSampleRate != stream->rateNewSampleRate) {
+    convertRatePositions(stream, oldSampleRate, newSampleRate);
+  }
+  if (!updateSincWeights(stream, oldSampleRate, newSampleRate)) {
+    return 0;
+  }
+  /* Leave at least N pitch sample in the buffer */
+  for (position = 0; position < stream->numPitchSamples - N; position++) {
+    while ((stream->oldRatePosition + 1) * newSampleRate >
+           stream->newRatePosition * oldSampleRate + stream->ratePhase) {
+      if (!enlargeOutputBufferIfNeeded(stream, 1)) {
+        removePitchSamples(stream, position);
+        return 0;
+      }
+      ratio = (stream->oldRatePosition + 1) * newSampleRate -
+              stream->newRatePosition * oldSampleRate - stream->ratePhase - 1;
+      weights = getSincWeights(stream, ratio, newSampleRate, localWeights);
+      out = stream->outputBuffer + stream->numOutputSamples * numChannels;
+      in = stream->pitchBuffer + position * numChannels;
+      interpolateFrame(in, weights, numChannels, out);
+      stream->newRatePosition++;
+      stream->numOutputSamples++;
+    }
+    stream->oldRatePosition++;
+    if (stream->oldRatePosition == oldSampleRate) {
+      stream->oldRatePosition = 0;
+      stream->newRatePosition -= newSampleRate;
+    }
+  }
+  removePitchSamples(stream, position);
+  return 1;
+}
+
+/* Skip over a pitch period, and copy period/speed samples to the output */
+static int skipPitchPeriod(sonicStream stream, sonicSample* samples,
+                           float speed, int period) {
+  long newSamples = period;
+  int numChannels = stream->numChannels;
+
+  if (speed >= 2.0f) {
+    newSamples = period / (speed - 1.0f);
+  }
+  /* Leave the stream as it was if the output does not fit. */
+  if (!enlargeOutputBufferIfNeeded(stream, newSamples)) {
+    return 0;
+  }
+  if (speed < 2.0f) {
+    stream->remainingInputToCopy = period * (2.0f - speed) / (speed - 1.0f);
+    stream->copySpeed = speed;
+  }
+  overlapAdd(stream, newSamples,
+             stream->outputBuffer + stream->numOutputSamples * numChannels,
+             samples, samples + period * numChannels);
+  stream->numOutputSamples += newSamples;
+  stream->stats.overlapAddSamples += newSamples;
+  return newSamples;
+}
+
+/* Insert a pitch period, and determine how much input to copy directly. */
+static int insertPitchPeriod(sonicStream stream, sonicSample* samples,
+                             float speed, int period) {
+  long newSamples = period;
+  sonicSample* out;
+  int numChannels = stream->numChannels;
+
+  if (speed < 0.5f) {
+    newSamples = period * speed / (1.0f - speed);
+  }
+  if (!enlargeOutputBufferIfNeeded(stream, period + newSamples)) {
+    return 0;
+  }
+  if (speed >= 0.5f) {
+    stream->remainingInputToCopy =
+        period * (2.0f * speed - 1.0f) / (1.0f - speed);
+    stream->copySpeed = speed;
+  }
+  out = stream->outputBuffer + stream->numOutputSamples * numChannels;
+  memcpy(out, samples, period * sizeof(sonicSample) * numChannels);
+  out =
+      stream->outputBuffer + (stream->numOutputSamples + period) * numChannels;
+  overlapAdd(stream, newSamples, out, samples + period * numChannels,
+             samples);
+  stream->numOutputSamples += period + newSamples;
+  stream->stats.copiedSamples += period;
+  stream->stats.overlapAddSamples += newSamples;
+  return newSamples;
+}
+
+/* Return the average magnitude of a pitch period, in 16-bit units, with the
+   channels mixed together. */
+static float computePeriodPower(sonicStream stream, sonicSample* samples,
+                                int period) {
+  int numSamples = period * stream->numChannels;
+  double total = 0.0;
+  int i;
+
+  for (i = 0; i < numSamples; i++) {
+    total += samples[i] >= 0 ? samples[i] : -samples[i];
+  }
+#ifdef SONIC_USE_FLOAT
+  total *= 32767.0;
+#endif
+  return total / numSamples;
+}
+
+/* Return the speed to use for the pitch period just found, in nonlinear
+   speedup mode.  Silent periods are weighted to go SONIC_SILENCE_WEIGHT times
+   faster than voiced ones, and unvoiced periods SONIC_UNVOICED_WEIGHT times
+   faster.  Scaling by the recent average of 1 / weight keeps the overall speed
+   near speed, and any drift left over is fed back through nonlinearError. */
+static float findNonlinearSpeed(sonicStream stream, sonicSample* samples,
+                                int period, float speed) {
+  float power = computePeriodPower(stream, samples, period);
+  float weight = 1.0f, correction, localSpeed;
+
+  if (power < stream->avePower * SONIC_SILENCE_POWER) {
+    weight = SONIC_SILENCE_WEIGHT;
+  } else if (stream->voicedMinDiff >
+             stream->voicedMaxDiff * SONIC_UNVOICED_DIFF_RATIO) {
+    weight = SONIC_UNVOICED_WEIGHT;
+  } else {
+    /* Track the loudness of voiced speech, to tell what is silent. */
+    stream->avePower += (power - stream->avePower) * 0.05f;
+  }
+  /* Output length is the sum of period / speed, so average 1 / weight. */
+  stream->aveInverseWeight += (1.0f / weight - stream->aveInverseWeight) *
+                              period /
+                              (stream->sampleRate * SONIC_NONLINEAR_SECONDS);
+  /* Speed up if we have output too much, by 2X per extra second. */
+  correction = 1.0f + stream->nonlinearError / stream->sampleRate;
+  if (correction < 0.5f) {
+    correction = 0.5f;
+  } else if (correction > 2.0f) {
+    correction = 2.0f;
+  }
+  localSpeed = speed * weight * correction * stream->aveInverseWeight;
+  /* skipPitchPeriod and insertPitchPeriod need the speed to be clearly
+     different from 1, and to make at least one sample. */
+  if (localSpeed >= 1.0f && localSpeed < 1.05f) {
+    localSpeed = 1.05f;
+  } else if (localSpeed < 1.0f && localSpeed > 0.95f) {
+    localSpeed = 0.95f;
+  }
+  if (localSpeed > period) {
+    localSpeed = period;
+  } else if (localSpeed < 1.0f / period) {
+    localSpeed = 1.0f / period;
+  }
+  return localSpeed;
+}
+
+/* Add how much more output than speed asks for was made from numInput input
+   samples, in nonlinear speedup mode. */
+static void updateNonlinearError(sonicStream stream, int numInput,
+                                 int numOutput, float speed) {
+  /* Forget old errors over SONIC_NONLINEAR_SECONDS. */
+  stream->nonlinearError *=
+      1.0f - (float)numInput / (stream->sampleRate * SONIC_NONLINEAR_SECONDS);
+  stream->nonlinearError += numOutput - numInput / speed;
+}
+
+/* Return how many periods of input are copied after each period skipped or
+   inserted at speed. */
+static float getCopyPeriods(sonicStream stream, float speed) {
+  if (stream->lowLatency) {
+    return speed > 1.0f ? 1.0f / (speed - 1.0f) : speed / (1.0f - speed);
+  }
+  if (speed > 1.0f) {
+    return speed >= 2.0f ? 0.0f : (2.0f - speed) / (speed - 1.0f);
+  }
+  return speed < 0.5f ? 0.0f : (2.0f * speed - 1.0f) / (1.0f - speed);
+}
+
+/* Return the speed for the pitch period at input position while ramps are
+   scheduled, and scale the input left to copy to suit it, so a ramp does not
+   wait for a long copy to end.  The speed is kept clearly different from 1,
+   since the copy after each period grows as 1 / |speed - 1|. */
+static float getRampedSpeed(sonicStream stream, long position) {
+  float speed, oldSpeed = stream->copySpeed;
+
+  applyRamps(stream, position);
+  speed = stream->speed / stream->pitch;
+  if (speed >= 1.0f && speed < 1.00001f) {
+    speed = 1.00001f;
+  } else if (speed < 1.0f && speed > 0.99999f) {
+    speed = 0.99999f;
+  }
+  if (stream->remainingInputToCopy > 0 && speed != oldSpeed) {
+    if ((speed > 1.0f) != (oldSpeed > 1.0f)) {
+      stream->remainingInputToCopy = 0;
+    } else {
+      stream->remainingInputToCopy *=
+          getCopyPeriods(stream, speed) / getCopyPeriods(stream, oldSpeed);
+    }
+    stream->copySpeed = speed;
+  }
+  return speed;
+}
+
+/* Create an empty set of pitch marks for input at sampleRate. */
+sonicPitchMarks sonicCreatePitchMarks(int sampleRate) {
+  sonicPitchMarks pitchMarks =
+      (sonicPitchMarks)calloc(1, sizeof(struct sonicPitchMarksStruct));
+
+  if (pitchMarks == NULL) {
+    return NULL;
+  }
+  pitchMarks->sampleRate = sampleRate;
+  return pitchMarks;
+}
+
+/* Destroy the pitch marks. */
+void sonicDestroyPitchMarks(sonicPitchMarks pitchMarks) {
+  if (pitchMarks != NULL) {
+    free(pitchMarks->marks);
+    free(pitchMarks);
+  }
+}
+
+/* Return the number of pitch marks. */
+int sonicGetNumPitchMarks(sonicPitchMarks pitchMarks) {
+  return pitchMarks->numMarks;
+}
+
+/* Return the sample rate the pitch marks were made for. */
+int sonicGetPitchMarksSampleRate(sonicPitchMarks pitchMarks) {
+  return pitchMarks->sampleRate;
+}
+
+/* Get the pitch mark at index. */
+void sonicGetPitchMark(sonicPitchMarks pitchMarks, int index, long* position,
+                       int* period, int* minDiff, int* maxDiff) {
+  sonicPitchMark* mark = pitchMarks->marks + index;
+
+  *position = mark->position;
+  *period = mark->period;
+  *minDiff = mark->minDiff;
+  *maxDiff = mark->maxDiff;
+}
+
+/* Add a pitch mark, replacing any at or after its position.  Return 0 if out
+   of memory. */
+int sonicAddPitchMark(sonicPitchMarks pitchMarks, long position, int period,
+                      int minDiff, int maxDiff) {
+  sonicPitchMark* mark;
+
+  while (pitchMarks->numMarks > 0 &&
+         pitchMarks->marks[pitchMarks->numMarks - 1].position >= position) {
+    pitchMarks->numMarks--;
+  }
+  if (pitchMarks->numMarks == pitchMarks->allocatedMarks) {
+    int allocatedMarks = pitchMarks->allocatedMarks * 2 + 256;
+    mark = (sonicPitchMark*)realloc(pitchMarks->marks,
+                                    allocatedMarks * sizeof(sonicPitchMark));
+    if (mark == NULL) {
+      return 0;
+    }
+    pitchMarks->marks = mark;
+    pitchMarks->allocatedMarks = allocatedMarks;
+  }
+  mark = pitchMarks->marks + pitchMarks->numMarks++;
+  mark->position = position;
+  mark->period = period;
+  mark->minDiff = minDiff;
+  mark->maxDiff = maxDiff;
+  return 1;
+}
+
+/* Pitch mark files start with this, followed by a version byte. */
+static const char sonicPitchMarksMagic[7] = {'S', 'O', 'N', 'I', 'C', 'P', 'M'};
+#define SONIC_PITCH_MARKS_VERSION 1
+/* The most bytes a number takes in a pitch mark file. */
+#define SONIC_MAX_VARINT_BYTES 10
+
+/* Write value 7 bits at a time, low bits first, setting the top bit of every
+   byte but the last.  Return the end of what was written. */
+static unsigned char* putVarint(unsigned char* p, unsigned long value) {
+  while (value >= 0x80) {
+    *p++ = (unsigned char)(value | 0x80);
+    value >>= 7;
+  }
+  *p++ = (unsigned char)value;
+  return p;
+}
+
+/* Write a signed value, mapping small negative values to small numbers. */
+static unsigned char* putSignedVarint(unsigned char* p, long value) {
+  if (value < 0) {
+    return putVarint(p, ((unsigned long)(-(value + 1)) << 1) | 1);
+  }
+  return putVarint(p, (unsigned long)value << 1);
+}
+
+/* Read a value written by putVarint.  Return the end of it, or NULL if it
+   runs past end or is too long. */
+static const unsigned char* getVarint(const unsigned char* p,
+                                      const unsigned char* end,
+                                      unsigned long* value) {
+  int shift = 0;
+
+  *value = 0;
+  while (p < end && shift < (int)sizeof(unsigned long) * 8) {
+    *value |= (unsigned long)(*p & 0x7f) << shift;
+    if (!(*p++ & 0x80)) {
+      return p;
+    }
+    shift += 7;
+  }
+  return NULL;
+}
+
+/* Read a value written by putSignedVarint, which must fit in an int. */
+static const unsigned char* getSignedVarint(const unsigned char* p,
+                                            const unsigned char* end,
+                                            long* value) {
+  unsigned long number;
+
+  p = getVarint(p, end, &number);
+  if (p == NULL || number > ((unsigned long)INT_MAX << 1 | 1)) {
+    return NULL;
+  }
+  *value = number & 1 ? -(long)(number >> 1) - 1 : (long)(number >> 1);
+  return p;
+}
+
+/* Save the pitch marks to a file.  Each period usually starts where the last
+   one ended, so only the difference is saved, and every number is saved in
+   as few bytes as it needs, which is about 6 bytes per mark. */
+int sonicSavePitchMarks(sonicPitchMarks pitchMarks, char* fileName) {
+  sonicPitchMark* mark = pitchMarks->marks;
+  unsigned char* buffer;
+  unsigned char* p;
+  FILE* file;
+  long expectedPosition = 0;
+  int i, succeeded;
+
+  buffer = (unsigned char*)malloc(
+      sizeof(sonicPitchMarksMagic) + 1 +
+      (2 + 4 * (size_t)pitchMarks->numMarks) * SONIC_MAX_VARINT_BYTES);
+  if (buffer == NULL) {
+    return 0;
+  }
+  memcpy(buffer, sonicPitchMarksMagic, sizeof(sonicPitchMarksMagic));
+  p = buffer + sizeof(sonicPitchMarksMagic);
+  *p++ = SONIC_PITCH_MARKS_VERSION;
+  p = putVarint(p, pitchMarks->sampleRate);
+  p = putVarint(p, pitchMarks->numMarks);
+  for (i = 0; i < pitchMarks->numMarks; i++, mark++) {
+    p = putSignedVarint(p, mark->position - expectedPosition);
+    p = putVarint(p, mark->period);
+    p = putSignedVarint(p, mark->minDiff);
+    p = putSignedVarint(p, mark->maxDiff);
+    expectedPosition = mark->position + mark->period;
+  }
+  file = fopen(fileName, "wb");
+  succeeded = file != NULL;
+  if (succeeded) {
+    succeeded = fwrite(buffer, 1, p - buffer, file) == (size_t)(p - buffer);
+    if (fclose(file) != 0) {
+      succeeded = 0;
+    }
+  }
+  free(buffer);
+  return succeeded;
+}
+
+/* Parse the pitch marks in a file read into memory.  Return NULL if it is not
+   a valid pitch mark file, or if out of memory. */
+static sonicPitchMarks parsePitchMarks(const unsigned char* p,
+                                       const unsigned char* end) {
+  sonicPitchMarks pitchMarks;
+  unsigned long sampleRate, numMarks, period, i;
+  long gap, minDiff, maxDiff, position = 0;
+
+  if (end - p < (long)sizeof(sonicPitchMarksMagic) + 1 ||
+      memcmp(p, sonicPitchMarksMagic, sizeof(sonicPitchMarksMagic)) ||
+      p[sizeof(sonicPitchMarksMagic)] != SONIC_PITCH_MARKS_VERSION) {
+    return NULL;
+  }
+  p += sizeof(sonicPitchMarksMagic) + 1;
+  p = getVarint(p, end, &sampleRate);
+  if (p == NULL || sampleRate == 0 || sampleRate > INT_MAX) {
+    return NULL;
+  }
+  p = getVarint(p, end, &numMarks);
+  /* Each mark takes at least 4 bytes. */
+  if (p == NULL || numMarks > (unsigned long)(end - p) / 4) {
+    return NULL;
+  }
+  pitchMarks = sonicCreatePitchMarks((int)sampleRate);
+  for (i = 0; i < numMarks && pitchMarks != NULL; i++) {
+    p = getSignedVarint(p, end, &gap);
+    if (p != NULL) {
+      p = getVarint(p, end, &period);
+    }
+    if (p != NULL) {
+      p = getSignedVarint(p, end, &minDiff);
+    }
+    if (p != NULL) {
+      p = getSignedVarint(p, end, &maxDiff);
+    }
+    /* The position is never negative, so only adding a positive gap or the
+       period can overflow it, which a long of 32 bits soon would. */
+    if (p == NULL || period == 0 || period > INT_MAX ||
+        (gap > 0 && gap > LONG_MAX - position)) {
+      sonicDestroyPitchMarks(pitchMarks);
+      return NULL;
+    }
+    position += gap;
+    if (position < 0 || (long)period > LONG_MAX - position ||
+        (pitchMarks->numMarks > 0 &&
+         position <= pitchMarks->marks[pitchMarks->numMarks - 1].position) ||
+        !sonicAddPitchMark(pitchMarks, position, (int)period, (int)minDiff,
+                           (int)maxDiff)) {
+      sonicDestroyPitchMarks(pitchMarks);
+      return NULL;
+    }
+    position += period;
+  }
+  return pitchMarks;
+}
+
+/* Load pitch marks saved by sonicSavePitchMarks. */
+sonicPitchMarks sonicLoadPitchMarks(char* fileName) {
+  sonicPitchMarks pitchMarks = NULL;
+  unsigned char* buffer = NULL;
+  FILE* file = fopen(fileName, "rb");
+  long size = -1;
+
+  if (file == NULL) {
+    return NULL;
   }
-  if (stream->numOutputSamples == originalNumOutputSamples) {
-    return 1;
+  if (fseek(file, 0, SEEK_END) == 0) {
+    size = ftell(file);
   }
-  if (!moveNewSamplesToPitchBuffer(stream, originalNumOutputSamples)) {
-    return 0;
+  if (size >= 0 && fseek(file, 0, SEEK_SET) == 0) {
+    buffer = (unsigned char*)malloc(size + 1);
   }
-  /* Leave at least N pitch sample in the buffer */
-  for (position = 0; position < stream->numPitchSamples - N; position++) {
-    while ((stream->oldRatePosition + 1) * newSampleRate >
-           stream->newRatePosition * oldSampleRate) {
-      if (!enlargeOutputBufferIfNeeded(stream, 1)) {
-        return 0;
-      }
-      out = stream->outputBuffer + stream->numOutputSamples * numChannels;
-      in = stream->pitchBuffer + position * numChannels;
-      for (i = 0; i < numChannels; i++) {
-        *out++ = interpolate(stream, in, oldSampleRate, newSampleRate);
-        in++;
-      }
-      stream->newRatePosition++;
-      stream->numOutputSamples++;
-    }
-    stream->oldRatePosition++;
-    if (stream->oldRatePosition == oldSampleRate) {
-      stream->oldRatePosition = 0;
-      if (stream->newRatePosition != newSampleRate) {
-        fprintf(stderr,
-                "Assertion failed: stream->newRatePosition != newSampleRate\n");
-        exit(1);
-      }
-      stream->newRatePosition = 0;
-    }
+  if (buffer != NULL && fread(buffer, 1, size, file) == (size_t)size) {
+    pitchMarks = parsePitchMarks(buffer, buffer + size);
   }
-  removePitchSamples(stream, position);
-  return 1;
+  free(buffer);
+  fclose(file);
+  return pitchMarks;
 }
 
-/* Skip over a pitch period, and copy period/speed samples to the output */
-static int skipPitchPeriod(sonicStream stream, short* samples, float speed,
-                           int period) {
-  long newSamples;
-  int numChannels = stream->numChannels;
+/* Return the stream's pitch mark whose period covers input position, or NULL
+   if there is none the stream can use. */
+static sonicPitchMark* findPitchMark(sonicStream stream, long position) {
+  sonicPitchMarks pitchMarks = stream->pitchMarks;
+  sonicPitchMark* mark;
+  int low = 0, high, middle;
 
-  if (speed >= 2.0f) {
-    newSamples = period / (speed - 1.0f);
-  } else {
-    newSamples = period;
-    stream->remainingInputToCopy = period * (2.0f - speed) / (speed - 1.0f);
+  if (pitchMarks == NULL || pitchMarks->numMarks == 0 ||
+      pitchMarks->sampleRate != stream->sampleRate) {
+    return NULL;
   }
-  if (!enlargeOutputBufferIfNeeded(stream, newSamples)) {
-    return 0;
+  /* Find the last mark at or before the position. */
+  high = pitchMarks->numMarks - 1;
+  while (low < high) {
+    middle = (low + high + 1) >> 1;
+    if (pitchMarks->marks[middle].position <= position) {
+      low = middle;
+    } else {
+      high = middle - 1;
+    }
   }
-  overlapAdd(newSamples, numChannels,
-             stream->outputBuffer + stream->numOutputSamples * numChannels,
-             samples, samples + period * numChannels);
-  stream->numOutputSamples += newSamples;
-  return newSamples;
+  mark = pitchMarks->marks + low;
+  if (position < mark->position || position >= mark->position + mark->period ||
+      mark->period < stream->minPeriod || mark->period > stream->maxPeriod) {
+    return NULL;
+  }
+  return mark;
 }
 
-/* Insert a pitch period, and determine how much input to copy directly. */
-static int insertPitchPeriod(sonicStream stream, short* samples, float speed,
-                             int period) {
-  long newSamples;
-  short* out;
-  int numChannels = stream->numChannels;
+/* Find the pitch period at position in the input buffer, looking it up in
+   the stream's pitch marks if they cover it. */
+static int findMarkedPitchPeriod(sonicStream stream, sonicSample* samples,
+                                 int position) {
+  sonicPitchMark* mark = NULL;
 
-  if (speed < 0.5f) {
-    newSamples = period * speed / (1.0f - speed);
-  } else {
-    newSamples = period;
-    stream->remainingInputToCopy =
-        period * (2.0f * speed - 1.0f) / (1.0f - speed);
+  if (!stream->recordPitchMarks) {
+    mark = findPitchMark(stream, stream->inputPosition + position);
   }
-  if (!enlargeOutputBufferIfNeeded(stream, period + newSamples)) {
+  if (mark == NULL) {
+    return findPitchPeriod(stream, samples, 1);
+  }
+  stream->voicedMinDiff = mark->minDiff;
+  stream->voicedMaxDiff = mark->maxDiff;
+  stream->stats.markedPeriods++;
+  return mark->period;
+}
+
+/* Find the pitch period at the start of samples, with the same search the
+   stream uses to change the speed.  This drops buffered samples.  Return 0 if
+   there are too few samples, or if we are out of memory. */
+int sonicFindPitchPeriod(sonicStream stream, short* samples, int numSamples) {
+  int period;
+
+  sonicResetStream(stream);
+  if (numSamples < stream->maxRequired ||
+      !addShortSamples(stream, samples, stream->maxRequired, 0)) {
     return 0;
   }
-  out = stream->outputBuffer + stream->numOutputSamples * numChannels;
-  memcpy(out, samples, period * sizeof(short) * numChannels);
-  out =
-      stream->outputBuffer + (stream->numOutputSamples + period) * numChannels;
-  overlapAdd(newSamples, numChannels, out, samples + period * numChannels,
-             samples);
-  stream->numOutputSamples += period + newSamples;
-  return newSamples;
+  period = findPitchPeriod(stream, stream->inputBuffer, 0);
+  sonicResetStream(stream);
+  return period;
 }
 
 /* Resample as many pitch periods as we have buffered on the input.  Return 0 if
    we fail to resize an input or output buffer. */
 static int changeSpeed(sonicStream stream, float speed) {
-  short* samples;
+  sonicSample* samples;
   int numSamples = stream->numInputSamples;
-  int position = 0, period, newSamples;
+  int position = 0, period, newSamples, startPosition, startOutput;
   int maxRequired = stream->maxRequired;
+  int ramped = rampsPending(stream);
+  int pitchHistory[4];
+  float periodSpeed = speed;
 
   /* printf("Changing speed to %f\n", speed); */
   if (stream->numInputSamples < maxRequired) {
     return 1;
   }
   do {
+    startPosition = position;
+    startOutput = stream->numOutputSamples;
+    savePitchHistory(stream, pitchHistory);
+    if (ramped) {
+      speed = getRampedSpeed(stream, stream->inputPosition + position);
+      periodSpeed = speed;
+    }
     if (stream->remainingInputToCopy > 0) {
-      newSamples = copyInputToOutput(stream, position);
+      newSamples = copyInputToOutput(stream, position, maxRequired);
       position += newSamples;
     } else {
       samples = stream->inputBuffer + position * stream->numChannels;
-      period = findPitchPeriod(stream, samples, 1);
+      period = findMarkedPitchPeriod(stream, samples, position);
+      if (stream->nonlinearSpeedup) {
+        periodSpeed = findNonlinearSpeed(stream, samples, period, speed);
+      }
+      if (stream->recordPitchMarks) {
+        newSamples = 0;
+        if (sonicAddPitchMark(stream->pitchMarks,
+                              stream->inputPosition + position, period,
+                              stream->voicedMinDiff, stream->voicedMaxDiff)) {
+          newSamples = period;
+        }
+        position += period;
+      }
 #ifdef SONIC_SPECTROGRAM
-      if (stream->spectrogram != NULL) {
+      else if (stream->spectrogram != NULL) {
         sonicAddPitchPeriodToSpectrogram(stream->spectrogram, samples, period,
                                          stream->numChannels);
         newSamples = period;
         position += period;
-      } else
+      }
 #endif  /* SONIC_SPECTROGRAM */
-          if (speed > 1.0) {
-        newSamples = skipPitchPeriod(stream, samples, speed, period);
+      else if (periodSpeed > 1.0) {
+        newSamples = skipPitchPeriod(stream, samples, periodSpeed, period);
         position += period + newSamples;
       } else {
-        newSamples = insertPitchPeriod(stream, samples, speed, period);
+        newSamples = insertPitchPeriod(stream, samples, periodSpeed, period);
         position += newSamples;
       }
     }
     if (newSamples == 0) {
-      return 0; /* Failed to resize output buffer */
+      /* Failed to resize the output buffer.  Keep the input from this period
+         on, so writing again after reading some output continues here. */
+      restorePitchHistory(stream, pitchHistory);
+      removeInputSamples(stream, startPosition);
+      return 0;
+    }
+    if (stream->nonlinearSpeedup) {
+      updateNonlinearError(stream, position - startPosition,
+                           stream->numOutputSamples - startOutput, speed);
     }
   } while (position + maxRequired <= numSamples);
   removeInputSamples(stream, position);
   return 1;
 }
 
-/* Resample as many pitch periods as we have buffered on the input.  Return 0 if
-   we fail to resize an input or output buffer.  Also scale the output by the
-   volume. */
-static int processStreamInput(sonicStream stream) {
-  int originalNumOutputSamples = stream->numOutputSamples;
+/* Remember input samples that have been processed, in low latency mode.  Only
+   the last maxRequired are kept, and they are moved down to the start of the
+   history buffer only when it is full. */
+static void addHistorySamples(sonicStream stream, sonicSample* samples,
+                              int numSamples) {
+  int numChannels = stream->numChannels;
+  int maxRequired = stream->maxRequired;
+  int numKept;
+
+  if (numSamples > maxRequired) {
+    samples += (numSamples - maxRequired) * numChannels;
+    numSamples = maxRequired;
+  }
+  if (stream->numHistorySamples + numSamples > 2 * maxRequired) {
+    numKept = maxRequired - numSamples;
+    memmove(stream->historyBuffer,
+            stream->historyBuffer +
+                (stream->numHistorySamples - numKept) * numChannels,
+            numKept * sizeof(sonicSample) * numChannels);
+    stream->numHistorySamples = numKept;
+  }
+  memcpy(stream->historyBuffer + stream->numHistorySamples * numChannels,
+         samples, numSamples * sizeof(sonicSample) * numChannels);
+  stream->numHistorySamples += numSamples;
+}
+
+/* Skip a pitch period in low latency mode.  Rather than fading over a whole
+   period, fade from the samples at the current position to the ones a period
+   later over at most fade samples, then copy enough input to make the speed
+   right.  Return the number of input samples used, or 0 if we fail to resize
+   the output buffer. */
+static int skipPitchPeriodLowLatency(sonicStream stream, sonicSample* samples,
+                                     float speed, int period, int fade) {
+  long newSamples = period / (speed - 1.0f);
+  int numChannels = stream->numChannels;
+
+  if (newSamples < 1) {
+    newSamples = 1;
+  }
+  if (fade > newSamples) {
+    fade = newSamples;
+  }
+  if (!enlargeOutputBufferIfNeeded(stream, fade)) {
+    return 0;
+  }
+  overlapAdd(stream, fade,
+             stream->outputBuffer + stream->numOutputSamples * numChannels,
+             samples, samples + period * numChannels);
+  stream->numOutputSamples += fade;
+  stream->stats.overlapAddSamples += fade;
+  stream->remainingInputToCopy = newSamples - fade;
+  stream->copySpeed = speed;
+  return period + fade;
+}
+
+/* Repeat the pitch period just before samples in low latency mode.  Fade from
+   the samples at the current position to the ones a period back over fade
+   samples, and copy the rest of that period from the history, which brings us
+   back to where we started.  Then copy enough input to make the speed right.
+   Return 0 if we fail to resize the output buffer. */
+static int insertPitchPeriodLowLatency(sonicStream stream, sonicSample* samples,
+                                       sonicSample* history, float speed,
+                                       int period, int fade) {
+  long newSamples = period * speed / (1.0f - speed);
+  int numChannels = stream->numChannels;
+  sonicSample* past = history + (stream->maxRequired - period) * numChannels;
+  sonicSample* out;
+
+  if (!enlargeOutputBufferIfNeeded(stream, period)) {
+    return 0;
+  }
+  out = stream->outputBuffer + stream->numOutputSamples * numChannels;
+  overlapAdd(stream, fade, out, samples, past);
+  memcpy(out + fade * numChannels, past + fade * numChannels,
+         (period - fade) * sizeof(sonicSample) * numChannels);
+  stream->numOutputSamples += period;
+  stream->stats.overlapAddSamples += fade;
+  stream->stats.copiedSamples += period - fade;
+  /* Always use some input, so we make progress at very low speeds. */
+  stream->remainingInputToCopy = newSamples < 1 ? 1 : newSamples;
+  stream->copySpeed = speed;
+  return 1;
+}
+
+/* Change the speed in low latency mode.  This works like changeSpeed, but the
+   pitch period is found in the last maxRequired samples already processed, so
+   slowing down needs only fade samples of future input, and speeding up needs
+   only enough to skip the longest period.  The fade is one minimum period
+   long.  Return 0 if we fail to resize the output buffer, keeping the input
+   from the period that failed. */
+static int changeSpeedLowLatency(sonicStream stream, float speed) {
+  sonicSample* samples;
+  sonicSample* history;
+  int numSamples = stream->numInputSamples;
+  int numChannels = stream->numChannels;
+  int fade = stream->minPeriod;
+  int lookahead = fade;
+  int position = 0, period, newSamples, startPosition, startOutput;
+  int ramped = rampsPending(stream);
+  int pitchHistory[4];
+  int result = 1;
+  float periodSpeed = speed;
+
+  if (speed > 1.0f || stream->nonlinearSpeedup || ramped) {
+    lookahead += stream->maxPeriod;
+  }
+  for (;;) {
+    startPosition = position;
+    startOutput = stream->numOutputSamples;
+    samples = stream->inputBuffer + position * numChannels;
+    savePitchHistory(stream, pitchHistory);
+    if (ramped) {
+      speed = getRampedSpeed(stream, stream->inputPosition + position);
+      periodSpeed = speed;
+    }
+    if (stream->remainingInputToCopy > 0) {
+      if (position == numSamples) {
+        break;
+      }
+      newSamples = copyInputToOutput(stream, position, numSamples - position);
+      if (newSamples == 0) {
+        result = 0;
+        break;
+      }
+      position += newSamples;
+    } else {
+      if (position + lookahead > numSamples) {
+        break;
+      }
+      history = stream->historyBuffer +
+                (stream->numHistorySamples - stream->maxRequired) * numChannels;
+      period = findPitchPeriod(stream, history, 1);
+      if (stream->nonlinearSpeedup) {
+        periodSpeed = findNonlinearSpeed(
+            stream, history + (stream->maxRequired - period) * numChannels,
+            period, speed);
+      }
+      if (periodSpeed > 1.0f) {
+        newSamples = skipPitchPeriodLowLatency(stream, samples, periodSpeed,
+                                               period, fade);
+        if (newSamples == 0) {
+          result = 0;
+          break;
+        }
+        position += newSamples;
+      } else if (!insertPitchPeriodLowLatency(stream, samples, history,
+                                              periodSpeed, period, fade)) {
+        result = 0;
+        break;
+      }
+    }
+    addHistorySamples(stream, samples, position - startPosition);
+    if (stream->nonlinearSpeedup) {
+      updateNonlinearError(stream, position - startPosition,
+                           stream->numOutputSamples - startOutput, speed);
+    }
+  }
+  if (!result) {
+    /* Like changeSpeed, keep the period that did not fit for the next write. */
+    restorePitchHistory(stream, pitchHistory);
+  }
+  removeInputSamples(stream, position);
+  return result;
+}
+
+/* Return the most input samples per channel that are held back before they
+   affect the output, with the current settings. */
+int sonicGetLatencySamples(sonicStream stream) {
   float speed = stream->speed / stream->pitch;
   float rate = stream->rate;
+  int latency = 0;
 
   if (!stream->useChordPitch) {
     rate *= stream->pitch;
   }
-  if (speed > 1.00001 || speed < 0.99999) {
-    changeSpeed(stream, speed);
+  if (speed > 1.00001 || speed < 0.99999 || stream->nonlinearSpeedup) {
+    if (!stream->lowLatency) {
+      latency = stream->maxRequired;
+    } else if (speed > 1.0f || stream->nonlinearSpeedup) {
+      latency = stream->maxPeriod + stream->minPeriod;
+    } else {
+      latency = stream->minPeriod;
+    }
+  }
+  if (stream->useChordPitch) {
+    if (stream->pitch != 1.0f) {
+      latency += stream->maxRequired;
+    }
+  } else if (rate != 1.0f) {
+    latency += SINC_FILTER_POINTS;
+  }
+  return latency;
+}
+
+/* Apply the pending volume to the whole output buffer now. */
+static void applyOutputVolume(sonicStream stream) {
+  if (stream->outputVolume != 1.0f) {
+    beginStage(stream);
+    scaleSamples(stream->outputBuffer,
+                 stream->numOutputSamples * stream->numChannels,
+                 stream->outputVolume);
+    endStage(stream, SONIC_STAGE_SCALE_SAMPLES);
+    stream->outputVolume = 1.0f;
+  }
+}
+
+/* Leave the output samples made since originalNumOutputSamples to be scaled
+   by the volume as they are read.  That only works while all the output
+   buffered wants the same volume, so when the volume has changed under
+   samples not yet read, scale everything now instead. */
+static void deferVolume(sonicStream stream, int originalNumOutputSamples) {
+  int numChannels = stream->numChannels;
+
+  if (stream->numOutputSamples == originalNumOutputSamples ||
+      stream->volume == stream->outputVolume) {
+    return;
+  }
+  if (originalNumOutputSamples == 0) {
+    stream->outputVolume = stream->volume;
+    return;
+  }
+  beginStage(stream);
+  if (stream->outputVolume != 1.0f) {
+    scaleSamples(stream->outputBuffer, originalNumOutputSamples * numChannels,
+                 stream->outputVolume);
+  }
+  if (stream->volume != 1.0f) {
+    scaleSamples(
+        stream->outputBuffer + originalNumOutputSamples * numChannels,
+        (stream->numOutputSamples - originalNumOutputSamples) * numChannels,
+        stream->volume);
+  }
+  endStage(stream, SONIC_STAGE_SCALE_SAMPLES);
+  stream->outputVolume = 1.0f;
+}
+
+/* Return 1 if processInput would only copy the input to the output.  The
+   volume does not matter, since it is applied as the output is read. */
+static int passesThrough(sonicStream stream) {
+  float speed = stream->speed / stream->pitch;
+  float rate = stream->rate * stream->pitch;
+
+  if (speed > 1.00001 || speed < 0.99999 || stream->nonlinearSpeedup ||
+      stream->recordPitchMarks || rampsPending(stream)) {
+    return 0;
+  }
+  if (stream->useChordPitch) {
+    return stream->pitch == 1.0f;
+  }
+  return rate == 1.0f;
+}
+
+/* Count numSamples input samples that were put straight into the output
+   buffer after the first originalNumOutputSamples, as if processInput had
+   copied them there. */
+static void passSamplesThrough(sonicStream stream, int originalNumOutputSamples,
+                               int numSamples) {
+  if (stream->lowLatency) {
+    addHistorySamples(stream,
+                      stream->outputBuffer +
+                          originalNumOutputSamples * stream->numChannels,
+                      numSamples);
+  }
+  stream->numOutputSamples = originalNumOutputSamples + numSamples;
+  stream->stats.copiedSamples += numSamples;
+  stream->inputPosition += numSamples;
+  deferVolume(stream, originalNumOutputSamples);
+  addSyncPoint(stream);
+}
+
+/* Pass all the input through to the empty output buffer by swapping the two
+   buffers, so no samples are copied. */
+static void swapInputAndOutput(sonicStream stream) {
+  sonicSample* buffer = stream->outputBuffer;
+  int size = stream->outputBufferSize;
+  int start = stream->outputBufferStart;
+
+  stream->outputBuffer = stream->inputBuffer;
+  stream->outputBufferSize = stream->inputBufferSize;
+  stream->outputBufferStart = stream->inputBufferStart;
+  stream->inputBuffer = buffer;
+  stream->inputBufferSize = size;
+  stream->inputBufferStart = start;
+  passSamplesThrough(stream, 0, stream->numInputSamples);
+  stream->numInputSamples = 0;
+}
+
+/* Return 1 if the speed is changed in low latency mode.  Recording pitch marks
+   and computing a spectrogram look at each period of the input as it comes,
+   so they always use changeSpeed. */
+static int usesLowLatencySpeed(sonicStream stream) {
+#ifdef SONIC_SPECTROGRAM
+  if (stream->spectrogram != NULL) {
+    return 0;
+  }
+#endif  /* SONIC_SPECTROGRAM */
+  return stream->lowLatency && !stream->recordPitchMarks;
+}
+
+/* Resample as many pitch periods as we have buffered on the input.  Return 0 if
+   we fail to resize an input or output buffer.  The output made before that
+   still goes through the later stages, and the input not yet used is kept.
+   The volume is applied when the output is read. */
+static int processInput(sonicStream stream) {
+  int originalNumOutputSamples = stream->numOutputSamples;
+  int result = 1;
+  float speed, rate;
+
+  applyRamps(stream, stream->inputPosition);
+  speed = stream->speed / stream->pitch;
+  if (speed > 1.00001 || speed < 0.99999 || stream->nonlinearSpeedup ||
+      stream->recordPitchMarks) {
+    beginStage(stream);
+    if (usesLowLatencySpeed(stream)) {
+      result = changeSpeedLowLatency(stream, speed);
+    } else {
+      result = changeSpeed(stream, speed);
+    }
+    endStage(stream, SONIC_STAGE_CHANGE_SPEED);
   } else {
     if (!copyToOutput(stream, stream->inputBuffer, stream->numInputSamples)) {
       return 0;
     }
-    stream->numInputSamples = 0;
+    if (stream->lowLatency) {
+      addHistorySamples(stream, stream->inputBuffer, stream->numInputSamples);
+    }
+    stream->stats.copiedSamples += stream->numInputSamples;
+    removeInputSamples(stream, stream->numInputSamples);
+  }
+  /* The later stages use the parameters for the input just processed. */
+  applyRamps(stream, stream->inputPosition);
+  rate = stream->rate;
+  if (!stream->useChordPitch) {
+    rate *= stream->pitch;
   }
   if (stream->useChordPitch) {
     if (stream->pitch != 1.0f) {
+      beginStage(stream);
       if (!adjustPitch(stream, originalNumOutputSamples)) {
         return 0;
       }
+      endStage(stream, SONIC_STAGE_ADJUST_PITCH);
     }
   } else if (rate != 1.0f) {
+    beginStage(stream);
     if (!adjustRate(stream, rate, originalNumOutputSamples)) {
       return 0;
     }
+    endStage(stream, SONIC_STAGE_ADJUST_RATE);
   }
-  if (stream->volume != 1.0f) {
-    /* Adjust output volume. */
-    scaleSamples(
-        stream->outputBuffer + originalNumOutputSamples * stream->numChannels,
-        (stream->numOutputSamples - originalNumOutputSamples) *
-            stream->numChannels,
-        stream->volume);
+  deferVolume(stream, originalNumOutputSamples);
+  return result;
+}
+
+/* Process the input, a shortest pitch period at a time while ramps are
+   scheduled, so that the stages after the speed change follow them closely.
+   The input not yet being processed is hidden from processInput. */
+static int processStreamInput(sonicStream stream) {
+  int numChannels = stream->numChannels;
+  sonicSample* base =
+      stream->inputBuffer - stream->inputBufferStart * numChannels;
+  int numHidden = stream->numInputSamples;
+  int numNew, end, result = 1;
+
+  if (!rampsPending(stream)) {
+    result = processInput(stream);
+    addSyncPoint(stream);
+    return result;
   }
-  return 1;
+  stream->numInputSamples = 0;
+  while (numHidden > 0 && result && rampsPending(stream)) {
+    numNew = numHidden < stream->minPeriod ? numHidden : stream->minPeriod;
+    stream->numInputSamples += numNew;
+    numHidden -= numNew;
+    end = stream->inputBufferStart + stream->numInputSamples;
+    result = processInput(stream);
+    /* Using up the input moves the buffer back to the start of its memory, so
+       put what is left back in front of the hidden samples. */
+    stream->inputBufferStart = end - stream->numInputSamples;
+    stream->inputBuffer = base + stream->inputBufferStart * numChannels;
+  }
+  stream->numInputSamples += numHidden;
+  if (result && numHidden > 0) {
+    result = processInput(stream);
+  }
+  addSyncPoint(stream);
+  return result;
 }
 
-/* Write floating point data to the input buffer and process it. */
+/* Count numSamples samples added by one of the write functions, and process
+   them, unless they were passed straight through to the output. */
+static int finishWrite(sonicStream stream, int numSamples, int passThrough) {
+  if (passThrough) {
+    passSamplesThrough(stream, stream->numOutputSamples, numSamples);
+    return 1;
+  }
+  stream->numInputSamples += numSamples;
+  return processStreamInput(stream);
+}
+
+/* Write floating point data to the input buffer and process it.  When the
+   stream has nothing buffered and would only copy the samples, they are
+   written straight to the output buffer instead. */
 int sonicWriteFloatToStream(sonicStream stream, float* samples,
                             int numSamples) {
-  if (!addFloatSamplesToInputBuffer(stream, samples, numSamples)) {
+  int passThrough = stream->numInputSamples == 0 && passesThrough(stream);
+
+  if (!addFloatSamples(stream, samples, numSamples, passThrough)) {
     return 0;
   }
-  return processStreamInput(stream);
+  return finishWrite(stream, numSamples, passThrough);
 }
 
 /* Simple wrapper around sonicWriteFloatToStream that does the short to float
    conversion for you. */
 int sonicWriteShortToStream(sonicStream stream, short* samples,
                             int numSamples) {
-  if (!addShortSamplesToInputBuffer(stream, samples, numSamples)) {
+  int passThrough = stream->numInputSamples == 0 && passesThrough(stream);
+
+  if (!addShortSamples(stream, samples, numSamples, passThrough)) {
     return 0;
   }
-  return processStreamInput(stream);
+  return finishWrite(stream, numSamples, passThrough);
 }
 
 /* Simple wrapper around sonicWriteFloatToStream that does the unsigned char to
    float conversion for you. */
 int sonicWriteUnsignedCharToStream(sonicStream stream, unsigned char* samples,
                                    int numSamples) {
-  if (!addUnsignedCharSamplesToInputBuffer(stream, samples, numSamples)) {
+  int passThrough = stream->numInputSamples == 0 && passesThrough(stream);
+
+  if (!addUnsignedCharSamples(stream, samples, numSamples, passThrough)) {
+    return 0;
+  }
+  return finishWrite(stream, numSamples, passThrough);
+}
+
+/* Write floating point data from one buffer per channel, and process it. */
+int sonicWriteFloatPlanar(sonicStream stream, float** channels,
+                          int numSamples) {
+  int passThrough = stream->numInputSamples == 0 && passesThrough(stream);
+
+  if (!addFloatPlanarSamples(stream, channels, numSamples, passThrough)) {
     return 0;
   }
+  return finishWrite(stream, numSamples, passThrough);
+}
+
+/* Write short data from one buffer per channel, and process it. */
+int sonicWriteShortPlanar(sonicStream stream, short** channels,
+                          int numSamples) {
+  int passThrough = stream->numInputSamples == 0 && passesThrough(stream);
+
+  if (!addShortPlanarSamples(stream, channels, numSamples, passThrough)) {
+    return 0;
+  }
+  return finishWrite(stream, numSamples, passThrough);
+}
+
+/* Return the number of output samples ready to be read, and point samples at
+   them.  The samples stay valid until they are consumed, or until the next
+   write or flush. */
+int sonicPeekOutput(sonicStream stream, sonicSample** samples) {
+  applyOutputVolume(stream);
+  *samples = stream->outputBuffer;
+  return stream->numOutputSamples;
+}
+
+/* Release samples returned by sonicPeekOutput. */
+void sonicConsumeOutput(sonicStream stream, int numSamples) {
+  if (numSamples > stream->numOutputSamples) {
+    numSamples = stream->numOutputSamples;
+  }
+  if (numSamples > 0) {
+    removeOutputSamples(stream, numSamples);
+  }
+}
+
+/* Return a pointer to room for numSamples new input samples, which become part
+   of the stream when committed with sonicCommitInput.  Return NULL if memory
+   realloc failed. */
+sonicSample* sonicAcquireInput(sonicStream stream, int numSamples) {
+  stream->numAcquiredSamples = 0;
+  if (!enlargeInputBufferIfNeeded(stream, numSamples)) {
+    return NULL;
+  }
+  stream->numAcquiredSamples = numSamples;
+  return stream->inputBuffer + stream->numInputSamples * stream->numChannels;
+}
+
+/* Add numSamples samples written to the space returned by sonicAcquireInput to
+   the stream, and process them.  If they only need copying to an empty output
+   buffer, the input and output buffers are swapped instead.  Fixed capacity
+   buffers are only swapped when they are the same size.  numSamples is
+   limited to the room the last sonicAcquireInput call returned, which
+   committing uses up. */
+int sonicCommitInput(sonicStream stream, int numSamples) {
+  if (numSamples > stream->numAcquiredSamples) {
+    numSamples = stream->numAcquiredSamples;
+  } else if (numSamples < 0) {
+    numSamples = 0;
+  }
+  stream->numAcquiredSamples = 0;
+  stream->numInputSamples += numSamples;
+  if (stream->numOutputSamples == 0 && stream->numInputSamples > 0 &&
+      passesThrough(stream) &&
+      (stream->fixedInputSamples == 0 ||
+       stream->inputBufferSize == stream->outputBufferSize)) {
+    swapInputAndOutput(stream);
+    return 1;
+  }
   return processStreamInput(stream);
 }
 
+/* Drop the buffered samples and start over at input position, keeping the
+   parameters, scheduled ramps and stats.  If the pitch marks cover position,
+   the pitch history is taken from them, and the stream starts at the
+   beginning of the marked period.  Return the input position to write from. */
+long sonicSeek(sonicStream stream, long position) {
+  sonicPitchMark* mark = findPitchMark(stream, position);
+
+  removeInputSamples(stream, stream->numInputSamples);
+  removeOutputSamples(stream, stream->numOutputSamples);
+  consumeBufferSamples(&stream->pitchBuffer, &stream->pitchBufferStart,
+                       &stream->numPitchSamples, stream->numPitchSamples,
+                       stream->numChannels);
+  stream->remainingInputToCopy = 0;
+  stream->oldRatePosition = 0;
+  stream->newRatePosition = 0;
+  stream->ratePhase = 0;
+  stream->rateNewSampleRate = 0;
+  stream->prevPeriod = 0;
+  stream->prevMinDiff = 0;
+  stream->nonlinearError = 0.0f;
+  memset(stream->historyBuffer, 0,
+         stream->maxRequired * sizeof(sonicSample) * stream->numChannels);
+  stream->numHistorySamples = stream->maxRequired;
+  if (mark != NULL) {
+    position = mark->position;
+    stream->prevPeriod = mark->period;
+    stream->prevMinDiff = mark->minDiff;
+  }
+  startPositionsAt(stream, position);
+  return position;
+}
+
+/* Return the number of output samples read since the stream was created,
+   reset or seeked. */
+long sonicGetOutputPosition(sonicStream stream) {
+  return stream->outputPosition;
+}
+
+/* Return the output position of point if output is set, or else its input
+   position. */
+static double getSyncPosition(sonicSyncPoint* point, int output) {
+  return output ? point->outputPosition : point->inputPosition;
+}
+
+/* Map position from input to output positions, or from output to input ones
+   if toInput is set, by interpolating between the sync points around it.
+   Past the newest point the current parameters are assumed, and before the
+   oldest the speed between the two oldest. */
+static long mapPosition(sonicStream stream, long position, int toInput) {
+  sonicSyncPoint *point, *next = NULL;
+  double from, to, ratio = getOutputRatio(stream);
+  int low = 0, high = stream->numSyncPoints - 1, middle;
+
+  if (toInput) {
+    ratio = 1.0 / ratio;
+  }
+  /* Find the last point at or before position, or the oldest. */
+  while (low < high) {
+    middle = (low + high + 1) >> 1;
+    if (getSyncPosition(getSyncPoint(stream, middle), toInput) <= position) {
+      low = middle;
+    } else {
+      high = middle - 1;
+    }
+  }
+  point = getSyncPoint(stream, low);
+  from = getSyncPosition(point, toInput);
+  to = getSyncPosition(point, !toInput);
+  if (low + 1 < stream->numSyncPoints) {
+    next = getSyncPoint(stream, low + 1);
+  }
+  if (next != NULL && getSyncPosition(next, toInput) > from) {
+    ratio = (getSyncPosition(next, !toInput) - to) /
+            (getSyncPosition(next, toInput) - from);
+  }
+  return (long)floor(to + (position - from) * ratio + 0.5);
+}
+
+/* Return the output position that input position is heard at. */
+long sonicInputToOutputPosition(sonicStream stream, long inputPosition) {
+  return mapPosition(stream, inputPosition, 0);
+}
+
+/* Return the input position that was turned into output position. */
+long sonicOutputToInputPosition(sonicStream stream, long outputPosition) {
+  return mapPosition(stream, outputPosition, 1);
+}
+
 /* This is a non-stream oriented interface to just change the speed of a sound
  * sample */
 int sonicChangeFloatSpeed(float* samples, int numSamples, float speed,
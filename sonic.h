@@ -51,27 +51,120 @@ similar to high speed factors is used.
    sound quality slightly, at the expense of lots of floating point math. */
 /* #define SONIC_USE_SIN */
 
+/* Uncomment this to process samples as floats rather than 16-bit integers.
+   Float input and output is then copied without conversion or quantization,
+   which is best if the rest of the audio pipeline is float.  The short and
+   unsigned char interfaces still work, but convert every sample. */
+/* #define SONIC_USE_FLOAT */
+
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-/* This specifies the range of voice pitches we try to match.
-   Note that if we go lower than 65, we could overflow in findPitchInRange */
+/* This specifies the default range of voice pitches we try to match.  See
+   sonicSetPitchRange.  Note that if we go lower than 65, we could overflow in
+   findPitchInRange where long is 32 bits. */
 #define SONIC_MIN_PITCH 65
 #define SONIC_MAX_PITCH 400
 
-/* These are used to down-sample some inputs to improve speed */
+/* These are used to down-sample some inputs to improve speed.  See
+   sonicSetAmdfFreq. */
 #define SONIC_AMDF_FREQ 4000
 
+/* Pitch detection methods for sonicSetPitchMethod.  SONIC_PITCH_AMDF is the
+   default brute-force Average Magnitude Difference Function search.
+   SONIC_PITCH_FFT computes a squared difference function for every period at
+   once using FFT cross-correlation, which is much faster for large pitch
+   periods, such as with quality 1 at 48KHz.  The FFT estimate is refined with
+   a narrow AMDF search, and on voiced speech it finds exactly the same period
+   as SONIC_PITCH_AMDF for about 70-80% of pitch periods, and a period within 2
+   samples for about 80%.  Most of the rest are weakly voiced periods where
+   neither method finds a strong match. */
+#define SONIC_PITCH_AMDF 0
+#define SONIC_PITCH_FFT 1
+
+/* Processing stages timed in sonicStats.stageSeconds.  The volume is applied
+   as output is read, so SONIC_STAGE_SCALE_SAMPLES includes the time the read
+   calls spend converting samples. */
+#define SONIC_STAGE_CHANGE_SPEED 0
+#define SONIC_STAGE_ADJUST_PITCH 1
+#define SONIC_STAGE_ADJUST_RATE 2
+#define SONIC_STAGE_SCALE_SAMPLES 3
+#define SONIC_NUM_STAGES 4
+
+/* Buffers described in sonicStats. */
+#define SONIC_INPUT_BUFFER 0
+#define SONIC_PITCH_BUFFER 1
+#define SONIC_OUTPUT_BUFFER 2
+#define SONIC_NUM_BUFFERS 3
+
+/* The parameters sonicRampParameter can change. */
+#define SONIC_PARAM_SPEED 0
+#define SONIC_PARAM_PITCH 1
+#define SONIC_PARAM_RATE 2
+#define SONIC_PARAM_VOLUME 3
+#define SONIC_NUM_PARAMS 4
+/* The most ramps that can be scheduled for one parameter at a time. */
+#define SONIC_MAX_RAMPS 32
+/* Channels at or above this can not be selected by sonicSetPitchChannelMask. */
+#define SONIC_MAX_MASK_CHANNELS 31
+
 struct sonicStreamStruct;
 typedef struct sonicStreamStruct* sonicStream;
 
+/* What a stream has done since it was created or last reset, from
+   sonicGetStats.  Buffer sizes are in samples per channel.  Stage times are
+   only measured when sonic is built with SONIC_PROFILE defined, which calls
+   clock_gettime several times per write, and are 0 otherwise. */
+typedef struct {
+  /* Pitch periods found, how many times the previous period was used instead
+     because it matched better, how many were found by searching only near
+     the previous period, in pitch tracking mode, and how many were looked up
+     in pitch marks instead of searched for. */
+  long pitchPeriods;
+  long prevPeriodsUsed;
+  long trackedPeriods;
+  long markedPeriods;
+  /* Samples the speed change copied straight from the input, and samples it
+     made by overlap-adding two pitch periods. */
+  long copiedSamples;
+  long overlapAddSamples;
+  /* How many times each buffer was reallocated to grow, and its largest
+     size. */
+  int bufferGrowths[SONIC_NUM_BUFFERS];
+  int peakBufferSizes[SONIC_NUM_BUFFERS];
+  double stageSeconds[SONIC_NUM_STAGES];
+} sonicStats;
+
+/* The type sonic uses to store samples internally. */
+#ifdef SONIC_USE_FLOAT
+typedef float sonicSample;
+#else
+typedef short sonicSample;
+#endif
+
+/* Memory allocation callbacks for sonicCreateStreamWithAllocator.  They
+   behave like malloc, realloc and free, and are passed the context given when
+   the stream was created. */
+typedef void* (*sonicAllocFunc)(void* context, size_t size);
+typedef void* (*sonicReallocFunc)(void* context, void* ptr, size_t size);
+typedef void (*sonicFreeFunc)(void* context, void* ptr);
+
 /* For all of the following functions, numChannels is multiplied by numSamples
    to determine the actual number of values read or returned. */
 
 /* Create a sonic stream.  Return NULL only if we are out of memory and cannot
   allocate the stream. Set numChannels to 1 for mono, and 2 for stereo. */
 sonicStream sonicCreateStream(int sampleRate, int numChannels);
+/* Create a sonic stream like sonicCreateStream, but get all of the stream's
+   memory from the given callbacks, which are passed context. */
+sonicStream sonicCreateStreamWithAllocator(int sampleRate, int numChannels,
+                                           sonicAllocFunc allocFunc,
+                                           sonicReallocFunc reallocFunc,
+                                           sonicFreeFunc freeFunc,
+                                           void* context);
 /* Destroy the sonic stream. */
 void sonicDestroyStream(sonicStream stream);
 /* Use this to write floating point data to be speed up or down into the stream.
@@ -97,12 +190,54 @@ int sonicReadShortFromStream(sonicStream stream, short* samples,
    will be available, and zero is returned, which is not an error condition. */
 int sonicReadUnsignedCharFromStream(sonicStream stream, unsigned char* samples,
                                     int maxSamples);
+/* Planar versions of the write functions, which take numSamples samples from
+   each of numChannels separate buffers rather than interleaved samples.
+   channels[i] points at the samples of channel i.  Return 0 if memory realloc
+   failed, otherwise 1. */
+int sonicWriteFloatPlanar(sonicStream stream, float** channels,
+                          int numSamples);
+int sonicWriteShortPlanar(sonicStream stream, short** channels,
+                          int numSamples);
+/* Planar versions of the read functions, which read up to maxSamples samples
+   into each of numChannels separate buffers.  Sometimes no data will be
+   available, and zero is returned, which is not an error condition. */
+int sonicReadFloatPlanar(sonicStream stream, float** channels,
+                         int maxSamples);
+int sonicReadShortPlanar(sonicStream stream, short** channels,
+                         int maxSamples);
+/* Zero-copy alternative to the read functions.  Set *samples to point at the
+   output samples ready to be read, and return how many there are.  The pointer
+   is valid until sonicConsumeOutput, or the next write or flush.  The read
+   functions apply the volume as they copy samples out, but peeking has to
+   scale the buffered samples in place first. */
+int sonicPeekOutput(sonicStream stream, sonicSample** samples);
+/* Release numSamples samples returned by sonicPeekOutput. */
+void sonicConsumeOutput(sonicStream stream, int numSamples);
+/* Zero-copy alternative to the write functions.  Return a pointer to room for
+   numSamples input samples, or NULL if memory realloc failed.  Fill in up to
+   numSamples samples, and pass the number written to sonicCommitInput
+   before any other call on the stream. */
+sonicSample* sonicAcquireInput(sonicStream stream, int numSamples);
+/* Add samples written to the space from sonicAcquireInput to the stream, and
+   process them.  The count is limited to 0 through the size passed to the
+   last sonicAcquireInput call.  Return 0 if memory realloc failed, otherwise
+   1.  When speed, pitch and rate are 1 and no output is waiting, the samples
+   are handed to the output side without being copied, so peeking passes audio
+   through with no copies at all. */
+int sonicCommitInput(sonicStream stream, int numSamples);
 /* Force the sonic stream to generate output using whatever data it currently
    has.  No extra delay will be added to the output, but flushing in the middle
    of words could introduce distortion. */
 int sonicFlushStream(sonicStream stream);
 /* Return the number of samples in the output buffer */
 int sonicSamplesAvailable(sonicStream stream);
+/* Drop all buffered samples and pitch history, so the stream can be reused for
+   unrelated audio without reallocating it.  Parameters such as speed, pitch
+   and volume are kept, but scheduled ramps are dropped, and the counters from
+   sonicGetStats are cleared. */
+void sonicResetStream(sonicStream stream);
+/* Copy the stream's counters to stats.  sonicResetStream clears them. */
+void sonicGetStats(sonicStream stream, sonicStats* stats);
 /* Get the speed of the stream. */
 float sonicGetSpeed(sonicStream stream);
 /* Set the speed of the stream. */
@@ -119,26 +254,193 @@ void sonicSetRate(sonicStream stream, float rate);
 float sonicGetVolume(sonicStream stream);
 /* Set the scaling factor of the stream. */
 void sonicSetVolume(sonicStream stream, float volume);
+/* Return how many input samples per channel have been written since the
+   stream was created or reset, plus the position of the last sonicSeek.  Ramps
+   are scheduled at these positions. */
+long sonicGetInputPosition(sonicStream stream);
+/* Drop the buffered samples and continue from input position, as when playback
+   jumps within the input.  Parameters, scheduled ramps and stats are kept.  If
+   the stream's pitch marks cover position, the stream starts at the beginning
+   of the marked pitch period, with its pitch history taken from the mark.
+   Return the input position the next sample written should come from. */
+long sonicSeek(sonicStream stream, long position);
+/* Return how many output samples per channel have been read since the stream
+   was created, reset or seeked. */
+long sonicGetOutputPosition(sonicStream stream);
+/* Return the output position an input position is heard at, or the input
+   position an output position was made from, for example to keep subtitles
+   in sync.  They are interpolated between points recorded as the stream
+   processes, which cover several seconds of recent output, and extrapolated
+   with the current speed beyond them.  Positions are accurate to about a
+   pitch period. */
+long sonicInputToOutputPosition(sonicStream stream, long inputPosition);
+long sonicOutputToInputPosition(sonicStream stream, long outputPosition);
+/* Change parameter, one of the SONIC_PARAM values, linearly to reach value at
+   input position, starting where its previous ramp ends, or from its current
+   value at the current input position.  The speed follows the ramp from one
+   pitch period to the next, and pitch, rate and volume are updated every
+   shortest pitch period, so large writes still get smooth changes.  Setting the
+   parameter directly cancels its ramps.  Return 0 if position is not after the
+   previous ramp and the current input position, or if SONIC_MAX_RAMPS ramps are
+   already scheduled for the parameter. */
+int sonicRampParameter(sonicStream stream, int parameter, long position,
+                       float value);
 /* Get the chord pitch setting. */
 int sonicGetChordPitch(sonicStream stream);
 /* Set chord pitch mode on or off.  Default is off.  See the documentation
    page for a description of this feature. */
 void sonicSetChordPitch(sonicStream stream, int useChordPitch);
+/* Get the nonlinear speedup setting. */
+int sonicGetNonlinearSpeedup(sonicStream stream);
+/* Speed up silence and unvoiced sounds such as "s" more than voiced speech,
+   so speech stays clearer at high speeds.  The overall speed still averages
+   out to the speed set with sonicSetSpeed, over a few seconds.  Default is
+   off. */
+void sonicSetNonlinearSpeedup(sonicStream stream, int enable);
+/* Get the sample rate that the pitch search down samples to. */
+int sonicGetAmdfFreq(sonicStream stream);
+/* Down sample to about amdfFreq Hz before the coarse pitch search at quality
+   0.  Default is SONIC_AMDF_FREQ.  Lower makes the coarse search cheaper but
+   the refining search around its result wider, and 0 turns down sampling off,
+   which is much slower. */
+void sonicSetAmdfFreq(sonicStream stream, int amdfFreq);
+/* Get the pitch low-pass setting. */
+int sonicGetPitchLowPass(sonicStream stream);
+/* Low-pass filter the down sampled input of the coarse pitch search, so that
+   less of what is above half the down sampled rate aliases into it.  Each
+   block average is averaged again with the next one, which costs one add per
+   value.  This can change which periods are found, so the output differs
+   slightly from the default.  Default is off. */
+void sonicSetPitchLowPass(sonicStream stream, int enable);
+/* Get the pitch tracking setting. */
+int sonicGetPitchTracking(sonicStream stream);
+/* Search for each pitch period near the last one first, and search the whole
+   pitch range only when that finds no good match.  This is several times
+   faster on sustained voiced speech.  Default is off. */
+void sonicSetPitchTracking(sonicStream stream, int enable);
+/* Get the low latency setting. */
+int sonicGetLowLatency(sonicStream stream);
+/* Find pitch periods from input that has already been processed, rather than
+   waiting for twice the longest pitch period of future input.  Slowing down
+   then needs only 2.5 ms of future input, and speeding up needs that plus one
+   longest pitch period.  Chord pitch is not affected.  Default is off. */
+void sonicSetLowLatency(sonicStream stream, int enable);
+/* Return the most input samples per channel the stream holds back before they
+   affect the output, with the current settings.  This is the latency sonic
+   adds. */
+int sonicGetLatencySamples(sonicStream stream);
+/* Return the pitch period, in frames, at the start of numSamples frames of
+   samples.  This is the search the stream runs before it changes the speed,
+   with its current settings, and it needs at least two of the longest periods
+   of samples.  This drops any samples that have not been read.  Return 0 if
+   there are too few samples, or if we are out of memory. */
+int sonicFindPitchPeriod(sonicStream stream, short* samples, int numSamples);
 /* Get the quality setting. */
 int sonicGetQuality(sonicStream stream);
 /* Set the "quality".  Default 0 is virtually as good as 1, but very much
  * faster. */
 void sonicSetQuality(sonicStream stream, int quality);
+/* Get the pitch detection method. */
+int sonicGetPitchMethod(sonicStream stream);
+/* Set the pitch detection method to SONIC_PITCH_AMDF (the default) or
+   SONIC_PITCH_FFT. */
+void sonicSetPitchMethod(sonicStream stream, int pitchMethod);
+/* Get the pitch channel mask. */
+int sonicGetPitchChannelMask(sonicStream stream);
+/* Choose which channels drive the pitch search, such as just the front
+   channels of 5.1 audio.  Bit i of mask selects channel i, for channels below
+   SONIC_MAX_MASK_CHANNELS.  The selected channels are mixed, and every channel
+   is then sped up using the pitch they share.  The default of 0, or a mask
+   that selects none of the stream's channels, mixes them all. */
+void sonicSetPitchChannelMask(sonicStream stream, int mask);
 /* Get the sample rate of the stream. */
 int sonicGetSampleRate(sonicStream stream);
 /* Set the sample rate of the stream.  This will drop any samples that have not
- * been read. */
+ * been read.  Setting the same sample rate just resets the stream, without
+ * reallocating it. */
 void sonicSetSampleRate(sonicStream stream, int sampleRate);
 /* Get the number of channels. */
 int sonicGetNumChannels(sonicStream stream);
 /* Set the number of channels.  This will drop any samples that have not been
- * read. */
+ * read.  Setting the same number just resets the stream, without reallocating
+ * it. */
 void sonicSetNumChannels(sonicStream stream, int numChannels);
+/* Get the lowest pitch searched for, in Hz. */
+int sonicGetMinPitch(sonicStream stream);
+/* Get the highest pitch searched for, in Hz. */
+int sonicGetMaxPitch(sonicStream stream);
+/* Search for pitches from minPitch to maxPitch Hz, rather than from
+   SONIC_MIN_PITCH to SONIC_MAX_PITCH.  A narrower range is faster, and a higher
+   minPitch also cuts the latency, which is about two of the longest periods.
+   This drops any samples that have not been read, and reallocates the
+   buffers unless the range is the same.  Return 0 if the range is empty or not
+   positive, or if we are out of memory.  The stream is then left as it was,
+   with its old range and buffered samples. */
+int sonicSetPitchRange(sonicStream stream, int minPitch, int maxPitch);
+/* Allocate everything needed for writes of up to maxInputSamples samples, with
+   up to maxOutputSamples samples left unread, so that writing, reading and
+   flushing never allocate memory.  This is meant for real-time audio threads.
+   A write that would not fit returns 0 instead of growing a buffer.  If the
+   samples fit in the input buffer but their output does not fit, the write
+   also returns 0, but keeps the samples it could not process yet: read some
+   output, then write 0 samples to continue, rather than writing the same
+   samples again.  sonicGetInputPosition tells the two cases apart.  Changing
+   the sample rate or number of channels allocates again.  Set maxInputSamples
+   to 0 to let the buffers grow again.  Return 0 if out of memory. */
+int sonicSetFixedCapacity(sonicStream stream, int maxInputSamples,
+                          int maxOutputSamples);
+/*
+Pitch marks are the pitch periods found across an input, kept so that other
+streams working on the same input, such as the same podcast at several speeds,
+can look them up rather than search for each period again.  One stream records
+the marks, with the settings that affect the pitch search, such as the quality
+and pitch method, that the others will use.  Only the speed change uses them,
+and not in low latency mode.  The pitch is still searched for in any input the
+marks do not cover.
+*/
+
+struct sonicPitchMarksStruct;
+typedef struct sonicPitchMarksStruct* sonicPitchMarks;
+
+/* Create an empty set of pitch marks, for input at sampleRate.  Return NULL if
+   out of memory. */
+sonicPitchMarks sonicCreatePitchMarks(int sampleRate);
+/* Destroy the pitch marks.  No stream may still be using them. */
+void sonicDestroyPitchMarks(sonicPitchMarks pitchMarks);
+/* Return the number of pitch marks. */
+int sonicGetNumPitchMarks(sonicPitchMarks pitchMarks);
+/* Get the pitch mark at index: the input position where a pitch period
+   starts, its length, and the minimum and maximum differences of the search
+   that found it. */
+void sonicGetPitchMark(sonicPitchMarks pitchMarks, int index, long* position,
+                       int* period, int* minDiff, int* maxDiff);
+/* Add a pitch mark after the others, first removing any at or after its
+   position.  Return 0 if out of memory. */
+int sonicAddPitchMark(sonicPitchMarks pitchMarks, long position, int period,
+                      int minDiff, int maxDiff);
+/* Save the pitch marks in a compact binary file, such as a sidecar file for
+   an audio file, so that re-rendering it at another speed can skip the pitch
+   search.  Return 0 on failure. */
+int sonicSavePitchMarks(sonicPitchMarks pitchMarks, char* fileName);
+/* Load pitch marks saved by sonicSavePitchMarks.  Return NULL if the file can
+   not be read, is not a valid pitch mark file, or if out of memory.  The sample
+   rate is saved with the marks, but nothing checks that they are used with the
+   same audio. */
+sonicPitchMarks sonicLoadPitchMarks(char* fileName);
+/* Return the sample rate the pitch marks were made for. */
+int sonicGetPitchMarksSampleRate(sonicPitchMarks pitchMarks);
+/* Find every pitch period of the input written to the stream from now on,
+   and add it to pitchMarks at its input position, as counted by
+   sonicGetInputPosition.  The stream makes no output while recording.  Marks
+   at or after a recorded position are replaced, so the same marks can be
+   recorded again after resetting the stream.  Pass NULL to stop recording. */
+void sonicRecordPitchMarks(sonicStream stream, sonicPitchMarks pitchMarks);
+/* Get the pitch marks the stream uses or records. */
+sonicPitchMarks sonicGetPitchMarks(sonicStream stream);
+/* Look pitch periods up in pitchMarks rather than searching for them.  Any
+   number of streams may share the same marks, from any thread, as long as
+   none is recording into them.  The default of NULL searches. */
+void sonicSetPitchMarks(sonicStream stream, sonicPitchMarks pitchMarks);
 /* This is a non-stream oriented interface to just change the speed of a sound
    sample.  It works in-place on the sample array, so there must be at least
    speed*numSamples available space in the array. Returns the new number of
@@ -154,6 +456,147 @@ int sonicChangeShortSpeed(short* samples, int numSamples, float speed,
                           float pitch, float rate, float volume,
                           int useChordPitch, int sampleRate, int numChannels);
 
+#ifdef SONIC_BATCH
+/*
+The batch interface runs many independent, short jobs, such as TTS utterances,
+on a pool of worker threads.  Each worker keeps its own sonicStream and reuses
+it from job to job, so there is no allocation per job once the streams have
+grown to fit.  Output goes straight into memory supplied with each job.
+
+Applications that drive their own streams can reuse them through a
+sonicStreamPool instead.
+*/
+
+struct sonicBatchStruct;
+typedef struct sonicBatchStruct* sonicBatch;
+
+/* One job for sonicProcessBatch.  The caller fills in everything except
+   numOutputSamples.  Like sonicChangeShortSpeed, all of the input is processed
+   and flushed.  At most maxOutputSamples are written to output, and
+   numOutputSamples is set to the number generated, which may be more. */
+typedef struct {
+  short* samples;
+  int numSamples;
+  int sampleRate;
+  int numChannels;
+  float speed;
+  float pitch;
+  float rate;
+  float volume;
+  int useChordPitch;
+  int quality;
+  int pitchMethod;
+  int pitchTracking;
+  /* The pitch range searched, as set with sonicSetPitchRange.  0 selects
+     SONIC_MIN_PITCH or SONIC_MAX_PITCH.  Jobs with a range that
+     sonicSetPitchRange rejects fail. */
+  int minPitch;
+  int maxPitch;
+  short* output;
+  int maxOutputSamples;
+  int numOutputSamples;
+} sonicBatchJob;
+
+/* Create a batch processor with numThreads threads, including the thread that
+   calls sonicProcessBatch.  Return NULL if out of memory or if threads cannot
+   be created. */
+sonicBatch sonicCreateBatch(int numThreads);
+/* Destroy the batch processor, stopping its threads. */
+void sonicDestroyBatch(sonicBatch batch);
+/* Run numJobs jobs, and return when they are all done.  Jobs may finish in
+   any order.  Return 0 if any job ran out of memory, otherwise 1.  Only one
+   thread at a time may call this for a given batch. */
+int sonicProcessBatch(sonicBatch batch, sonicBatchJob* jobs, int numJobs);
+/* Run one long job, such as a whole audiobook, on all of the batch's threads.
+   The input is cut into segments of about segmentSamples samples, at least a
+   second long, at the quietest point near each cut.  Each cut is then moved
+   between two pulses of the pitch period there, found with the same search
+   that changes the speed, using the job's settings.  Each segment is processed
+   by its own stream, and neighbouring segments overlap by 10ms, which is
+   crossfaded in the output.  Return 0 if out of memory, otherwise 1. */
+int sonicProcessLongJob(sonicBatch batch, sonicBatchJob* job,
+                        int segmentSamples);
+/* Run numJobs variants of the same input, such as one episode at several
+   speeds, on the batch's threads.  The jobs must all have the same samples,
+   sample rate and number of channels.  The pitch periods are found once, with
+   the quality, pitch method, pitch tracking and pitch range of the first job,
+   and shared as pitch marks by every job, which then only has to change the
+   speed.  Like sonicProcessBatch, return 0 if out of memory, otherwise 1. */
+int sonicProcessFanout(sonicBatch batch, sonicBatchJob* jobs, int numJobs);
+
+/* A stream pool keeps released streams so they can be handed out again without
+   being reallocated.  It may be used from any number of threads. */
+struct sonicStreamPoolStruct;
+typedef struct sonicStreamPoolStruct* sonicStreamPool;
+
+/* Create an empty stream pool.  Return NULL if out of memory. */
+sonicStreamPool sonicCreateStreamPool(void);
+/* Destroy the pool and the streams in it.  Streams still handed out are not
+   affected, and must be destroyed with sonicDestroyStream. */
+void sonicDestroyStreamPool(sonicStreamPool pool);
+/* Create numStreams streams in the pool ahead of time.  Return 0 if out of
+   memory. */
+int sonicPrewarmStreamPool(sonicStreamPool pool, int sampleRate,
+                           int numChannels, int numStreams);
+/* Return a stream from the pool with the given sample rate and number of
+   channels, or a new one if there is none.  The stream is reset and has
+   default settings, just like one from sonicCreateStream.  Return NULL if out
+   of memory. */
+sonicStream sonicGetPooledStream(sonicStreamPool pool, int sampleRate,
+                                 int numChannels);
+/* Give a stream back to the pool, which then owns it.  Any stream may be given
+   to the pool, not just ones that came from it. */
+void sonicReleasePooledStream(sonicStreamPool pool, sonicStream stream);
+
+/* A threaded stream runs a sonicStream on its own worker thread, for players
+   that write on a decoder thread and read on a real-time audio thread.  One
+   thread, the producer, writes, flushes and sets parameters, and another, the
+   consumer, reads.  Reading never locks, waits or allocates.  Both sides go
+   through fixed size queues: when the consumer falls behind, the worker stops
+   once the output queue is full, the input queue then fills, and writes
+   accept fewer samples.  When the worker falls behind, reads return fewer
+   samples, and the consumer should play silence for the rest. */
+struct sonicThreadedStreamStruct;
+typedef struct sonicThreadedStreamStruct* sonicThreadedStream;
+
+/* Start a worker thread for stream, which must not be used directly until the
+   threaded stream is destroyed.  The input and output queues hold at least
+   inputSamples and outputSamples samples per channel.  Return NULL if out of
+   memory or if the thread cannot be created. */
+sonicThreadedStream sonicCreateThreadedStream(sonicStream stream,
+                                              int inputSamples,
+                                              int outputSamples);
+/* Stop the worker and free the queues.  Queued samples are dropped, and the
+   stream is not destroyed. */
+void sonicDestroyThreadedStream(sonicThreadedStream threaded);
+/* Queue as many of numSamples samples as fit, without waiting for room.
+   Return the number queued.  Only the producer may call this. */
+int sonicWriteShortToThreadedStream(sonicThreadedStream threaded,
+                                    short* samples, int numSamples);
+/* Wait until the input queue has room for numSamples samples, or is empty if
+   it is smaller.  Return 0 if the worker ran out of memory, in which case the
+   threaded stream makes no more output.  Only the producer may call this. */
+int sonicWaitForThreadedInputSpace(sonicThreadedStream threaded,
+                                   int numSamples);
+/* Flush the stream, like sonicFlushStream, after the input queued so far.
+   Each flush happens in its place between writes.  Up to eight flushes can
+   wait for the worker, and when that many are waiting, this waits for it to
+   do one.  Return 0 if the worker ran out of memory.  Only the producer may
+   call this. */
+int sonicFlushThreadedStream(sonicThreadedStream threaded);
+/* Set parameter, one of the SONIC_PARAM values, to value.  It applies from the
+   next input the worker processes, so it is heard once the output queued
+   before it has been read. */
+void sonicSetThreadedParameter(sonicThreadedStream threaded, int parameter,
+                               float value);
+/* Copy up to maxSamples processed samples to samples, and return the number
+   copied.  Only the consumer may call this. */
+int sonicReadShortFromThreadedStream(sonicThreadedStream threaded,
+                                     short* samples, int maxSamples);
+/* Return the number of processed samples ready to be read. */
+int sonicThreadedSamplesAvailable(sonicThreadedStream threaded);
+#endif  /* SONIC_BATCH */
+
 #ifdef SONIC_SPECTROGRAM
 /*
 This code generates high quality spectrograms from sound samples, using
@@ -205,20 +648,53 @@ sonicSpectrogram sonicCreateSpectrogram(int sampleRate);
    sonicDestroyStream. */
 void sonicDestroySpectrogram(sonicSpectrogram spectrogram);
 
-/* Convert the spectrogram to a bitmap. Caller must destroy bitmap when done. */
+/* Called with each column of an incrementally rendered spectrogram as soon as
+   it is complete.  Columns are numbered from 0, and have numRows pixels from
+   the top row down, as in a sonicBitmap.  The column is only valid during the
+   call. */
+typedef void (*sonicSpectrogramColumnFunc)(void* context, int col,
+                                           const unsigned char* column,
+                                           int numRows);
+
+/* Render the spectrogram one column every samplesPerColumn input samples, and
+   pass each to columnFunc as soon as the audio it covers has been added.  Only
+   the last spectrum is kept, so memory stays constant however long the audio
+   is.  The range of the whole recording is not known yet, so power is scaled
+   from minPower to maxPower, in the units of the bitmap's 16-bit samples.
+   This must be called before any audio is added.  Return 0 if the arguments
+   are invalid or out of memory. */
+int sonicSetSpectrogramColumnFunc(sonicSpectrogram spectrogram,
+                                  sonicSpectrogramColumnFunc columnFunc,
+                                  void* context, int numRows,
+                                  double samplesPerColumn, double minPower,
+                                  double maxPower);
+
+/* Convert the spectrogram to a bitmap. Caller must destroy bitmap when done.
+   NULL is returned if it is rendered incrementally, or holds fewer than two
+   spectrums. */
 sonicBitmap sonicConvertSpectrogramToBitmap(sonicSpectrogram spectrogram,
                                             int numRows, int numCols);
 
+/* Like sonicConvertSpectrogramToBitmap, but render the columns on numThreads
+   threads.  Threads are only used when sonic is built with SONIC_BATCH. */
+sonicBitmap sonicConvertSpectrogramToBitmapInParallel(
+    sonicSpectrogram spectrogram, int numRows, int numCols, int numThreads);
+
 /* Destroy a bitmap returned by sonicConvertSpectrogramToBitmap. */
 void sonicDestroyBitmap(sonicBitmap bitmap);
 
+/* Write the bitmap as a binary PGM file.  Return 0 on failure. */
 int sonicWritePGM(sonicBitmap bitmap, char* fileName);
 
+/* Write the bitmap as an 8-bit grayscale PNG file.  It is not compressed.
+   Return 0 on failure. */
+int sonicWritePNG(sonicBitmap bitmap, char* fileName);
+
 /* Add two pitch periods worth of samples to the spectrogram.  There must be
    2*period samples.  Time should advance one pitch period for each call to
    this function. */
 void sonicAddPitchPeriodToSpectrogram(sonicSpectrogram spectrogram,
-                                      short* samples, int period,
+                                      sonicSample* samples, int period,
                                       int numChannels);
 #endif  /* SONIC_SPECTROGRAM */
 
@@ -15,6 +15,10 @@
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#ifdef SONIC_BATCH
+#include <pthread.h>
+#endif
 #include "sonic.h"
 #ifndef M_PI
 #define M_PI 3.14159265358979323846
@@ -23,34 +27,69 @@
 #define M_E 2.7182818284590452354
 #endif
 
-struct sonicSpectrumStruct;
+#ifdef  KISS_FFT
+typedef kiss_fft_cfg sonicFftPlan;
+#else
+typedef fftw_plan sonicFftPlan;
+#endif
+
+/* A spectral line.  Its power values are kept in the spectrogram's pool. */
+struct sonicSpectrumStruct {
+  int powerIndex; /* Index of the first power value in the pool */
+  int numFreqs; /* Number of frequencies */
+  int numSamples;
+  int startingSample;
+};
+
 typedef struct sonicSpectrumStruct* sonicSpectrum;
 
 struct sonicSpectrogramStruct {
-  sonicSpectrum* spectrums;
+  sonicSpectrum spectrums;
+  double* powers;
+  /* FFT plans indexed by length, which all share the buffers below. */
+  sonicFftPlan* plans;
+  double* in;
+#ifdef  KISS_FFT
+  kiss_fft_cpx* cin;
+  kiss_fft_cpx* out;
+#else
+  fftw_complex* out;
+#endif
+  /* Set when rendering columns as the audio is added. */
+  sonicSpectrogramColumnFunc columnFunc;
+  void* columnContext;
+  unsigned char* column;
+  double samplesPerColumn;
+  double columnMinPower, columnMaxPower;
   double minPower, maxPower;
   int numSpectrums;
   int allocatedSpectrums;
+  int numPowers;
+  int allocatedPowers;
+  int allocatedPlans;
+  int fftSize;
+  int numRows;
+  int numCols;
   int sampleRate;
   int totalSamples;
 };
 
-struct sonicSpectrumStruct {
-  sonicSpectrogram spectrogram;
-  double* power;
-  int numFreqs; /* Number of frequencies */
-  int numSamples;
-  int startingSample;
-};
+/* Return the power values of the spectrum. */
+static double* getSpectrumPower(sonicSpectrogram spectrogram,
+                                sonicSpectrum spectrum) {
+  return spectrogram->powers + spectrum->powerIndex;
+}
 
 /* Print out spectrum data for debugging. */
-static void dumpSpectrum(sonicSpectrum spectrum) {
+static void dumpSpectrum(sonicSpectrogram spectrogram,
+                         sonicSpectrum spectrum) {
+  double* power = getSpectrumPower(spectrogram, spectrum);
   printf("spectrum numFreqs:%d numSamples:%d startingSample:%d\n",
          spectrum->numFreqs, spectrum->numSamples, spectrum->startingSample);
   printf("   ");
   int i;
   for (i = 0; i < spectrum->numFreqs; i++) {
-    printf(" %.1f", spectrum->power[i]);
+    printf(" %.1f", power[i]);
   }
   printf("\n");
 }
@@ -63,40 +102,108 @@ static void dumpSpectrogram(sonicSpectrogram spectrogram) {
       spectrogram->totalSamples);
   int i;
   for (i = 0; i < spectrogram->numSpectrums; i++) {
-    dumpSpectrum(spectrogram->spectrums[i]);
+    dumpSpectrum(spectrogram, spectrogram->spectrums + i);
   }
 }
 
-/* Create an new spectrum. */
-static sonicSpectrum sonicCreateSpectrum(sonicSpectrogram spectrogram) {
-  sonicSpectrum spectrum =
-      (sonicSpectrum)calloc(1, sizeof(struct sonicSpectrumStruct));
-  if (spectrum == NULL) {
-    return NULL;
-  }
+/* Make room for one more spectrum with numFreqs power values.  Spectrums and
+   their power values are allocated from two arrays which grow as needed,
+   rather than one at a time.  Return 0 if out of memory. */
+static int allocateSpectrum(sonicSpectrogram spectrogram, int numFreqs) {
   if (spectrogram->numSpectrums == spectrogram->allocatedSpectrums) {
-    spectrogram->allocatedSpectrums <<= 1;
-    spectrogram->spectrums = (sonicSpectrum*)realloc(
+    int allocatedSpectrums = spectrogram->allocatedSpectrums << 1;
+    sonicSpectrum spectrums = (sonicSpectrum)realloc(
         spectrogram->spectrums,
-        spectrogram->allocatedSpectrums * sizeof(sonicSpectrum));
-    if (spectrogram->spectrums == NULL) {
-      return NULL;
+        allocatedSpectrums * sizeof(struct sonicSpectrumStruct));
+    if (spectrums == NULL) {
+      return 0;
+    }
+    spectrogram->spectrums = spectrums;
+    spectrogram->allocatedSpectrums = allocatedSpectrums;
+  }
+  if (spectrogram->numPowers + numFreqs > spectrogram->allocatedPowers) {
+    int allocatedPowers = (spectrogram->allocatedPowers << 1) + numFreqs;
+    double* powers =
+        (double*)realloc(spectrogram->powers, allocatedPowers * sizeof(double));
+    if (powers == NULL) {
+      return 0;
     }
+    spectrogram->powers = powers;
+    spectrogram->allocatedPowers = allocatedPowers;
   }
-  spectrogram->spectrums[spectrogram->numSpectrums++] = spectrum;
-  spectrum->spectrogram = spectrogram;
-  return spectrum;
+  return 1;
 }
 
-/* Destroy the spectrum. */
-static void sonicDestroySpectrum(sonicSpectrum spectrum) {
-  if (spectrum == NULL) {
-    return;
+/* Free the buffers the FFT plans share. */
+static void freeFftBuffers(sonicSpectrogram spectrogram) {
+#ifdef  KISS_FFT
+  free(spectrogram->in);
+  free(spectrogram->cin);
+  free(spectrogram->out);
+  spectrogram->cin = NULL;
+#else
+  fftw_free(spectrogram->in);
+  fftw_free(spectrogram->out);
+#endif
+  spectrogram->in = NULL;
+  spectrogram->out = NULL;
+  spectrogram->fftSize = 0;
+}
+
+/* Return the FFT plan for numSamples samples, creating it the first time that
+   length is seen.  Pitch periods only take a few hundred different lengths, so
+   this avoids planning an FFT for every period.  Return NULL if out of
+   memory. */
+static sonicFftPlan getFftPlan(sonicSpectrogram spectrogram, int numSamples) {
+  if (numSamples > spectrogram->fftSize) {
+    freeFftBuffers(spectrogram);
+#ifdef  KISS_FFT
+    spectrogram->in = (double*)malloc(numSamples * sizeof(double));
+    spectrogram->cin = (kiss_fft_cpx*)malloc(numSamples * sizeof(kiss_fft_cpx));
+    spectrogram->out = (kiss_fft_cpx*)malloc(numSamples * sizeof(kiss_fft_cpx));
+    if (spectrogram->cin == NULL) {
+      freeFftBuffers(spectrogram);
+      return NULL;
+    }
+#else
+    /* FFTW can run a plan on other buffers with the alignment fftw_malloc
+       gives, so the plans stay valid when the buffers grow. */
+    spectrogram->in = (double*)fftw_malloc(numSamples * sizeof(double));
+    spectrogram->out = (fftw_complex*)fftw_malloc((numSamples / 2 + 1) *
+                                                  sizeof(fftw_complex));
+#endif  /* FFTW */
+    if (spectrogram->in == NULL || spectrogram->out == NULL) {
+      freeFftBuffers(spectrogram);
+      return NULL;
+    }
+    spectrogram->fftSize = numSamples;
+  }
+  if (numSamples >= spectrogram->allocatedPlans) {
+    int allocatedPlans = spectrogram->allocatedPlans << 1;
+    sonicFftPlan* plans;
+    if (allocatedPlans <= numSamples) {
+      allocatedPlans = numSamples + 1;
+    }
+    plans = (sonicFftPlan*)realloc(spectrogram->plans,
+                                   allocatedPlans * sizeof(sonicFftPlan));
+    if (plans == NULL) {
+      return NULL;
+    }
+    memset(plans + spectrogram->allocatedPlans, 0,
+           (allocatedPlans - spectrogram->allocatedPlans) *
+               sizeof(sonicFftPlan));
+    spectrogram->plans = plans;
+    spectrogram->allocatedPlans = allocatedPlans;
   }
-  if (spectrum->power != NULL) {
-    free(spectrum->power);
+  if (spectrogram->plans[numSamples] == NULL) {
+#ifdef  KISS_FFT
+    spectrogram->plans[numSamples] = kiss_fft_alloc(numSamples, 0, NULL, NULL);
+#else
+    spectrogram->plans[numSamples] = fftw_plan_dft_r2c_1d(
+        numSamples, spectrogram->in, spectrogram->out, FFTW_ESTIMATE);
+#endif  /* FFTW */
   }
-  free(spectrum);
+  return spectrogram->plans[numSamples];
 }
 
 /* Create an empty spectrogram. */
@@ -107,8 +214,8 @@ sonicSpectrogram sonicCreateSpectrogram(int sampleRate) {
     return NULL;
   }
   spectrogram->allocatedSpectrums = 32;
-  spectrogram->spectrums = (sonicSpectrum*)calloc(
-      spectrogram->allocatedSpectrums, sizeof(sonicSpectrum));
+  spectrogram->spectrums = (sonicSpectrum)calloc(
+      spectrogram->allocatedSpectrums, sizeof(struct sonicSpectrumStruct));
   if (spectrogram->spectrums == NULL) {
     sonicDestroySpectrogram(spectrogram);
     return NULL;
@@ -122,14 +229,21 @@ sonicSpectrogram sonicCreateSpectrogram(int sampleRate) {
 /* Destroy the spectrotram. */
 void sonicDestroySpectrogram(sonicSpectrogram spectrogram) {
   if (spectrogram != NULL) {
-    if (spectrogram->spectrums != NULL) {
-      int i;
-      for (i = 0; i < spectrogram->numSpectrums; i++) {
-        sonicSpectrum spectrum = spectrogram->spectrums[i];
-        sonicDestroySpectrum(spectrum);
+    int i;
+    for (i = 0; i < spectrogram->allocatedPlans; i++) {
+      if (spectrogram->plans[i] != NULL) {
+#ifdef  KISS_FFT
+        free(spectrogram->plans[i]);
+#else
+        fftw_destroy_plan(spectrogram->plans[i]);
+#endif
       }
-      free(spectrogram->spectrums);
     }
+    free(spectrogram->plans);
+    freeFftBuffers(spectrogram);
+    free(spectrogram->spectrums);
+    free(spectrogram->powers);
+    free(spectrogram->column);
     free(spectrogram);
   }
 }
@@ -159,11 +273,22 @@ void sonicDestroyBitmap(sonicBitmap bitmap) {
 
 /* Overlap-add the two pitch periods using a Hann window.  Caller must free the
  * result. */
-static void computeOverlapAdd(short* samples, int period, int numChannels,
-                              double* ola_samples) {
+static void computeOverlapAdd(sonicSample* samples, int period,
+                              int numChannels, double* ola_samples) {
   int i;
   for (i = 0; i < period; i++) {
     double weight = (1.0 - cos(M_PI * i / period)) / 2.0;
+#ifdef SONIC_USE_FLOAT
+    /* Scale float samples to the 16-bit range used for the 16-bit samples. */
+    double sample1 = 0.0, sample2 = 0.0;
+    int j;
+    for (j = 0; j < numChannels; j++) {
+      sample1 += samples[i * numChannels + j];
+      sample2 += samples[(i + period) * numChannels + j];
+    }
+    sample1 *= 32767.0 / numChannels;
+    sample2 *= 32767.0 / numChannels;
+#else
     short sample1, sample2;
     if (numChannels == 1) {
       sample1 = samples[i];
@@ -180,6 +305,7 @@ static void computeOverlapAdd(short* samples, int period, int numChannels,
       sample1 = (total1 + (numChannels >> 1)) / numChannels;
       sample2 = (total2 + (numChannels >> 1)) / numChannels;
     }
+#endif  /* SONIC_USE_FLOAT */
     ola_samples[i] = weight * sample1 + (1.0 - weight) * sample2;
   }
 }
@@ -196,78 +322,39 @@ static double magnitude(fftw_complex c) {
 }
 #endif
 
-/* Add two pitch periods worth of samples to the spectrogram.  There must be
-   2*period samples.  Time should advance one pitch period for each call to
-   this function. */
-void sonicAddPitchPeriodToSpectrogram(sonicSpectrogram spectrogram,
-                                      short* samples, int numSamples,
-                                      int numChannels) {
-  int i;
-  sonicSpectrum spectrum = sonicCreateSpectrum(spectrogram);
-  spectrum->startingSample = spectrogram->totalSamples;
-  spectrogram->totalSamples += numSamples;
-  /* TODO: convert to fixed-point */
-  double* in = calloc(numSamples, sizeof(double));
-  int numFreqs = numSamples / 2 + 1;
-  spectrum->numFreqs = numFreqs;
-  spectrum->numSamples = numSamples;
-  spectrum->power = (double*)calloc(spectrum->numFreqs, sizeof(double));
-  computeOverlapAdd(samples, numSamples, numChannels, in);
-#ifdef  KISS_FFT
-  kiss_fft_cpx* cin = calloc(numFreqs, sizeof(kiss_fft_cpx));
-  for (i=0; i<numFreqs; i++) {
-    cin[i].r = in[i];
-  }
-  kiss_fft_cpx* out = calloc(numFreqs, sizeof(kiss_fft_cpx));
-  kiss_fft_cfg kiss_plan = kiss_fft_alloc(numFreqs, 0, NULL, NULL);
-  kiss_fft(kiss_plan, cin, out);
-  free(cin);
-#else
-  fftw_complex* out = calloc(numFreqs, sizeof(fftw_complex));
-  fftw_plan p = fftw_plan_dft_r2c_1d(numSamples, in, out, FFTW_ESTIMATE);
-  fftw_execute(p);
-  fftw_destroy_plan(p);
-#endif  /* FFTW */
-  /* Set the DC power to 0. */
-  spectrum->power[0] = 0.0;
-  for (i = 1; i < numFreqs; ++i) {
-    double power = magnitude(out[i]) / numSamples;
-    spectrum->power[i] = power;
-    if (power > spectrogram->maxPower) {
-      spectrogram->maxPower = power;
-    }
-    if (power < spectrogram->minPower) {
-      spectrogram->minPower = power;
-    }
-  }
-  free(in);
-  free(out);
-}
-
 /* Linearly interpolate the power at a given position in the spectrogram. */
-static double interpolateSpectrum(sonicSpectrum spectrum, int row,
+static double interpolateSpectrum(sonicSpectrogram spectrogram,
+                                  sonicSpectrum spectrum, int row,
                                   int numRows) {
+  double* power = getSpectrumPower(spectrogram, spectrum);
   /* Flip the row so that we show lowest frequency on the bottom. */
   row = numRows - row - 1;
   /* We want the max row to be 1/2 the Niquist frequency, or 4 samples worth. */
   double spectrumFreqSpacing =
-      (double)spectrum->spectrogram->sampleRate / spectrum->numSamples;
+      (double)spectrogram->sampleRate / spectrum->numSamples;
   double rowFreqSpacing = SONIC_MAX_SPECTRUM_FREQ / (numRows - 1);
   double targetFreq = row * rowFreqSpacing;
   int bottomIndex = targetFreq / spectrumFreqSpacing;
-  double bottomPower = spectrum->power[bottomIndex];
-  double topPower = spectrum->power[bottomIndex + 1];
+  if (bottomIndex + 1 >= spectrum->numFreqs) {
+    /* Above the Niquist frequency of low sample rates. */
+    return power[spectrum->numFreqs - 1];
+  }
+  double bottomPower = power[bottomIndex];
+  double topPower = power[bottomIndex + 1];
   double position =
       (targetFreq - bottomIndex * spectrumFreqSpacing) / spectrumFreqSpacing;
   return (1.0 - position) * bottomPower + position * topPower;
 }
 
 /* Linearly interpolate the power at a given position in the spectrogram. */
-static double interpolateSpectrogram(sonicSpectrum leftSpectrum,
+static double interpolateSpectrogram(sonicSpectrogram spectrogram,
+                                     sonicSpectrum leftSpectrum,
                                      sonicSpectrum rightSpectrum, int row,
                                      int numRows, int colTime) {
-  double leftPower = interpolateSpectrum(leftSpectrum, row, numRows);
-  double rightPower = interpolateSpectrum(rightSpectrum, row, numRows);
+  double leftPower =
+      interpolateSpectrum(spectrogram, leftSpectrum, row, numRows);
+  double rightPower =
+      interpolateSpectrum(spectrogram, rightSpectrum, row, numRows);
   if (rightSpectrum->startingSample !=
       leftSpectrum->startingSample + leftSpectrum->numSamples) {
     fprintf(stderr, "Invalid sample spacing\n");
@@ -278,21 +365,24 @@ static double interpolateSpectrogram(sonicSpectrum leftSpectrum,
   return (1.0 - position) * leftPower + position * rightPower;
 }
 
-/* Add one column of data to the output bitmap data. */
-static void addBitmapCol(unsigned char* data, int col, int numCols, int numRows,
-                         sonicSpectrogram spectrogram, sonicSpectrum spectrum,
-                         sonicSpectrum nextSpectrum, int colTime) {
-  double minPower = spectrogram->minPower;
-  double maxPower = spectrogram->maxPower;
+/* Render one column of the bitmap at colTime, writing a pixel every stride
+   bytes of data.  Power is scaled from minPower to maxPower. */
+static void renderBitmapCol(unsigned char* data, int stride, int numRows,
+                            sonicSpectrogram spectrogram,
+                            sonicSpectrum spectrum, sonicSpectrum nextSpectrum,
+                            int colTime, double minPower, double maxPower) {
+  double range = maxPower - minPower;
   int row;
   for (row = 0; row < numRows; row++) {
-    double power =
-        interpolateSpectrogram(spectrum, nextSpectrum, row, numRows, colTime);
-    if (power < minPower && power > maxPower) {
-      fprintf(stderr, "Power outside min/max range\n");
-      exit(1);
+    double power = interpolateSpectrogram(spectrogram, spectrum, nextSpectrum,
+                                          row, numRows, colTime);
+    /* The DC power, and the power of incremental spectrograms, can fall
+       outside the range. */
+    if (power < minPower) {
+      power = minPower;
+    } else if (power > maxPower) {
+      power = maxPower;
     }
-    double range = maxPower - minPower;
     /* Use log scale such that log(min) = 0, and log(max) = 255. */
     int value =
         256.0 * sqrt(sqrt(log((M_E - 1.0) * (power - minPower) / range + 1.0)));
@@ -300,8 +390,226 @@ static void addBitmapCol(unsigned char* data, int col, int numCols, int numRows,
     if (value >= 256) {
       value = 255;
     }
-    data[row * numCols + col] = 255 - value;
+    data[row * stride] = 255 - value;
+  }
+}
+
+/* Render every column up to the start of the last spectrum, and pass each to
+   the column function.  Then drop all but the last spectrum, since no later
+   column needs them. */
+static void emitBitmapCols(sonicSpectrogram spectrogram) {
+  int numSpectrums = spectrogram->numSpectrums;
+  sonicSpectrum spectrum = spectrogram->spectrums + numSpectrums - 2;
+  sonicSpectrum nextSpectrum = spectrum + 1;
+  struct sonicSpectrumStruct last;
+  double colTime = spectrogram->numCols * spectrogram->samplesPerColumn;
+  while (colTime <= nextSpectrum->startingSample) {
+    renderBitmapCol(spectrogram->column, 1, spectrogram->numRows, spectrogram,
+                    spectrum, nextSpectrum, colTime,
+                    spectrogram->columnMinPower, spectrogram->columnMaxPower);
+    spectrogram->columnFunc(spectrogram->columnContext, spectrogram->numCols,
+                            spectrogram->column, spectrogram->numRows);
+    spectrogram->numCols++;
+    colTime = spectrogram->numCols * spectrogram->samplesPerColumn;
+  }
+  last = *nextSpectrum;
+  memmove(spectrogram->powers, getSpectrumPower(spectrogram, &last),
+          last.numFreqs * sizeof(double));
+  last.powerIndex = 0;
+  spectrogram->spectrums[0] = last;
+  spectrogram->numSpectrums = 1;
+  spectrogram->numPowers = last.numFreqs;
+}
+
+/* Add two pitch periods worth of samples to the spectrogram.  There must be
+   2*period samples.  Time should advance one pitch period for each call to
+   this function. */
+void sonicAddPitchPeriodToSpectrogram(sonicSpectrogram spectrogram,
+                                      sonicSample* samples, int numSamples,
+                                      int numChannels) {
+  int i;
+  int numFreqs = numSamples / 2 + 1;
+  sonicFftPlan plan = getFftPlan(spectrogram, numSamples);
+  if (plan == NULL || !allocateSpectrum(spectrogram, numFreqs)) {
+    return;
+  }
+  sonicSpectrum spectrum = spectrogram->spectrums + spectrogram->numSpectrums++;
+  spectrum->powerIndex = spectrogram->numPowers;
+  spectrogram->numPowers += numFreqs;
+  spectrum->startingSample = spectrogram->totalSamples;
+  spectrogram->totalSamples += numSamples;
+  spectrum->numFreqs = numFreqs;
+  spectrum->numSamples = numSamples;
+  double* power = getSpectrumPower(spectrogram, spectrum);
+  /* TODO: convert to fixed-point */
+  double* in = spectrogram->in;
+  computeOverlapAdd(samples, numSamples, numChannels, in);
+#ifdef  KISS_FFT
+  kiss_fft_cpx* cin = spectrogram->cin;
+  for (i = 0; i < numSamples; i++) {
+    cin[i].r = in[i];
+    cin[i].i = 0.0;
+  }
+  kiss_fft(plan, cin, spectrogram->out);
+#else
+  fftw_execute_dft_r2c(plan, in, spectrogram->out);
+#endif  /* FFTW */
+  /* Set the DC power to 0. */
+  power[0] = 0.0;
+  for (i = 1; i < numFreqs; ++i) {
+    double value = magnitude(spectrogram->out[i]) / numSamples;
+    power[i] = value;
+    if (value > spectrogram->maxPower) {
+      spectrogram->maxPower = value;
+    }
+    if (value < spectrogram->minPower) {
+      spectrogram->minPower = value;
+    }
+  }
+  if (spectrogram->columnFunc != NULL && spectrogram->numSpectrums > 1) {
+    emitBitmapCols(spectrogram);
+  }
+}
+
+/* Render the spectrogram one column at a time as the audio is added. */
+int sonicSetSpectrogramColumnFunc(sonicSpectrogram spectrogram,
+                                  sonicSpectrogramColumnFunc columnFunc,
+                                  void* context, int numRows,
+                                  double samplesPerColumn, double minPower,
+                                  double maxPower) {
+  if (spectrogram->numSpectrums != 0 || numRows < 2 ||
+      samplesPerColumn <= 0.0 || maxPower <= minPower) {
+    return 0;
+  }
+  unsigned char* column =
+      (unsigned char*)realloc(spectrogram->column, numRows);
+  if (column == NULL) {
+    return 0;
+  }
+  spectrogram->column = column;
+  spectrogram->columnFunc = columnFunc;
+  spectrogram->columnContext = context;
+  spectrogram->numRows = numRows;
+  spectrogram->samplesPerColumn = samplesPerColumn;
+  spectrogram->columnMinPower = minPower;
+  spectrogram->columnMaxPower = maxPower;
+  return 1;
+}
+
+/* A range of bitmap columns for one thread to render. */
+typedef struct {
+  sonicSpectrogram spectrogram;
+  unsigned char* data;
+  int numRows;
+  int numCols;
+  int startCol;
+  int endCol;
+} sonicColRange;
+
+/* Return the index of the spectrum to the right of colTime: the first after
+   the first spectrum that starts later than colTime, or the last. */
+static int findNextSpectrum(sonicSpectrogram spectrogram, double colTime) {
+  int low = 1;
+  int high = spectrogram->numSpectrums - 1;
+  while (low < high) {
+    int middle = (low + high) >> 1;
+    if (colTime < spectrogram->spectrums[middle].startingSample) {
+      high = middle;
+    } else {
+      low = middle + 1;
+    }
+  }
+  return low;
+}
+
+/* Render the range of columns.  Columns do not depend on each other, so
+   ranges can be rendered in parallel. */
+static void renderBitmapCols(sonicColRange* range) {
+  sonicSpectrogram spectrogram = range->spectrogram;
+  int totalTime =
+      spectrogram->spectrums[spectrogram->numSpectrums - 1].startingSample;
+  int col;
+  for (col = range->startCol; col < range->endCol; col++) {
+    double colTime = (double)totalTime * col / (range->numCols - 1);
+    sonicSpectrum nextSpectrum =
+        spectrogram->spectrums + findNextSpectrum(spectrogram, colTime);
+    renderBitmapCol(range->data + col, range->numCols, range->numRows,
+                    spectrogram, nextSpectrum - 1, nextSpectrum, colTime,
+                    spectrogram->minPower, spectrogram->maxPower);
+  }
+}
+
+#ifdef SONIC_BATCH
+/* Run renderBitmapCols on a thread. */
+static void* runRenderThread(void* arg) {
+  renderBitmapCols((sonicColRange*)arg);
+  return NULL;
+}
+#endif  /* SONIC_BATCH */
+
+/* Convert the spectrogram to a bitmap, rendering the columns on numThreads
+   threads. */
+sonicBitmap sonicConvertSpectrogramToBitmapInParallel(
+    sonicSpectrogram spectrogram, int numRows, int numCols, int numThreads) {
+  /* dumpSpectrogram(spectrogram); */
+  /* There must be at least two spectrums for this to work right. */
+  if (spectrogram->columnFunc != NULL || spectrogram->numSpectrums < 2) {
+    return NULL;
+  }
+#ifndef SONIC_BATCH
+  numThreads = 1;
+#endif
+  if (numThreads > numCols) {
+    numThreads = numCols;
+  }
+  if (numThreads < 1) {
+    numThreads = 1;
+  }
+  unsigned char* data =
+      (unsigned char*)calloc(numRows * numCols, sizeof(unsigned char));
+  sonicColRange* ranges =
+      (sonicColRange*)calloc(numThreads, sizeof(sonicColRange));
+  if (data == NULL || ranges == NULL) {
+    free(data);
+    free(ranges);
+    return NULL;
+  }
+  int i;
+  for (i = 0; i < numThreads; i++) {
+    ranges[i].spectrogram = spectrogram;
+    ranges[i].data = data;
+    ranges[i].numRows = numRows;
+    ranges[i].numCols = numCols;
+    ranges[i].startCol = (int)((long)numCols * i / numThreads);
+    ranges[i].endCol = (int)((long)numCols * (i + 1) / numThreads);
+  }
+#ifdef SONIC_BATCH
+  pthread_t* threads = (pthread_t*)calloc(numThreads, sizeof(pthread_t));
+  int* started = (int*)calloc(numThreads, sizeof(int));
+  if (threads != NULL && started != NULL) {
+    for (i = 1; i < numThreads; i++) {
+      started[i] =
+          pthread_create(threads + i, NULL, runRenderThread, ranges + i) == 0;
+    }
+  }
+  for (i = 0; i < numThreads; i++) {
+    /* Render on this thread whatever no other thread took. */
+    if (started == NULL || !started[i]) {
+      renderBitmapCols(ranges + i);
+    }
+  }
+  for (i = 1; i < numThreads; i++) {
+    if (started != NULL && started[i]) {
+      pthread_join(threads[i], NULL);
+    }
   }
+  free(threads);
+  free(started);
+#else
+  renderBitmapCols(ranges);
+#endif  /* SONIC_BATCH */
+  free(ranges);
+  return sonicCreateBitmap(data, numRows, numCols);
 }
 
 /* Convert the spectrogram to a bitmap.  The returned array must be freed by
@@ -309,62 +617,161 @@ static void addBitmapCol(unsigned char* data, int col, int numCols, int numRows,
    to bottom, and each row is left to right.  So, the pixel in the 5th row from
    the top, in the 18th column from the left in a 32x128 array would be in
    position 128*4 + 18.  NULL is returned if calloc fails to allocate the
-   memory. */
+   memory, or if the spectrogram is rendered incrementally. */
 sonicBitmap sonicConvertSpectrogramToBitmap(sonicSpectrogram spectrogram,
                                             int numRows, int numCols) {
-  /* dumpSpectrogram(spectrogram); */
-  unsigned char* data =
-      (unsigned char*)calloc(numRows * numCols, sizeof(unsigned char));
-  if (data == NULL) {
-    return NULL;
+  return sonicConvertSpectrogramToBitmapInParallel(spectrogram, numRows,
+                                                   numCols, 1);
+}
+
+/* Write the whole buffer to the file, and close it.  Return 0 on failure. */
+static int writeImageFile(char* fileName, unsigned char* buffer, long size) {
+  FILE* file = fopen(fileName, "wb");
+  int status;
+  if (file == NULL) {
+    return 0;
   }
-  int xSpectrum = 0; /* xSpectrum is index of nextSpectrum */
-  sonicSpectrum spectrum = spectrogram->spectrums[xSpectrum++];
-  sonicSpectrum nextSpectrum = spectrogram->spectrums[xSpectrum];
-  int totalTime =
-      spectrogram->spectrums[spectrogram->numSpectrums - 1]->startingSample;
-  int col;
-  for (col = 0; col < numCols; col++) {
-    /* There must be at least two spectrums for this to work right. */
-    double colTime = (double)totalTime * col / (numCols - 1);
-    while (xSpectrum + 1 < spectrogram->numSpectrums &&
-           colTime >= nextSpectrum->startingSample) {
-      spectrum = nextSpectrum;
-      nextSpectrum = spectrogram->spectrums[++xSpectrum];
-    }
-    addBitmapCol(data, col, numCols, numRows, spectrogram, spectrum,
-                 nextSpectrum, colTime);
+  status = fwrite(buffer, 1, size, file) == (size_t)size;
+  if (fclose(file) != 0) {
+    status = 0;
   }
-  return sonicCreateBitmap(data, numRows, numCols);
+  return status;
 }
 
-/* Write a PGM image file, which is 8-bit grayscale and looks like:
-    P2
+/* Write a PGM image file, which is 8-bit grayscale.  It is written in the
+   binary P5 format, with one byte per pixel after a header like:
+    P5
     # CREATOR: libsonic
     640 400
     255
-    ...
 */
 int sonicWritePGM(sonicBitmap bitmap, char* fileName) {
   printf("Writing PGM to %s\n", fileName);
-  FILE* file = fopen(fileName, "w");
-  if (file == NULL) {
+  char header[64];
+  int headerLength = sprintf(header, "P5\n# CREATOR: libsonic\n%d %d\n255\n",
+                             bitmap->numCols, bitmap->numRows);
+  long numPixels = (long)bitmap->numRows * bitmap->numCols;
+  unsigned char* buffer = (unsigned char*)malloc(headerLength + numPixels);
+  if (buffer == NULL) {
     return 0;
   }
-  if (fprintf(file, "P2\n# CREATOR: libsonic\n%d %d\n255\n", bitmap->numCols,
-              bitmap->numRows) < 0) {
-    fclose(file);
+  memcpy(buffer, header, headerLength);
+  long i;
+  unsigned char* p = buffer + headerLength;
+  for (i = 0; i < numPixels; i++) {
+    p[i] = 255 - bitmap->data[i];
+  }
+  int status = writeImageFile(fileName, buffer, headerLength + numPixels);
+  free(buffer);
+  return status;
+}
+
+/* The largest block of data deflate can store uncompressed. */
+#define SONIC_MAX_STORED_BLOCK 65535
+
+/* Write value in 4 bytes, most significant first, as PNG does. */
+static unsigned char* putPNGLong(unsigned char* p, unsigned long value) {
+  p[0] = (unsigned char)(value >> 24);
+  p[1] = (unsigned char)(value >> 16);
+  p[2] = (unsigned char)(value >> 8);
+  p[3] = (unsigned char)value;
+  return p + 4;
+}
+
+/* Finish the PNG chunk whose length and type start at chunk, and whose data
+   ends at end, by filling in its length and appending its CRC. */
+static unsigned char* endPNGChunk(unsigned char* chunk, unsigned char* end,
+                                  const unsigned long* crcTable) {
+  unsigned long crc = 0xffffffffUL;
+  unsigned char* p;
+  putPNGLong(chunk, end - chunk - 8);
+  for (p = chunk + 4; p < end; p++) {
+    crc = crcTable[(crc ^ *p) & 0xff] ^ (crc >> 8);
+  }
+  return putPNGLong(end, crc ^ 0xffffffffUL);
+}
+
+/* Write a PNG image file, which is 8-bit grayscale.  This does not depend on
+   zlib, so the pixels are stored in uncompressed deflate blocks, which makes
+   the file a little larger than a PGM file. */
+int sonicWritePNG(sonicBitmap bitmap, char* fileName) {
+  static const unsigned char signature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+  unsigned long crcTable[256];
+  unsigned long adler1 = 1, adler2 = 0;
+  int numRows = bitmap->numRows;
+  int numCols = bitmap->numCols;
+  /* Each row starts with a filter type byte. */
+  long rawSize = (long)numRows * (numCols + 1);
+  long numBlocks = (rawSize + SONIC_MAX_STORED_BLOCK - 1) /
+                   SONIC_MAX_STORED_BLOCK;
+  long dataSize = 2 + rawSize + 5 * numBlocks + 4;
+  long size = sizeof(signature) + 25 + 12 + dataSize + 12;
+  unsigned char* buffer;
+  unsigned char* chunk;
+  unsigned char* p;
+  long i, position = 0;
+  int j, k;
+
+  printf("Writing PNG to %s\n", fileName);
+  for (j = 0; j < 256; j++) {
+    unsigned long c = j;
+    for (k = 0; k < 8; k++) {
+      c = c & 1 ? 0xedb88320UL ^ (c >> 1) : c >> 1;
+    }
+    crcTable[j] = c;
+  }
+  buffer = (unsigned char*)malloc(size);
+  if (buffer == NULL) {
     return 0;
   }
-  int i;
-  int numPixels = bitmap->numRows * bitmap->numCols;
-  unsigned char* p = bitmap->data;
-  for (i = 0; i < numPixels; i++) {
-    if (fprintf(file, "%d\n", 255 - *p++) < 0) {
-      fclose(file);
-      return 0;
+  memcpy(buffer, signature, sizeof(signature));
+  chunk = buffer + sizeof(signature);
+  p = chunk + 4;
+  memcpy(p, "IHDR", 4);
+  p = putPNGLong(p + 4, numCols);
+  p = putPNGLong(p, numRows);
+  /* 8-bit grayscale, deflate, no interlacing. */
+  *p++ = 8;
+  *p++ = 0;
+  *p++ = 0;
+  *p++ = 0;
+  *p++ = 0;
+  chunk = endPNGChunk(chunk, p, crcTable);
+  p = chunk + 4;
+  memcpy(p, "IDAT", 4);
+  p += 4;
+  /* The zlib header, for deflate with a 32K window. */
+  *p++ = 0x78;
+  *p++ = 0x01;
+  for (i = 0; i < numBlocks; i++) {
+    long blockSize = rawSize - i * SONIC_MAX_STORED_BLOCK;
+    long end;
+    if (blockSize > SONIC_MAX_STORED_BLOCK) {
+      blockSize = SONIC_MAX_STORED_BLOCK;
+    }
+    *p++ = i == numBlocks - 1;
+    *p++ = (unsigned char)blockSize;
+    *p++ = (unsigned char)(blockSize >> 8);
+    *p++ = (unsigned char)~blockSize;
+    *p++ = (unsigned char)(~blockSize >> 8);
+    for (end = position + blockSize; position < end; position++) {
+      long row = position / (numCols + 1);
+      long col = position - row * (numCols + 1);
+      unsigned char value = 0;
+      if (col != 0) {
+        value = 255 - bitmap->data[row * numCols + col - 1];
+      }
+      *p++ = value;
+      adler1 = (adler1 + value) % 65521;
+      adler2 = (adler2 + adler1) % 65521;
     }
   }
-  fclose(file);
-  return 1;
+  p = putPNGLong(p, (adler2 << 16) | adler1);
+  chunk = endPNGChunk(chunk, p, crcTable);
+  p = chunk + 4;
+  memcpy(p, "IEND", 4);
+  endPNGChunk(chunk, p + 4, crcTable);
+  int status = writeImageFile(fileName, buffer, size);
+  free(buffer);
+  return status;
 }
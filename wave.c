@@ -9,22 +9,84 @@
 /*
 This file supports read/write wave files.
 */
+
+/* Input files are memory mapped where mmap is available.  It is POSIX, not
+   ANSI C. */
+#if defined(__unix__) || defined(__APPLE__)
+#define WAVE_USE_MMAP
+#define _POSIX_C_SOURCE 200112L
+#endif
+
 #include "wave.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef WAVE_USE_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
 #define WAVE_BUF_LEN 4096
+/* The stdio buffer size for unmapped files, so big files are read and written
+   with few system calls. */
+#define WAVE_STDIO_BUF_LEN (1 << 20)
+
+/* Format tags in the fmt chunk. */
+#define WAVE_TAG_PCM 1
+#define WAVE_TAG_FLOAT 3
+#define WAVE_TAG_EXTENSIBLE 0xfffe
+
+/* The chunk size written when streaming to a pipe, which means the chunk goes
+   on until the end of the file. */
+#define WAVE_UNKNOWN_SIZE 0xffffffffUL
 
 struct waveFileStruct {
   int numChannels;
   int sampleRate;
+  int format;
   FILE* soundFile;
   int bytesWritten; /* The number of bytes written so far, including header */
   int failed;
   int isInput;
+  /* Output files that cannot seek, such as pipes, are written with unknown
+     sizes.  Otherwise the data size is patched at dataSizeOffset. */
+  int isSeekable;
+  int dataSizeOffset;
+  /* Bytes left in the data chunk of an input file, or -1 if it goes on until
+     the end of the file.  The data chunk starts at dataOffset, or it is -1 if
+     the file cannot seek, and holds dataBytes bytes, or it is -1 if unknown.
+     dataBytesRead counts the bytes of it read so far. */
+  long bytesLeft;
+  long dataOffset;
+  long dataBytes;
+  long dataBytesRead;
+  /* If the input file is memory mapped, the samples in it, and how many have
+     been read. */
+  void* map;
+  size_t mapLength;
+  short* mappedSamples;
+  int numMappedSamples;
+  int mappedSamplePos;
 };
 
+/* Return 1 if this host stores shorts little endian, like wave files. */
+static int isLittleEndian(void) {
+  short value = 1;
+
+  return *(char*)&value == 1;
+}
+
+/* Return the number of bytes in one sample of one channel. */
+static int bytesPerSample(int format) {
+  switch (format) {
+    case WAVE_PCM24:
+      return 3;
+    case WAVE_FLOAT32:
+      return 4;
+  }
+  return 2;
+}
+
 /* Write a string to a file. */
 static void writeBytes(waveFile file, void* bytes, int length) {
   size_t bytesWritten;
@@ -46,7 +108,7 @@ static void writeString(waveFile file, char* string) {
 }
 
 /* Write an integer to a file in little endian order. */
-static void writeInt(waveFile file, int value) {
+static void writeInt(waveFile file, unsigned long value) {
   char bytes[4];
   int i;
 
@@ -91,10 +153,22 @@ static void readExactBytes(waveFile file, void* bytes, int length) {
   }
 }
 
-/* Read an integer from the input file */
-static int readInt(waveFile file) {
+/* Skip bytes in the input file by reading them, which also works on pipes. */
+static void skipBytes(waveFile file, unsigned long length) {
+  unsigned char bytes[WAVE_BUF_LEN];
+
+  while (length > WAVE_BUF_LEN) {
+    readExactBytes(file, bytes, WAVE_BUF_LEN);
+    length -= WAVE_BUF_LEN;
+  }
+  readExactBytes(file, bytes, length);
+}
+
+/* Read an unsigned integer from the input file */
+static unsigned long readInt(waveFile file) {
   unsigned char bytes[4];
-  int value = 0, i;
+  unsigned long value = 0;
+  int i;
 
   readExactBytes(file, bytes, 4);
   for (i = 3; i >= 0; i--) {
@@ -135,74 +209,266 @@ static void expectString(waveFile file, char* expectedString) {
   }
 }
 
-/* Write the header of the wave file. */
-static void writeHeader(waveFile file, int sampleRate, int numChannels) {
-  /* write the wav file per the wav file format */
+/* Convert a float sample to an IEEE float in little endian order. */
+static void packFloatBits(float value, unsigned char* bytes) {
+  unsigned int bits;
+  int i;
+
+  memcpy(&bits, &value, 4);
+  for (i = 0; i < 4; i++) {
+    bytes[i] = bits;
+    bits >>= 8;
+  }
+}
+
+/* Convert an IEEE float in little endian order to a float sample. */
+static float unpackFloatBits(unsigned char* bytes) {
+  unsigned int bits = 0;
+  float value;
+  int i;
+
+  for (i = 3; i >= 0; i--) {
+    bits <<= 8;
+    bits |= bytes[i];
+  }
+  memcpy(&value, &bits, 4);
+  return value;
+}
+
+/* Multiply a float from -1 to 1 by scale, and clip it to -limit to limit. */
+static long clipFloat(float value, float scale, long limit) {
+  value *= scale;
+  if (value > limit) {
+    return limit;
+  } else if (value < -limit) {
+    return -limit;
+  }
+  return (long)value;
+}
+
+/* Pack a 16-bit sample in the file's format. */
+static void packShort(int format, short value, unsigned char* bytes) {
+  switch (format) {
+    case WAVE_PCM16:
+      bytes[0] = value;
+      bytes[1] = value >> 8;
+      break;
+    case WAVE_PCM24:
+      bytes[0] = 0;
+      bytes[1] = value;
+      bytes[2] = value >> 8;
+      break;
+    case WAVE_FLOAT32:
+      packFloatBits(value / 32767.0f, bytes);
+      break;
+  }
+}
+
+/* Pack a float sample from -1 to 1 in the file's format. */
+static void packFloat(int format, float value, unsigned char* bytes) {
+  long intValue;
+
+  switch (format) {
+    case WAVE_PCM16:
+      intValue = clipFloat(value, 32767.0f, 32767);
+      bytes[0] = intValue;
+      bytes[1] = intValue >> 8;
+      break;
+    case WAVE_PCM24:
+      intValue = clipFloat(value, 32767.0f * 256.0f, 8388607);
+      bytes[0] = intValue;
+      bytes[1] = intValue >> 8;
+      bytes[2] = intValue >> 16;
+      break;
+    case WAVE_FLOAT32:
+      packFloatBits(value, bytes);
+      break;
+  }
+}
+
+/* Unpack a sample in the file's format to a 16-bit sample. */
+static short unpackShort(int format, unsigned char* bytes) {
+  switch (format) {
+    case WAVE_PCM24:
+      /* Drop the low byte. */
+      bytes++;
+      break;
+    case WAVE_FLOAT32:
+      return clipFloat(unpackFloatBits(bytes), 32767.0f, 32767);
+  }
+  return (short)(bytes[0] | (unsigned int)bytes[1] << 8);
+}
+
+/* Unpack a sample in the file's format to a float from -1 to 1. */
+static float unpackFloat(int format, unsigned char* bytes) {
+  long value;
+
+  switch (format) {
+    case WAVE_PCM24:
+      value = bytes[0] | (long)bytes[1] << 8 | (long)bytes[2] << 16;
+      if (value & 0x800000) {
+        value -= 0x1000000;
+      }
+      /* Scale like 16-bit samples, so the low byte is just more precision. */
+      return value / (32767.0f * 256.0f);
+    case WAVE_FLOAT32:
+      return unpackFloatBits(bytes);
+  }
+  return unpackShort(format, bytes) / 32767.0f;
+}
+
+/* Write the header of the wave file.  The sizes are filled in by
+   closeWaveFile, or left unknown if the file cannot seek. */
+static void writeHeader(waveFile file, int sampleRate, int numChannels,
+                        int format) {
+  int sampleBytes = bytesPerSample(format);
+  unsigned long size = file->isSeekable ? 0 : WAVE_UNKNOWN_SIZE;
+
   writeString(file, "RIFF"); /* 00 - RIFF */
-  /* We have to fseek and overwrite this later when we close the file because */
-  /* we don't know how big it is until then. */
-  writeInt(file,
-           36 /* + dataLength */); /* 04 - how big is the rest of this file? */
-  writeString(file, "WAVE");       /* 08 - WAVE */
-  writeString(file, "fmt ");       /* 12 - fmt */
-  writeInt(file, 16);              /* 16 - size of this chunk */
-  writeShort(
-      file,
-      1); /* 20 - what is the audio format? 1 for PCM = Pulse Code Modulation */
-  writeShort(file,
-             numChannels);    /* 22 - mono or stereo? 1 or 2?  (or 5 or ???) */
-  writeInt(file, sampleRate); /* 24 - samples per second (numbers per second) */
-  writeInt(file, sampleRate * 2); /* 28 - bytes per second */
-  writeShort(file, 2); /* 32 - # of bytes in one sample, for all channels */
-  writeShort(
-      file, 16); /* 34 - how many bits in a sample(number)?  usually 16 or 24 */
-  writeString(file, "data"); /* 36 - data */
-  writeInt(file, 0);         /* 40 - how big is this data chunk */
-}
-
-/* Read the header of the wave file. */
-static int readHeader(waveFile file) {
-  int data;
+  writeInt(file, file->isSeekable ? 36 : size); /* 04 - size of the rest */
+  writeString(file, "WAVE");                    /* 08 - WAVE */
+  writeString(file, "fmt ");                    /* 12 - fmt */
+  writeInt(file, 16);                           /* 16 - size of this chunk */
+  /* 20 - PCM or IEEE float */
+  writeShort(file, format == WAVE_FLOAT32 ? WAVE_TAG_FLOAT : WAVE_TAG_PCM);
+  writeShort(file, numChannels); /* 22 - mono or stereo? 1 or 2? */
+  writeInt(file, sampleRate);    /* 24 - samples per second */
+  writeInt(file, sampleRate * numChannels * sampleBytes); /* 28 - byte rate */
+  writeShort(file, numChannels * sampleBytes); /* 32 - bytes per frame */
+  writeShort(file, sampleBytes * 8);           /* 34 - bits per sample */
+  writeString(file, "data");                   /* 36 - data */
+  file->dataSizeOffset = file->bytesWritten;
+  writeInt(file, size); /* 40 - how big is this data chunk */
+}
 
-  expectString(file, "RIFF");
-  data = readInt(file);          /* 04 - how big is the rest of this file? */
-  expectString(file, "WAVE");    /* 08 - WAVE */
-  expectString(file, "fmt ");    /* 12 - fmt */
-  int chunkSize = readInt(file); /* 16 or 18 - size of this chunk */
-  if (chunkSize != 16 && chunkSize != 18) {
-    fprintf(stderr, "Only basic wave files are supported\n");
+/* Read the fmt chunk of the wave file, which is chunkSize bytes long.  Return
+   0 if the format is not supported. */
+static int readFormat(waveFile file, unsigned long chunkSize) {
+  int tag, bits;
+
+  if (chunkSize < 16) {
+    fprintf(stderr, "Invalid wave file format chunk\n");
     return 0;
   }
-  data = readShort(file); /* 20 - what is the audio format? 1 for PCM = Pulse
-                             Code Modulation */
-  if (data != 1) {
-    fprintf(stderr, "Only PCM wave files are supported\n");
-    return 0;
+  tag = readShort(file);
+  file->numChannels = readShort(file);
+  file->sampleRate = readInt(file);
+  readInt(file);   /* bytes per second */
+  readShort(file); /* bytes per frame */
+  bits = readShort(file);
+  chunkSize -= 16;
+  if (tag == WAVE_TAG_EXTENSIBLE && chunkSize >= 24) {
+    readShort(file); /* size of the extension */
+    readShort(file); /* valid bits per sample */
+    readInt(file);   /* speaker positions of the channels */
+    tag = readShort(file); /* the rest of the format GUID is fixed */
+    chunkSize -= 10;
   }
-  file->numChannels =
-      readShort(file); /* 22 - mono or stereo? 1 or 2?  (or 5 or ???) */
-  file->sampleRate =
-      readInt(file); /* 24 - samples per second (numbers per second) */
-  readInt(file);     /* 28 - bytes per second */
-  readShort(file);   /* 32 - # of bytes in one sample, for all channels */
-  data = readShort(
-      file); /* 34 - how many bits in a sample(number)?  usually 16 or 24 */
-  if (data != 16) {
-    fprintf(stderr, "Only 16 bit PCM wave files are supported\n");
+  skipBytes(file, chunkSize + (chunkSize & 1));
+  if (tag == WAVE_TAG_PCM && bits == 16) {
+    file->format = WAVE_PCM16;
+  } else if (tag == WAVE_TAG_PCM && bits == 24) {
+    file->format = WAVE_PCM24;
+  } else if (tag == WAVE_TAG_FLOAT && bits == 32) {
+    file->format = WAVE_FLOAT32;
+  } else {
+    fprintf(stderr,
+            "Only 16 and 24 bit PCM and 32 bit float wave files are "
+            "supported\n");
     return 0;
   }
-  if (chunkSize == 18) { /* ffmpeg writes 18, and so has 2 extra bytes here */
-    data = readShort(file);
+  if (file->numChannels < 1) {
+    fprintf(stderr, "Invalid number of channels\n");
+    return 0;
   }
-  expectString(file, "data"); /* 36 - data */
-  readInt(file);              /* 40 - how big is this data chunk */
   return 1;
 }
 
+/* Read the header of the wave file, up to the start of the samples.  Chunks
+   other than fmt and data are skipped. */
+static int readHeader(waveFile file) {
+  char chunkId[5];
+  unsigned long chunkSize;
+  int haveFormat = 0;
+
+  expectString(file, "RIFF");
+  readInt(file); /* 04 - how big is the rest of this file? */
+  expectString(file, "WAVE");
+  chunkId[4] = '\0';
+  while (!file->failed) {
+    readExactBytes(file, chunkId, 4);
+    chunkSize = readInt(file);
+    if (file->failed) {
+      break;
+    }
+    if (!strcmp(chunkId, "fmt ")) {
+      if (!readFormat(file, chunkSize)) {
+        return 0;
+      }
+      haveFormat = 1;
+    } else if (!strcmp(chunkId, "data")) {
+      if (!haveFormat) {
+        fprintf(stderr, "Wave file has no format chunk\n");
+        return 0;
+      }
+      /* Streamed files have unknown sizes, and unfinished ones have zero. */
+      if (chunkSize == 0 || chunkSize == WAVE_UNKNOWN_SIZE) {
+        file->bytesLeft = -1;
+      } else {
+        file->bytesLeft = chunkSize;
+      }
+      file->dataBytes = file->bytesLeft;
+      file->dataOffset = ftell(file->soundFile);
+      return 1;
+    } else {
+      /* Chunks are padded to an even size. */
+      skipBytes(file, chunkSize + (chunkSize & 1));
+    }
+  }
+  fprintf(stderr, "Wave file has no data chunk\n");
+  return 0;
+}
+
+/* Map the samples after the header into memory, so they can be used without
+   copying or conversion.  This only works for 16-bit files on little endian
+   hosts.  Leave the file unmapped if it cannot be mapped. */
+static void mapSamples(waveFile file) {
+#ifdef WAVE_USE_MMAP
+  struct stat status;
+  long offset = ftell(file->soundFile);
+  int fd = fileno(file->soundFile);
+  long numBytes;
+
+  if (file->format != WAVE_PCM16 || !isLittleEndian() || offset < 0 ||
+      (offset & 1) || fstat(fd, &status) != 0 || !S_ISREG(status.st_mode) ||
+      status.st_size <= offset) {
+    return;
+  }
+  file->mapLength = status.st_size;
+  file->map = mmap(NULL, file->mapLength, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (file->map == MAP_FAILED) {
+    file->map = NULL;
+    return;
+  }
+  posix_madvise(file->map, file->mapLength, POSIX_MADV_SEQUENTIAL);
+  file->mappedSamples = (short*)((char*)file->map + offset);
+  numBytes = status.st_size - offset;
+  if (file->bytesLeft >= 0 && file->bytesLeft < numBytes) {
+    numBytes = file->bytesLeft;
+  }
+  file->numMappedSamples = numBytes / (file->numChannels * sizeof(short));
+#endif  /* WAVE_USE_MMAP */
+}
+
 /* Close the input or output file and free the waveFile. */
 static void closeFile(waveFile file) {
   FILE* soundFile = file->soundFile;
 
+#ifdef WAVE_USE_MMAP
+  if (file->map != NULL) {
+    munmap(file->map, file->mapLength);
+  }
+#endif  /* WAVE_USE_MMAP */
   if (soundFile != NULL) {
     fclose(soundFile);
     file->soundFile = NULL;
@@ -210,12 +476,18 @@ static void closeFile(waveFile file) {
   free(file);
 }
 
-/* Open a 16-bit little-endian wav file for reading.  It may be mono or stereo.
- */
+/* Open a wav file for reading, or standard input if fileName is "-".  It may
+   have any number of channels, and the samples may be 16 or 24 bit PCM or 32
+   bit float. */
 waveFile openInputWaveFile(char* fileName, int* sampleRate, int* numChannels) {
   waveFile file;
-  FILE* soundFile = fopen(fileName, "rb");
+  FILE* soundFile;
 
+  if (!strcmp(fileName, "-")) {
+    soundFile = stdin;
+  } else {
+    soundFile = fopen(fileName, "rb");
+  }
   if (soundFile == NULL) {
     fprintf(stderr, "Unable to open wave file %s for reading\n", fileName);
     return NULL;
@@ -223,30 +495,49 @@ waveFile openInputWaveFile(char* fileName, int* sampleRate, int* numChannels) {
   file = (waveFile)calloc(1, sizeof(struct waveFileStruct));
   file->soundFile = soundFile;
   file->isInput = 1;
-  if (!readHeader(file)) {
+  if (!readHeader(file) || file->failed) {
     closeFile(file);
     return NULL;
   }
+  mapSamples(file);
+  if (file->map == NULL) {
+    setvbuf(soundFile, NULL, _IOFBF, WAVE_STDIO_BUF_LEN);
+  }
   *sampleRate = file->sampleRate;
   *numChannels = file->numChannels;
   return file;
 }
 
-/* Open a 16-bit little-endian wav file for writing.  It may be mono or stereo.
- */
+/* Open a 16-bit wav file for writing.  It may be mono or stereo. */
 waveFile openOutputWaveFile(char* fileName, int sampleRate, int numChannels) {
+  return openOutputWaveFileWithFormat(fileName, sampleRate, numChannels,
+                                      WAVE_PCM16);
+}
+
+/* Open a wav file for writing samples in the given format, or standard output
+   if fileName is "-". */
+waveFile openOutputWaveFileWithFormat(char* fileName, int sampleRate,
+                                      int numChannels, int format) {
   waveFile file;
-  FILE* soundFile = fopen(fileName, "wb");
+  FILE* soundFile;
 
+  if (!strcmp(fileName, "-")) {
+    soundFile = stdout;
+  } else {
+    soundFile = fopen(fileName, "wb");
+  }
   if (soundFile == NULL) {
     fprintf(stderr, "Unable to open wave file %s for writing\n", fileName);
     return NULL;
   }
+  setvbuf(soundFile, NULL, _IOFBF, WAVE_STDIO_BUF_LEN);
   file = (waveFile)calloc(1, sizeof(struct waveFileStruct));
   file->soundFile = soundFile;
   file->sampleRate = sampleRate;
   file->numChannels = numChannels;
-  writeHeader(file, sampleRate, numChannels);
+  file->format = format;
+  file->isSeekable = fseek(soundFile, 0, SEEK_CUR) == 0;
+  writeHeader(file, sampleRate, numChannels, format);
   if (file->failed) {
     closeFile(file);
     return NULL;
@@ -254,12 +545,21 @@ waveFile openOutputWaveFile(char* fileName, int sampleRate, int numChannels) {
   return file;
 }
 
+/* Return the sample format of the file. */
+int getWaveFileFormat(waveFile file) { return file->format; }
+
 /* Close the sound file. */
 int closeWaveFile(waveFile file) {
   FILE* soundFile = file->soundFile;
+  unsigned long dataSize;
   int passed = 1;
 
-  if (!file->isInput) {
+  if (!file->isInput && file->isSeekable) {
+    dataSize = file->bytesWritten - file->dataSizeOffset - 4;
+    if (dataSize & 1) {
+      /* Chunks are padded to an even size. */
+      writeBytes(file, "", 1);
+    }
     if (fseek(soundFile, 4, SEEK_SET) != 0) {
       fprintf(stderr, "Failed to seek on input file.\n");
       passed = 0;
@@ -270,59 +570,220 @@ int closeWaveFile(waveFile file) {
         fprintf(stderr, "Failed to write wave file size.\n");
         passed = 0;
       }
-      if (fseek(soundFile, 40, SEEK_SET) != 0) {
+      if (fseek(soundFile, file->dataSizeOffset, SEEK_SET) != 0) {
         fprintf(stderr, "Failed to seek on input file.\n");
         passed = 0;
       } else {
         /* Now update the file to have the correct size. */
-        writeInt(file, file->bytesWritten - 48);
+        writeInt(file, dataSize);
         if (file->failed) {
           fprintf(stderr, "Failed to write wave file size.\n");
           passed = 0;
         }
       }
     }
+  } else if (!file->isInput && fflush(soundFile) != 0) {
+    fprintf(stderr, "Unable to write to output file");
+    passed = 0;
   }
   closeFile(file);
   return passed;
 }
 
-/* Read from the wave file.  Return the number of samples read. */
+/* Return the samples left in a memory mapped input file, and set numSamples
+   to how many there are.  They are then considered read. */
+short* getMappedWaveSamples(waveFile file, int* numSamples) {
+  short* samples;
+
+  if (file->mappedSamples == NULL) {
+    *numSamples = 0;
+    return NULL;
+  }
+  samples = file->mappedSamples + file->mappedSamplePos * file->numChannels;
+  *numSamples = file->numMappedSamples - file->mappedSamplePos;
+  file->mappedSamplePos = file->numMappedSamples;
+  return samples;
+}
+
+/* Read up to maxSamples samples of raw data from the data chunk, but no more
+   than fit in WAVE_BUF_LEN bytes.  Return the number of samples read. */
+static int readSampleBytes(waveFile file, unsigned char* bytes,
+                           int maxSamples) {
+  int frameBytes = file->numChannels * bytesPerSample(file->format);
+  int bytesRead;
+
+  if (maxSamples * frameBytes > WAVE_BUF_LEN) {
+    maxSamples = WAVE_BUF_LEN / frameBytes;
+  }
+  if (file->bytesLeft >= 0 && maxSamples * frameBytes > file->bytesLeft) {
+    maxSamples = file->bytesLeft / frameBytes;
+  }
+  bytesRead = readBytes(file, bytes, maxSamples * frameBytes);
+  if (file->bytesLeft >= 0) {
+    file->bytesLeft -= bytesRead;
+  }
+  file->dataBytesRead += bytesRead;
+  return bytesRead / frameBytes;
+}
+
+/* Read and drop samples until the input reaches sample position, or the end
+   of the data.  Return 0 if position is before the samples already read. */
+static int skipSamples(waveFile file, long position) {
+  long frameBytes = file->numChannels * bytesPerSample(file->format);
+  long numSamples = position - file->dataBytesRead / frameBytes;
+  unsigned char bytes[WAVE_BUF_LEN];
+  int samplesRead;
+
+  if (numSamples < 0) {
+    return 0;
+  }
+  while (numSamples > 0) {
+    samplesRead = readSampleBytes(file, bytes,
+                                  numSamples < WAVE_BUF_LEN ? (int)numSamples
+                                                            : WAVE_BUF_LEN);
+    if (samplesRead == 0) {
+      break;
+    }
+    numSamples -= samplesRead;
+  }
+  return !file->failed;
+}
+
+/* Move an input file to sample position, so the next read starts there.
+   Positions past the end move to the end.  Files that cannot seek, such as
+   pipes, can only move forward, by reading the samples before position.
+   Return 0 if the file cannot move there. */
+int seekWaveFile(waveFile file, long position) {
+  long frameBytes = file->numChannels * bytesPerSample(file->format);
+
+  if (position < 0) {
+    position = 0;
+  }
+  if (file->mappedSamples != NULL) {
+    if (position > file->numMappedSamples) {
+      position = file->numMappedSamples;
+    }
+    file->mappedSamplePos = position;
+    return 1;
+  }
+  if (!file->isInput || file->failed) {
+    return 0;
+  }
+  if (file->dataOffset < 0) {
+    return skipSamples(file, position);
+  }
+  if (file->dataBytes >= 0 && position > file->dataBytes / frameBytes) {
+    position = file->dataBytes / frameBytes;
+  }
+  if (fseek(file->soundFile, file->dataOffset + position * frameBytes,
+            SEEK_SET) != 0) {
+    return 0;
+  }
+  if (file->dataBytes >= 0) {
+    file->bytesLeft = file->dataBytes - position * frameBytes;
+  }
+  file->dataBytesRead = position * frameBytes;
+  return 1;
+}
+
+/* Read from the wave file, converting to 16 bits.  Return the number of
+   samples read. */
 int readFromWaveFile(waveFile file, short* buffer, int maxSamples) {
-  int i, bytesRead, samplesRead;
-  int bytePos = 0;
+  int i, samplesRead;
+  int sampleBytes = bytesPerSample(file->format);
   unsigned char bytes[WAVE_BUF_LEN];
-  short sample;
+  unsigned char* p = bytes;
 
-  if (maxSamples * file->numChannels * 2 > WAVE_BUF_LEN) {
-    maxSamples = WAVE_BUF_LEN / (file->numChannels * 2);
+  if (file->mappedSamples != NULL) {
+    samplesRead = file->numMappedSamples - file->mappedSamplePos;
+    if (samplesRead > maxSamples) {
+      samplesRead = maxSamples;
+    }
+    memcpy(buffer,
+           file->mappedSamples + file->mappedSamplePos * file->numChannels,
+           samplesRead * file->numChannels * sizeof(short));
+    file->mappedSamplePos += samplesRead;
+    return samplesRead;
   }
-  bytesRead = readBytes(file, bytes, maxSamples * file->numChannels * 2);
-  samplesRead = bytesRead / (file->numChannels * 2);
+  samplesRead = readSampleBytes(file, bytes, maxSamples);
   for (i = 0; i < samplesRead * file->numChannels; i++) {
-    sample = bytes[bytePos++];
-    sample |= (unsigned int)bytes[bytePos++] << 8;
-    *buffer++ = sample;
+    *buffer++ = unpackShort(file->format, p);
+    p += sampleBytes;
   }
   return samplesRead;
 }
 
-/* Write to the wave file. */
+/* Read from the wave file, converting to floats from -1 to 1.  Return the
+   number of samples read. */
+int readFloatFromWaveFile(waveFile file, float* buffer, int maxSamples) {
+  int i, samplesRead;
+  int sampleBytes = bytesPerSample(file->format);
+  unsigned char bytes[WAVE_BUF_LEN];
+  unsigned char* p = bytes;
+  short* samples;
+
+  if (file->mappedSamples != NULL) {
+    samplesRead = file->numMappedSamples - file->mappedSamplePos;
+    if (samplesRead > maxSamples) {
+      samplesRead = maxSamples;
+    }
+    samples = file->mappedSamples + file->mappedSamplePos * file->numChannels;
+    for (i = 0; i < samplesRead * file->numChannels; i++) {
+      *buffer++ = *samples++ / 32767.0f;
+    }
+    file->mappedSamplePos += samplesRead;
+    return samplesRead;
+  }
+  samplesRead = readSampleBytes(file, bytes, maxSamples);
+  for (i = 0; i < samplesRead * file->numChannels; i++) {
+    *buffer++ = unpackFloat(file->format, p);
+    p += sampleBytes;
+  }
+  return samplesRead;
+}
+
+/* Write to the wave file, converting from 16 bits. */
 int writeToWaveFile(waveFile file, short* buffer, int numSamples) {
   int i;
   int bytePos = 0;
+  int sampleBytes = bytesPerSample(file->format);
+  unsigned char bytes[WAVE_BUF_LEN];
+  int total = numSamples * file->numChannels;
+
+  if (file->format == WAVE_PCM16 && isLittleEndian()) {
+    /* The samples are already in the file's byte order. */
+    writeBytes(file, buffer, total * sizeof(short));
+    return file->failed;
+  }
+  for (i = 0; i < total; i++) {
+    if (bytePos + sampleBytes > WAVE_BUF_LEN) {
+      writeBytes(file, bytes, bytePos);
+      bytePos = 0;
+    }
+    packShort(file->format, buffer[i], bytes + bytePos);
+    bytePos += sampleBytes;
+  }
+  if (bytePos != 0) {
+    writeBytes(file, bytes, bytePos);
+  }
+  return file->failed;
+}
+
+/* Write floats from -1 to 1 to the wave file. */
+int writeFloatToWaveFile(waveFile file, float* buffer, int numSamples) {
+  int i;
+  int bytePos = 0;
+  int sampleBytes = bytesPerSample(file->format);
   unsigned char bytes[WAVE_BUF_LEN];
-  short sample;
   int total = numSamples * file->numChannels;
 
   for (i = 0; i < total; i++) {
-    if (bytePos == WAVE_BUF_LEN) {
+    if (bytePos + sampleBytes > WAVE_BUF_LEN) {
       writeBytes(file, bytes, bytePos);
       bytePos = 0;
     }
-    sample = buffer[i];
-    bytes[bytePos++] = sample;
-    bytes[bytePos++] = sample >> 8;
+    packFloat(file->format, buffer[i], bytes + bytePos);
+    bytePos += sampleBytes;
   }
   if (bytePos != 0) {
     writeBytes(file, bytes, bytePos);
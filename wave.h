@@ -7,10 +7,34 @@
 
 /* Support for reading and writing wave files. */
 
+/* Sample formats of wave files. */
+#define WAVE_PCM16 0
+#define WAVE_PCM24 1
+#define WAVE_FLOAT32 2
+
 typedef struct waveFileStruct* waveFile;
 
+/* Use "-" as the file name for standard input or output.  Output to a pipe is
+   written with unknown chunk sizes, which most readers take to mean the data
+   goes on until the end of the file. */
 waveFile openInputWaveFile(char* fileName, int* sampleRate, int* numChannels);
 waveFile openOutputWaveFile(char* fileName, int sampleRate, int numChannels);
+waveFile openOutputWaveFileWithFormat(char* fileName, int sampleRate,
+                                      int numChannels, int format);
+int getWaveFileFormat(waveFile file);
 int closeWaveFile(waveFile file);
+/* Samples are converted to and from the file's format as needed.  Float
+   samples range from -1 to 1. */
 int readFromWaveFile(waveFile file, short* buffer, int maxSamples);
+int readFloatFromWaveFile(waveFile file, float* buffer, int maxSamples);
+/* Move an input file to a sample position.  Pipes can only move forward.
+   Return 0 if the file cannot move there. */
+int seekWaveFile(waveFile file, long position);
 int writeToWaveFile(waveFile file, short* buffer, int numSamples);
+int writeFloatToWaveFile(waveFile file, float* buffer, int numSamples);
+/* Input files are memory mapped when the host allows it.  Return the samples
+   left to read in a mapped file without copying them, and set numSamples to
+   how many there are.  They stay valid until the file is closed, and are then
+   considered read.  Return NULL if the file is not mapped, in which case use
+   readFromWaveFile. */
+short* getMappedWaveSamples(waveFile file, int* numSamples);